@@ -32,10 +32,18 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+# include <linux/net_tstamp.h>
+#endif
 
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#ifdef __linux__
+# include <netinet/udp.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -50,21 +58,23 @@
 #include "logger.h"
 #include "mdns.h"
 #include "misc.h"
+#include "evthr.h"
 // #include "player.h"
 #include "db.h"
 #include "artwork.h"
 // #include "dmap_common.h"
 #include "rtp_common.h"
-#include "transcode.h"
+#include "alac.h"
 #include "outputs.h"
 #include "airplay.h"
 
 #include "airplay_events.h"
+#include "airplay_ptp.h"
+#include "airplay_uring.h"
 #include "pair_ap/pair.h"
 
 /* List of TODO's for AirPlay 2
  *
- * inplace encryption
  * latency needs different handling
  * support ipv6, e.g. in SETPEERS
  *
@@ -87,12 +97,139 @@
 
 #define AIRPLAY_RTP_PAYLOADTYPE                 0x60
 
+// Buffered audio (stream type 103) is for receivers with SupportsBufferedAudio.
+// It goes over TCP, so there are no retransmits or sync packets, and the
+// receiver plays according to the anchor set with SETRATEANCHORTIME. Since the
+// anchor is in the PTP timeline we only use it with PTP. Packets are written in
+// batches to keep the number of syscalls down.
+#define AIRPLAY_RTP_PAYLOADTYPE_BUFFERED        103
+#define AIRPLAY_BUFFERED_AUDIO_SIZE             (8 * 1024 * 1024)
+#define AIRPLAY_BUFFERED_BATCH_PACKETS          32
+// If the receiver stops reading we give up when this much is pending
+#define AIRPLAY_BUFFERED_PENDING_MAX            (4 * 1024 * 1024)
+// The player is paced in real time, so a buffered receiver normally gets the
+// audio the output buffer's duration before playing it. With the airplay_shared
+// "buffered_lookahead_ms" setting the anchor is moved that much later, so the
+// receiver holds more audio and rides out longer network stalls. The cost is
+// the same amount of extra delay before playback starts, and the look-ahead
+// must fit in AIRPLAY_BUFFERED_AUDIO_SIZE.
+#define AIRPLAY_BUFFERED_LOOKAHEAD_MAX_MS       30000
+
 // For transient pairing the key_len will be 64 bytes, but only 32 are used for
 // audio payload encryption. For normal pairing the key is 32 bytes.
 #define AIRPLAY_AUDIO_KEY_LEN 32
 
-// How many RTP packets keep in a buffer for retransmission
-#define AIRPLAY_PACKET_BUFFER_SIZE    1000
+// Encrypted audio packets have the Poly1305 auth tag and the last 8 bytes of
+// the 12 byte ChaCha20 nonce appended after the payload
+#define AIRPLAY_AUTHTAG_LEN           16
+#define AIRPLAY_NONCE_LEN             12
+#define AIRPLAY_NONCE_OFFSET          4
+#define AIRPLAY_PACKET_TAILROOM       (AIRPLAY_AUTHTAG_LEN + AIRPLAY_NONCE_LEN - AIRPLAY_NONCE_OFFSET)
+
+// RFC 2198 redundant audio, opt-in with the "redundancy" setting for receivers
+// with SupportsRFC2198Redundancy. Each packet also carries the previous ALAC
+// frames, so a single lost packet doesn't need a retransmit. The previous
+// frames are only added while the packet stays below the MTU, so it works best
+// with small frames.
+#define AIRPLAY_RTP_PAYLOADTYPE_RED   0x61
+#define AIRPLAY_RED_PAYLOAD_MAX       (1400 - AIRPLAY_PACKET_TAILROOM)
+
+// The redundancy self test sends this many packets (about 46 sec) through a
+// simulated lossy link for each depth up to AIRPLAY_SELFTEST_RED_DEPTH_MAX
+#define AIRPLAY_SELFTEST_PACKETS      6000
+#define AIRPLAY_SELFTEST_RED_DEPTH_MAX 2
+
+// How much audio (in ms) to keep in a buffer for retransmission, can be changed
+// with the airplay_shared "retransmit_buffer_ms" setting. The buffer must hold
+// at least a couple of send batches, see below.
+#define AIRPLAY_PACKET_BUFFER_MS      8000
+#define AIRPLAY_PACKET_BUFFER_MIN     (2 * AIRPLAY_SEND_BATCH_SIZE)
+
+// Audio and sync packets for all sessions are collected during a write. Audio
+// is then sent with one sendmmsg() per session on the session's connected data
+// socket, and sync packets with one sendmmsg() on the control socket. The batch
+// must be smaller than the packet buffer, since it references the encrypted
+// packet slots.
+#if defined(__linux__) || defined(__FreeBSD__)
+# define AIRPLAY_USE_SENDMMSG         1
+#else
+# define AIRPLAY_USE_SENDMMSG         0
+#endif
+#define AIRPLAY_SEND_BATCH_SIZE       256
+#define AIRPLAY_SEND_BATCH_COPY_LEN   32
+
+// With UDP GSO (Linux 4.18+) consecutive audio packets for the same device are
+// passed to the kernel as one large datagram that is split in segment size
+// packets. Enabled with the airplay_shared "udp_gso" setting.
+#if AIRPLAY_USE_SENDMMSG && defined(__linux__)
+# define AIRPLAY_USE_UDP_GSO          1
+# ifndef UDP_SEGMENT
+#  define UDP_SEGMENT                 103
+# endif
+#else
+# define AIRPLAY_USE_UDP_GSO          0
+#endif
+#define AIRPLAY_GSO_SEGMENTS_MAX      64
+#define AIRPLAY_GSO_BYTES_MAX         65000
+// Only runs of equal size datagrams can be merged. Verbatim ALAC frames only
+// vary in size when a frame is short, so with GSO the frames of a write are
+// zero padded to the largest in their run, as long as the padding is at most
+// 1/PAD_RATIO of the run's payload. Compressed frames are not padded, since no
+// receiver has been tested with data after the end tag.
+#define AIRPLAY_GSO_PAD_RATIO         8
+
+// Timing and retransmit requests are read with recvmmsg(), so that one wakeup
+// handles all the requests that are waiting, and timing replies go back with
+// one sendmmsg(). A flood is handled over several wakeups, with at most
+// ROUNDS_MAX batches per wakeup. The buffers are larger than any request, so
+// that oversized datagrams can be detected.
+#define AIRPLAY_RECV_BATCH_SIZE       32
+#define AIRPLAY_RECV_ROUNDS_MAX       4
+#define AIRPLAY_RECV_PACKET_LEN       64
+#define AIRPLAY_TIMING_PACKET_LEN     32
+
+// With the airplay_shared "paced_send" setting each audio packet gets a
+// departure time, so that a write's packets are spread out instead of leaving
+// in a burst that overflows the buffers of access points. With SO_TXTIME
+// (Linux 4.19+, needs the fq qdisc on the interface) the kernel does the
+// pacing, otherwise packets are held back and sent by a timer. GSO is not used
+// when pacing, since a GSO message leaves as one burst.
+#if AIRPLAY_USE_SENDMMSG && defined(SO_TXTIME)
+# define AIRPLAY_USE_SO_TXTIME        1
+#else
+# define AIRPLAY_USE_SO_TXTIME        0
+#endif
+// Packets are never scheduled more than this far ahead
+#define AIRPLAY_PACING_AHEAD_MAX_MS   500
+// With timer pacing, packets due within this many ms are sent right away
+#define AIRPLAY_PACING_SLACK_MS       2
+
+// Retransmit requests from a device are collected for a few ms, so that
+// overlapping ranges are merged and sent once. Packets resent less than
+// SUPPRESS_MS ago are not sent again, and each device has a token bucket
+// (packets per second and burst) so that one broken receiver can't keep the
+// player thread busy. A second of 44.1 kHz audio is about 125 packets.
+#define AIRPLAY_RESEND_COALESCE_MS    5
+#define AIRPLAY_RESEND_SUPPRESS_MS    50
+#define AIRPLAY_RESEND_RANGES_MAX     8
+#define AIRPLAY_RESEND_RATE           500
+#define AIRPLAY_RESEND_BURST          250
+
+// Each quality (master session) is encoded on its own thread. To make sure the
+// encoded packets are still in the retransmit buffer when they are sent, at
+// most half the buffer is encoded before sending.
+#define AIRPLAY_ENCODE_THREADS        2
+#define AIRPLAY_ENCODE_PACKETS_MAX(rms) ((rms)->rtp_session->pktbuf_size / 2)
+
+// With the airplay_shared "io_uring" setting, audio and sync packets are sent
+// through io_uring instead of sendmmsg(), see airplay_uring.c. Each encrypted
+// packet ring (per session, or per master session with a group stream key) is
+// registered as a buffer.
+#define AIRPLAY_URING_ENTRIES         (2 * AIRPLAY_SEND_BATCH_SIZE)
+#define AIRPLAY_URING_BUFFERS_MAX     64
+
+// Initial size hint for the session indexes, they grow as needed
+#define AIRPLAY_SESSIONS_INDEX_SIZE   64
 
 #define AIRPLAY_MD_DELAY_STARTUP      15360
 #define AIRPLAY_MD_DELAY_SWITCH       (AIRPLAY_MD_DELAY_STARTUP * 2)
@@ -156,6 +293,8 @@ enum airplay_seq_type
   AIRPLAY_SEQ_PAIR_VERIFY,
   AIRPLAY_SEQ_PAIR_TRANSIENT,
   AIRPLAY_SEQ_FEEDBACK,
+  AIRPLAY_SEQ_SETUP_STREAM,
+  AIRPLAY_SEQ_SEND_ANCHOR,
   AIRPLAY_SEQ_CONTINUE, // Must be last element
 };
 
@@ -179,14 +318,48 @@ enum airplay_status_flags
   AIRPLAY_FLAG_RECEIVER_IS_BUSY               = (1 << 17),
 };
 
+// Ring of encrypted packets, indexed like the packet buffer of the master
+// session's RTP session. Packets are encrypted into the slots, so in steady
+// state sending does not allocate, and retransmits don't need to encrypt
+// again (the nonce is the seqnum, so the ciphertext is always the same).
+// The slots are in one arena, like the RTP packet buffer, which is
+// registered with io_uring if that is used.
+struct airplay_encrypted_ring
+{
+  struct rtp_packet *pktbuf;
+  size_t pktbuf_size;
+  uint8_t *arena;
+  size_t arena_size;
+  int uring_buf_index;
+};
+
 struct airplay_master_session
 {
+  // Holds input that doesn't make up a whole packet, and is completed with the
+  // next write
   struct evbuffer *input_buffer;
   int input_buffer_samples;
 
-  // ALAC encoder and buffer for encoded data
-  struct encode_ctx *encode_ctx;
-  struct evbuffer *encoded_buffer;
+  // The part of the player's buffer that we haven't consumed yet. Only valid
+  // during airplay_write(), packets are encoded straight from here.
+  const uint8_t *input_direct;
+  size_t input_direct_len;
+
+  // MEDIA_FORMAT_ALAC or MEDIA_FORMAT_PCM (big endian LPCM, no encoder)
+  enum media_format format;
+
+  // ALAC encoder, keeps predictor state between packets
+  struct alac_encoder *alac_encoder;
+  // Only verbatim frames, so they are all the same size, unless short
+  bool alac_uncompressed;
+
+  // Number of previous frames to add as RFC 2198 redundant blocks, 0 if off.
+  // The frame is encoded to red_primary first, since its length decides how
+  // many previous frames fit in the packet.
+  int red_depth;
+  uint8_t *red_primary;
+  uint64_t red_packets;
+  uint64_t red_packets_covered;
 
   struct rtp_session *rtp_session;
 
@@ -196,16 +369,39 @@ struct airplay_master_session
   size_t rawbuf_size;
   int samples_per_packet;
 
+  // Packets encoded in the current write, waiting to be sent
+  size_t encoded_first;
+  int encoded_len;
+
   struct media_quality quality;
 
+  // With the airplay_shared "group_stream_key" setting, the master session
+  // makes a stream key that is given as shk to all its realtime sessions, so
+  // each packet is encrypted once, into a ring that the sessions share
+  bool group_key;
+  uint8_t stream_key[AIRPLAY_AUDIO_KEY_LEN];
+  gcry_cipher_hd_t packet_cipher_hd;
+  struct airplay_encrypted_ring encrypted;
+  uint64_t encrypted_shared;
+  uint64_t encrypted_total;
+
   // Number of samples that we tell the output to buffer (this will mean that
   // the position that we send in the sync packages are offset by this amount
   // compared to the rtptimes of the corresponding RTP packages we are sending)
   int output_buffer_samples;
 
+  // Number of sessions attached, the master session is freed when it drops to 0
+  int sessions_count;
+
   struct airplay_master_session *next;
 };
 
+struct airplay_resend_range
+{
+  uint16_t seqnum;
+  uint16_t len;
+};
+
 struct airplay_session
 {
   uint64_t device_id;
@@ -223,6 +419,21 @@ struct airplay_session
   uint16_t wanted_metadata;
   bool req_has_auth;
   bool supports_auth_setup;
+  // Receiver supports PTP and we can be master, set during SETUP (session)
+  bool supports_ptp;
+  bool timing_ptp;
+  // Buffered audio, see AIRPLAY_RTP_PAYLOADTYPE_BUFFERED. Decided when the
+  // SETUP (session) reply has settled the timing, and then server_fd is a TCP
+  // connection.
+  bool supports_buffered_audio;
+  bool buffered;
+  int buffered_lookahead_ms;
+  // Wanted number of redundant frames per packet, see AIRPLAY_RTP_PAYLOADTYPE_RED
+  int redundancy;
+  enum output_resampler resampler;
+  struct evbuffer *buffered_out;
+  struct event *buffered_ev;
+  int buffered_pending;
 
   struct event *deferredev;
 
@@ -262,11 +473,34 @@ struct airplay_session
 
   gcry_cipher_hd_t packet_cipher_hd;
 
+  // Own ring of encrypted packets. If group_key is set (during SETUP) the
+  // device was given the master session's stream key, and this ring is only
+  // used for packets that are not the same for all devices, see session_ring()
+  struct airplay_encrypted_ring encrypted;
+  bool group_key;
+  uint64_t resend_cache_hits;
+  uint64_t resend_cache_misses;
+
+  // Retransmit scheduler, see resend_request_add(). resend_sent_ms has the
+  // time each slot of the master session's packet ring was last resent, so it
+  // has resend_sent_size elements.
+  struct event *resend_timer;
+  struct airplay_resend_range resend_ranges[AIRPLAY_RESEND_RANGES_MAX];
+  int resend_nranges;
+  uint64_t *resend_sent_ms;
+  size_t resend_sent_size;
+  double resend_tokens;
+  uint64_t resend_refill_ms;
+  struct airplay_resend_stats resend_stats;
+
   int server_fd;
+  // SO_TXTIME is enabled on server_fd, see AIRPLAY_USE_SO_TXTIME
+  bool so_txtime;
 
   struct airplay_service *timing_svc;
   struct airplay_service *control_svc;
 
+  struct airplay_session *prev;
   struct airplay_session *next;
 };
 
@@ -284,6 +518,86 @@ struct airplay_service
   struct event *ev;
 };
 
+struct airplay_send_batch
+{
+  int len;
+  struct airplay_session *session[AIRPLAY_SEND_BATCH_SIZE];
+  union net_sockaddr addr[AIRPLAY_SEND_BATCH_SIZE];
+  struct iovec iov[AIRPLAY_SEND_BATCH_SIZE];
+#if AIRPLAY_USE_SENDMMSG
+  // For each message the index of its (first) packet in the batch
+  struct mmsghdr msgs[AIRPLAY_SEND_BATCH_SIZE];
+  int msg_first[AIRPLAY_SEND_BATCH_SIZE];
+#endif
+  // Departure time (CLOCK_MONOTONIC ns) of each packet, 0 is right away
+  uint64_t txtime[AIRPLAY_SEND_BATCH_SIZE];
+#if AIRPLAY_USE_SO_TXTIME
+  uint8_t txtime_control[AIRPLAY_SEND_BATCH_SIZE][CMSG_SPACE(sizeof(uint64_t))];
+#endif
+  // Storage for small packets whose source buffer may change before the batch
+  // is sent, e.g. sync packets. io_uring copies them again, so the batch can be
+  // reused while they are in flight (AIRPLAY_URING_COPY_LEN must not be less).
+  uint8_t copy[AIRPLAY_SEND_BATCH_SIZE][AIRPLAY_SEND_BATCH_COPY_LEN];
+#if AIRPLAY_USE_UDP_GSO
+  // The iov's reordered so that each device's packets are contiguous, and the
+  // cmsg of each message
+  struct iovec gso_iov[AIRPLAY_SEND_BATCH_SIZE];
+  uint8_t gso_control[AIRPLAY_SEND_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+};
+
+struct airplay_recv_batch
+{
+  int len;
+  int pkt_len[AIRPLAY_RECV_BATCH_SIZE];
+  union net_sockaddr addr[AIRPLAY_RECV_BATCH_SIZE];
+  uint8_t buf[AIRPLAY_RECV_BATCH_SIZE][AIRPLAY_RECV_PACKET_LEN];
+  uint8_t control[AIRPLAY_RECV_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct timeval))];
+  struct iovec iov[AIRPLAY_RECV_BATCH_SIZE];
+#if AIRPLAY_USE_SENDMMSG
+  struct mmsghdr msgs[AIRPLAY_RECV_BATCH_SIZE];
+#else
+  struct msghdr msgs[AIRPLAY_RECV_BATCH_SIZE];
+#endif
+  // Timing replies, each for the request with index reply_to[]
+  int replies_len;
+  int reply_to[AIRPLAY_RECV_BATCH_SIZE];
+  struct timespec reply_recv_ts[AIRPLAY_RECV_BATCH_SIZE];
+  uint8_t replies[AIRPLAY_RECV_BATCH_SIZE][AIRPLAY_TIMING_PACKET_LEN];
+  struct iovec replies_iov[AIRPLAY_RECV_BATCH_SIZE];
+#if AIRPLAY_USE_SENDMMSG
+  struct mmsghdr replies_msgs[AIRPLAY_RECV_BATCH_SIZE];
+#endif
+};
+
+struct airplay_encode_barrier
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int pending;
+};
+
+struct airplay_send_stats
+{
+  uint64_t packets;
+  uint64_t syscalls;
+  uint64_t flushes;
+  uint64_t flush_nsec;
+  // GSO messages sent and ALAC padding added for them
+  uint64_t gso_msgs;
+  uint64_t gso_padding;
+};
+
+struct airplay_timing_stats
+{
+  uint64_t batches;
+  uint64_t replies;
+  uint64_t kernel_stamps;
+  // Time from the request arriving until the reply is handed to the kernel
+  uint64_t latency_nsec;
+  uint64_t latency_nsec_max;
+};
+
 /* NTP timestamp definitions */
 #define FRAC             4294967296. /* 2^32 as a double */
 #define NTP_EPOCH_DELTA  0x83aa7e80  /* 2208988800 - that's 1970 - 1900 in seconds */
@@ -404,11 +718,47 @@ static struct media_quality airplay_quality_default =
 /* From player.c */
 extern struct event_base *evbase_player;
 
-/* AirTunes v2 time synchronization */
+/* AirTunes v2 time synchronization, served by its own thread so that replies
+ * don't have to wait for encoding in the player thread
+ */
 static struct airplay_service airplay_timing_svc;
+static struct event_base *evbase_timing;
+static pthread_t tid_timing;
+static struct airplay_timing_stats airplay_timing_stats;
+static struct airplay_recv_batch airplay_timing_recv;
 
 /* AirTunes v2 playback synchronization / control */
 static struct airplay_service airplay_control_svc;
+static struct airplay_resend_stats airplay_resend_stats;
+static struct airplay_recv_batch airplay_control_recv;
+
+/* Audio and sync packets collected during airplay_write() */
+static struct airplay_send_batch airplay_data_batch;
+static struct airplay_send_batch airplay_sync_batch;
+
+/* Worker threads for encoding, and the barrier for waiting on them */
+static struct evthr_pool *airplay_encode_pool;
+static struct airplay_encode_barrier airplay_encode_barrier =
+{
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* If audio should be sent with UDP GSO, and counters for comparing send modes */
+static bool airplay_udp_gso;
+static struct airplay_send_stats airplay_send_stats;
+
+/* Pacing of audio packets, see AIRPLAY_USE_SO_TXTIME */
+enum airplay_pacing
+{
+  AIRPLAY_PACING_OFF,
+  AIRPLAY_PACING_TXTIME,
+  AIRPLAY_PACING_TIMER,
+};
+static enum airplay_pacing airplay_pacing;
+static struct event *airplay_pacing_timer;
+// Packets held back by timer pacing are moved here when they are due
+static struct airplay_send_batch airplay_data_due_batch;
 
 /* Metadata */
 static struct output_metadata *airplay_cur_metadata;
@@ -421,6 +771,11 @@ static struct timeval keep_alive_tv = { AIRPLAY_KEEP_ALIVE_INTERVAL, 0 };
 static struct airplay_master_session *airplay_master_sessions;
 static struct airplay_session *airplay_sessions;
 
+// Indexes of airplay_sessions by peer address and by device id, so lookups for
+// e.g. retransmit requests don't have to walk the list
+static struct hashidx airplay_sessions_by_addr;
+static struct hashidx airplay_sessions_by_device;
+
 /* Our own device ID */
 static uint64_t airplay_device_id;
 
@@ -431,32 +786,71 @@ static void
 sequence_start(enum airplay_seq_type seq_type, struct airplay_session *rs, void *arg, const char *log_caller);
 static void
 sequence_continue(struct airplay_seq_ctx *seq_ctx);
+static void
+send_batch_session_remove(struct airplay_send_batch *batch, struct airplay_session *rs);
+static void
+resend_timer_cb(int fd, short what, void *arg);
 
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
 
-static inline int
-alac_encode(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, uint8_t *rawbuf, size_t rawbuf_size, int nsamples, struct media_quality *quality)
+static enum output_resampler
+resampler_from_string(const char *name, const char *devname)
 {
-  transcode_frame *frame;
-  int len;
+  if (strcasecmp(name, "balanced") == 0)
+    return OUTPUT_RESAMPLER_BALANCED;
+  if (strcasecmp(name, "fast") == 0)
+    return OUTPUT_RESAMPLER_FAST;
+  if (strcasecmp(name, "best") == 0)
+    return OUTPUT_RESAMPLER_BEST;
+  if (strcasecmp(name, "ffmpeg") == 0)
+    return OUTPUT_RESAMPLER_FFMPEG;
+
+  DPRINTF(E_LOG, L_AIRPLAY, "Unknown resampler '%s' for '%s', using 'balanced'\n", name, devname);
+  return OUTPUT_RESAMPLER_BALANCED;
+}
+
+// Returns the audioFormat bit for the SETUP request, see
+// https://openairplay.github.io/airplay-spec/audio/rtsp_requests/setup.html
+static uint64_t
+audio_format_get(enum media_format format, struct media_quality *quality)
+{
+  int bit;
+
+  if (quality->channels != 1 && quality->channels != 2)
+    return 0;
 
-  frame = transcode_frame_new(rawbuf, rawbuf_size, nsamples, quality);
-  if (!frame)
+  if (format == MEDIA_FORMAT_ALAC)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not convert raw PCM to frame (bufsize=%zu)\n", rawbuf_size);
-      return -1;
+      if (quality->channels != 2)
+	return 0;
+      if (quality->sample_rate == 44100)
+	bit = (quality->bits_per_sample == 16) ? 18 : 19;
+      else if (quality->sample_rate == 48000)
+	bit = (quality->bits_per_sample == 16) ? 20 : 21;
+      else
+	return 0;
     }
-
-  len = transcode_encode(evbuf, encode_ctx, frame, 0);
-  transcode_frame_free(frame);
-  if (len < 0)
+  else if (format == MEDIA_FORMAT_PCM)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not ALAC encode frame\n");
-      return -1;
+      // PCM/44100/16/1 is bit 10, then 24 bit and then the same for 48000
+      if (quality->sample_rate == 44100)
+	bit = 10;
+      else if (quality->sample_rate == 48000)
+	bit = 14;
+      else
+	return 0;
+
+      bit += (quality->bits_per_sample == 24) ? 2 : 0;
+      bit += quality->channels - 1;
     }
+  else
+    return 0;
+
+  if (quality->bits_per_sample != 16 && quality->bits_per_sample != 24)
+    return 0;
 
-  return len;
+  return (uint64_t)1 << bit;
 }
 
 // AirTunes v2 time synchronization helpers
@@ -1048,38 +1442,60 @@ session_status(struct airplay_session *rs)
   rs->callback_id = -1;
 }
 
+static void
+encrypted_ring_free(struct airplay_encrypted_ring *ring)
+{
+  // Sends may still be using the arena
+  if (ring->uring_buf_index >= 0)
+    airplay_uring_buffer_unregister(ring->uring_buf_index);
+  else
+    airplay_uring_drain();
+  free(ring->arena);
+  free(ring->pktbuf);
+}
+
 static void
 master_session_free(struct airplay_master_session *rms)
 {
   if (!rms)
     return;
 
-  outputs_quality_unsubscribe(&rms->rtp_session->quality);
-  rtp_session_free(rms->rtp_session);
+  if (rms->rtp_session)
+    {
+      outputs_quality_unsubscribe(&rms->rtp_session->quality);
+      rtp_session_free(rms->rtp_session);
+    }
+
+  alac_encoder_free(rms->alac_encoder);
 
-  transcode_encode_cleanup(&rms->encode_ctx);
+  if (rms->red_packets > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Redundant audio (depth %d): %" PRIu64 " of %" PRIu64 " packets carried previous frames\n",
+      rms->red_depth, rms->red_packets_covered, rms->red_packets);
+  free(rms->red_primary);
+
+  if (rms->encrypted_total > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Group stream key: %" PRIu64 " of %" PRIu64 " packet sends reused an encrypted packet\n",
+      rms->encrypted_shared, rms->encrypted_total);
+  chacha_close(rms->packet_cipher_hd);
+  encrypted_ring_free(&rms->encrypted);
 
   if (rms->input_buffer)
     evbuffer_free(rms->input_buffer);
-  if (rms->encoded_buffer)
-    evbuffer_free(rms->encoded_buffer);
 
   free(rms->rawbuf);
   free(rms);
 }
 
+// Call when a session detaches from the master session
 static void
 master_session_cleanup(struct airplay_master_session *rms)
 {
   struct airplay_master_session *s;
-  struct airplay_session *rs;
 
   // First check if any other session is using the master session
-  for (rs = airplay_sessions; rs; rs=rs->next)
-    {
-      if (rs->master_session == rms)
-	return;
-    }
+  rms->sessions_count--;
+  if (rms->sessions_count > 0)
+    return;
 
   if (rms == airplay_master_sessions)
     airplay_master_sessions = airplay_master_sessions->next;
@@ -1097,66 +1513,107 @@ master_session_cleanup(struct airplay_master_session *rms)
   master_session_free(rms);
 }
 
+// The resampler is set on the quality subscription, so the master sessions
+// with the same quality use the one of the device that was set up last
 static struct airplay_master_session *
-master_session_make(struct media_quality *quality)
+master_session_make(struct media_quality *quality, enum media_format format, int red_depth, enum output_resampler resampler)
 {
   struct airplay_master_session *rms;
-  struct transcode_encode_setup_args encode_args = { .profile = XCODE_ALAC, .quality = quality };
+  cfg_t *cfg_shared;
+  bool uncompressed;
+  bool hugepages;
+  size_t payload_max;
+  int pktbuf_size;
+  int buffer_ms;
   int ret;
 
   // First check if we already have a suitable session
   for (rms = airplay_master_sessions; rms; rms = rms->next)
     {
-      if (quality_is_equal(quality, &rms->rtp_session->quality))
+      if (quality_is_equal(quality, &rms->rtp_session->quality) && rms->format == format && rms->red_depth == red_depth)
 	return rms;
     }
 
   // Let's create a master session
-  // BK
-  // ret = outputs_quality_subscribe(quality);
-  // if (ret < 0)
-  //   {
-  //     DPRINTF(E_LOG, L_AIRPLAY, "Could not subscribe to required audio quality (%d/%d/%d)\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
-  //     return NULL;
-  //   }
+  ret = outputs_quality_subscribe(quality);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not subscribe to required audio quality (%d/%d/%d)\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
+      return NULL;
+    }
+
+  outputs_quality_resampler_set(quality, resampler);
 
   CHECK_NULL(L_AIRPLAY, rms = calloc(1, sizeof(struct airplay_master_session)));
 
-  DPRINTF(E_DBG, L_AIRPLAY, "master_session_make(): Calling rtp_session_new with quality %d/%d/%d\n",
-    quality->sample_rate, quality->bits_per_sample, quality->channels);
-  rms->rtp_session = rtp_session_new(quality, AIRPLAY_PACKET_BUFFER_SIZE, 0);
-  if (!rms->rtp_session)
+  rms->encrypted.uring_buf_index = -1;
+
+  cfg_shared = cfg_getsec(cfg, "airplay_shared");
+
+  // The key is random like the pair-verify shared secrets, so the devices
+  // can't tell the difference
+  if (cfg_getbool(cfg_shared, "group_stream_key"))
     {
-      goto error;
-    }
+      gcry_randomize(rms->stream_key, sizeof(rms->stream_key), GCRY_STRONG_RANDOM);
+      rms->packet_cipher_hd = chacha_open(rms->stream_key, sizeof(rms->stream_key));
+      if (!rms->packet_cipher_hd)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Could not create packet ciphering handle for group stream key\n");
+	  goto error;
+	}
 
-  // BK
-  // DPRINTF(E_DBG, L_AIRPLAY, "master_session(): Calling transcode_decode_setup_raw for XCODE_PCM16\n");
-  // encode_args.src_ctx = transcode_decode_setup_raw(XCODE_PCM16, quality);
-  // if (!encode_args.src_ctx)
-  //   {
-  //     DPRINTF(E_LOG, L_AIRPLAY, "Could not create decoding context\n");
-  //     goto error;
-  //   }
-
-  // DPRINTF(E_DBG, L_AIRPLAY, "master_session(): Calling transcode_encode_setup\n");
-  // rms->encode_ctx = transcode_encode_setup(encode_args);
-  // DPRINTF(E_DBG, L_AIRPLAY, "master_session(): Calling transcode_decode_cleanup\n");
-  // transcode_decode_cleanup(&encode_args.src_ctx);
-  // if (!rms->encode_ctx)
-  //   {
-  //     DPRINTF(E_LOG, L_AIRPLAY, "Will not be able to stream AirPlay 2, ffmpeg has no ALAC encoder\n");
-  //     goto error;
-  //   }
+      rms->group_key = true;
+    }
 
+  rms->format = format;
   rms->quality = *quality;
   rms->samples_per_packet = AIRPLAY_SAMPLES_PER_PACKET;
   rms->rawbuf_size = STOB(rms->samples_per_packet, quality->bits_per_sample, quality->channels);
+
+  // LPCM packets are the size of the raw input, ALAC frames can in theory be
+  // slightly larger
+  payload_max = rms->rawbuf_size;
+  if (format == MEDIA_FORMAT_ALAC)
+    {
+      uncompressed = cfg_getbool(cfg_shared, "uncompressed_alac");
+      rms->alac_encoder = alac_encoder_new(quality->bits_per_sample, quality->channels, AIRPLAY_SAMPLES_PER_PACKET, uncompressed);
+      rms->alac_uncompressed = uncompressed;
+      if (!rms->alac_encoder)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Could not create ALAC encoder for quality %d/%d/%d\n", quality->sample_rate, quality->bits_per_sample, quality->channels);
+	  goto error;
+	}
+
+      payload_max = MAX(payload_max, alac_encoder_max_len(rms->alac_encoder));
+
+      // The primary frame has a 1 byte header, and redundant blocks are only
+      // added up to AIRPLAY_RED_PAYLOAD_MAX
+      if (red_depth > 0)
+	{
+	  rms->red_depth = red_depth;
+	  CHECK_NULL(L_AIRPLAY, rms->red_primary = malloc(alac_encoder_max_len(rms->alac_encoder)));
+	  payload_max = MAX(payload_max + 1, AIRPLAY_RED_PAYLOAD_MAX);
+	}
+    }
+
+  buffer_ms = cfg_getint(cfg_shared, "retransmit_buffer_ms");
+  if (buffer_ms <= 0)
+    buffer_ms = AIRPLAY_PACKET_BUFFER_MS;
+
+  pktbuf_size = MAX((int64_t)buffer_ms * quality->sample_rate / 1000 / rms->samples_per_packet, AIRPLAY_PACKET_BUFFER_MIN);
+  hugepages = cfg_getbool(cfg_shared, "hugepages");
+
+  DPRINTF(E_DBG, L_AIRPLAY, "master_session_make(): Calling rtp_session_new with quality %d/%d/%d, %d packets retransmit buffer\n",
+    quality->sample_rate, quality->bits_per_sample, quality->channels, pktbuf_size);
+  rms->rtp_session = rtp_session_new(quality, pktbuf_size, payload_max, hugepages, 0);
+  if (!rms->rtp_session)
+    {
+      goto error;
+    }
   rms->output_buffer_samples = OUTPUTS_BUFFER_DURATION * quality->sample_rate;
 
   CHECK_NULL(L_AIRPLAY, rms->rawbuf = malloc(rms->rawbuf_size));
   CHECK_NULL(L_AIRPLAY, rms->input_buffer = evbuffer_new());
-  CHECK_NULL(L_AIRPLAY, rms->encoded_buffer = evbuffer_new());
 
   rms->next = airplay_master_sessions;
   airplay_master_sessions = rms;
@@ -1169,15 +1626,156 @@ master_session_make(struct media_quality *quality)
   return NULL;
 }
 
+// Moves the session to a master session with the same quality but another
+// format or redundancy, e.g. if the device rejected LPCM during SETUP
+static int
+session_format_set(struct airplay_session *rs, enum media_format format, int red_depth)
+{
+  struct airplay_master_session *old = rs->master_session;
+
+  if (format != MEDIA_FORMAT_ALAC)
+    red_depth = 0;
+
+  if (old->format == format && old->red_depth == red_depth)
+    return 0;
+
+  rs->master_session = master_session_make(&old->quality, format, red_depth, rs->resampler);
+  if (!rs->master_session)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not attach a %s master session for device '%s'\n", media_format_to_string(format), rs->devname);
+      rs->master_session = old;
+      return -1;
+    }
+
+  rs->master_session->sessions_count++;
+  master_session_cleanup(old);
+
+  // The resend times were for the slots of the old packet ring
+  free(rs->resend_sent_ms);
+  rs->resend_sent_ms = NULL;
+  rs->resend_sent_size = 0;
+  return 0;
+}
+
+// Decides how the audio will be streamed, which must be settled before SETUP
+// (stream): buffered over TCP if the receiver supports it and we are its PTP
+// master, otherwise realtime over UDP. Also moves the session to the master
+// session for the format.
+static int
+session_stream_set(struct airplay_session *rs, enum media_format format)
+{
+  int ret;
+
+  rs->buffered = rs->supports_buffered_audio && rs->timing_ptp;
+
+  // Redundant blocks are no use over TCP
+  ret = session_format_set(rs, format, rs->buffered ? 0 : rs->redundancy);
+  if (ret < 0)
+    return -1;
+
+  // Buffered sessions frame and encrypt each packet for the device anyway
+  rs->group_key = rs->master_session->group_key && !rs->buffered;
+
+  if (rs->buffered)
+    {
+      rs->buffered_lookahead_ms = cfg_getint(cfg_getsec(cfg, "airplay_shared"), "buffered_lookahead_ms");
+      rs->buffered_lookahead_ms = MAX(0, MIN(rs->buffered_lookahead_ms, AIRPLAY_BUFFERED_LOOKAHEAD_MAX_MS));
+    }
+
+  return 0;
+}
+
+// Normalises the address to an ipv6 address, where ipv4 is mapped to ipv6:
+// 16 bytes/4 words: 0x00000000 0x00000000 0x0000ffff 0x[IPv4]. That way a peer
+// that reaches us via a dual stack socket is found under its ipv4 address.
+static int
+session_addr_key(uint8_t *key, union net_sockaddr *naddr)
+{
+  switch (naddr->sa.sa_family)
+    {
+      case AF_INET:
+	memset(key, 0, 10);
+	memset(key + 10, 0xff, 2);
+	memcpy(key + 12, &naddr->sin.sin_addr.s_addr, 4);
+	return 0;
+
+      case AF_INET6:
+	memcpy(key, &naddr->sin6.sin6_addr, 16);
+	return 0;
+    }
+
+  return -1;
+}
+
+static void
+session_index_add(struct airplay_session *rs)
+{
+  uint8_t key[HASHIDX_KEY_LEN];
+
+  if (session_addr_key(key, &rs->naddr) == 0)
+    hashidx_add(&airplay_sessions_by_addr, key, rs);
+
+  hashidx_key_from_u64(key, rs->device_id);
+  hashidx_add(&airplay_sessions_by_device, key, rs);
+}
+
+static void
+session_index_remove(struct airplay_session *rs)
+{
+  uint8_t key[HASHIDX_KEY_LEN];
+
+  if (session_addr_key(key, &rs->naddr) == 0)
+    hashidx_remove(&airplay_sessions_by_addr, key, rs);
+
+  hashidx_key_from_u64(key, rs->device_id);
+  hashidx_remove(&airplay_sessions_by_device, key, rs);
+}
+
+static struct airplay_session *
+session_find_by_address(union net_sockaddr *peer_addr)
+{
+  uint8_t key[HASHIDX_KEY_LEN];
+
+  if (session_addr_key(key, peer_addr) < 0)
+    return NULL;
+
+  return hashidx_get(&airplay_sessions_by_addr, key);
+}
+
+static struct airplay_session *
+session_find_by_device_id(uint64_t device_id)
+{
+  uint8_t key[HASHIDX_KEY_LEN];
+
+  hashidx_key_from_u64(key, device_id);
+
+  return hashidx_get(&airplay_sessions_by_device, key);
+}
+
 static void
 session_free(struct airplay_session *rs)
 {
   if (!rs)
     return;
 
+  if (rs->resend_cache_hits || rs->resend_cache_misses)
+    DPRINTF(E_DBG, L_AIRPLAY, "Retransmit cache for '%s': %" PRIu64 " hits, %" PRIu64 " misses\n",
+      rs->devname, rs->resend_cache_hits, rs->resend_cache_misses);
+
+  if (rs->resend_stats.requested)
+    DPRINTF(E_DBG, L_AIRPLAY, "Retransmits for '%s': %" PRIu64 " requested, %" PRIu64 " sent, %" PRIu64 " suppressed, %" PRIu64 " throttled, %" PRIu64 " out of buffer\n",
+      rs->devname, rs->resend_stats.requested, rs->resend_stats.sent, rs->resend_stats.suppressed,
+      rs->resend_stats.throttled, rs->resend_stats.out_of_buffer);
+
   if (rs->master_session)
     master_session_cleanup(rs->master_session);
 
+  if (rs->timing_ptp)
+    airplay_ptp_peer_remove(&rs->naddr);
+
+  // Paced packets may still be waiting to be sent
+  send_batch_session_remove(&airplay_data_batch, rs);
+
   if (rs->ctrl)
     {
       evrtsp_connection_set_closecb(rs->ctrl, NULL, NULL);
@@ -1186,11 +1784,20 @@ session_free(struct airplay_session *rs)
 
   if (rs->deferredev)
     event_free(rs->deferredev);
+  if (rs->resend_timer)
+    event_free(rs->resend_timer);
+
+  if (rs->buffered_ev)
+    event_free(rs->buffered_ev);
+  if (rs->buffered_out)
+    evbuffer_free(rs->buffered_out);
 
   if (rs->server_fd >= 0)
     close(rs->server_fd);
 
   chacha_close(rs->packet_cipher_hd);
+  encrypted_ring_free(&rs->encrypted);
+  free(rs->resend_sent_ms);
 
   pair_setup_free(rs->pair_setup_ctx);
   pair_verify_free(rs->pair_verify_ctx);
@@ -1208,20 +1815,17 @@ session_free(struct airplay_session *rs)
 static void
 session_cleanup(struct airplay_session *rs)
 {
-  struct airplay_session *s;
+  session_index_remove(rs);
 
-  if (rs == airplay_sessions)
-    airplay_sessions = airplay_sessions->next;
+  if (rs->prev)
+    rs->prev->next = rs->next;
+  else if (rs == airplay_sessions)
+    airplay_sessions = rs->next;
   else
-    {
-      for (s = airplay_sessions; s && (s->next != rs); s = s->next)
-	; /* EMPTY */
+    DPRINTF(E_WARN, L_AIRPLAY, "WARNING: struct airplay_session not found in list; BUG!\n");
 
-      if (!s)
-	DPRINTF(E_WARN, L_AIRPLAY, "WARNING: struct airplay_session not found in list; BUG!\n");
-      else
-	s->next = rs->next;
-    }
+  if (rs->next)
+    rs->next->prev = rs->prev;
 
   outputs_device_session_remove(rs->device_id);
 
@@ -1474,40 +2078,12 @@ session_ids_set(struct airplay_session *rs)
   return -1;
 }
 
-static struct airplay_session *
-session_find_by_address(union net_sockaddr *peer_addr)
-{
-  struct airplay_session *rs;
-  uint32_t *addr_ptr;
-  int family = peer_addr->sa.sa_family;
-
-  for (rs = airplay_sessions; rs; rs = rs->next)
-    {
-      if (family == rs->family)
-	{
-	  if (family == AF_INET && peer_addr->sin.sin_addr.s_addr == rs->naddr.sin.sin_addr.s_addr)
-	    break;
-
-	  if (family == AF_INET6 && IN6_ARE_ADDR_EQUAL(&peer_addr->sin6.sin6_addr, &rs->naddr.sin6.sin6_addr))
-	    break;
-	}
-      else if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&peer_addr->sin6.sin6_addr))
-	{
-	  // ipv4 mapped to ipv6 consists of 16 bytes/4 words: 0x00000000 0x00000000 0x0000ffff 0x[IPv4]
-	  addr_ptr = (uint32_t *)(&peer_addr->sin6.sin6_addr);
-	  if (addr_ptr[3] == rs->naddr.sin.sin_addr.s_addr)
-	    break;
-	}
-    }
-
-  return rs;
-}
-
 static struct airplay_session *
 session_make(struct output_device *rd, int callback_id)
 {
   struct airplay_session *rs;
   struct airplay_extra *re;
+  enum media_format format;
   int ret;
 
   re = rd->extra_device_info;
@@ -1515,6 +2091,7 @@ session_make(struct output_device *rd, int callback_id)
 
   CHECK_NULL(L_AIRPLAY, rs = calloc(1, sizeof(struct airplay_session)));
   CHECK_NULL(L_AIRPLAY, rs->deferredev = evtimer_new(evbase_player, deferred_session_failure_cb, rs));
+  CHECK_NULL(L_AIRPLAY, rs->resend_timer = evtimer_new(evbase_player, resend_timer_cb, rs));
 
   rs->devname = strdup(rd->name);
   rs->volume = rd->volume;
@@ -1527,10 +2104,17 @@ session_make(struct output_device *rd, int callback_id)
   rs->callback_id = callback_id;
 
   rs->server_fd = -1;
+  rs->encrypted.uring_buf_index = -1;
 
   rs->password = rd->password;
 
   rs->supports_auth_setup = re->supports_auth_setup;
+  rs->supports_ptp = re->supports_ptp;
+  rs->supports_buffered_audio = re->supports_buffered_audio;
+  // Opt-in, and only for devices that announce support
+  if (re->supports_rfc2198_redundancy)
+    rs->redundancy = MAX(0, MIN(re->redundancy, RTP_RED_DEPTH_MAX));
+  rs->resampler = re->resampler;
   rs->wanted_metadata = re->wanted_metadata;
 
   rs->next_seq = AIRPLAY_SEQ_CONTINUE;
@@ -1548,18 +2132,31 @@ session_make(struct output_device *rd, int callback_id)
 	goto error;
     }
 
+  format = MEDIA_FORMAT_ALAC;
+  if (re->wants_lpcm && audio_format_get(MEDIA_FORMAT_PCM, &rd->quality))
+    format = MEDIA_FORMAT_PCM;
+  else if (re->wants_lpcm)
+    DPRINTF(E_WARN, L_AIRPLAY, "LPCM not possible with quality %d/%d/%d, will use ALAC for '%s'\n", rd->quality.sample_rate, rd->quality.bits_per_sample, rd->quality.channels, rd->name);
+
   DPRINTF(E_DBG, L_AIRPLAY, "session_make(): Calling master_session_make()\n");
-  rs->master_session = master_session_make(&rd->quality);
+  rs->master_session = master_session_make(&rd->quality, format, (format == MEDIA_FORMAT_ALAC) ? rs->redundancy : 0, rs->resampler);
   if (!rs->master_session)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Could not attach a master session for device '%s'\n", rd->name);
       goto error;
     }
 
+  rs->master_session->sessions_count++;
+
   // Attach to list of sessions
+  rs->prev = NULL;
   rs->next = airplay_sessions;
+  if (airplay_sessions)
+    airplay_sessions->prev = rs;
   airplay_sessions = rs;
 
+  session_index_add(rs);
+
   // rs is now the official device session
   // BK
   // outputs_device_session_add(rd->id, rs);
@@ -1800,7 +2397,7 @@ airplay_volume_to_pct(struct output_device *rd, const char *volstr)
 static int
 airplay_set_volume_one(struct output_device *device, int callback_id)
 {
-  struct airplay_session *rs = device->session;
+  struct airplay_session *rs = session_find_by_device_id(device->id);
 
   if (!rs || !(rs->state & AIRPLAY_STATE_F_CONNECTED))
     return 0;
@@ -1838,179 +2435,1478 @@ airplay_keep_alive_timer_cb(int fd, short what, void *arg)
 
 /* -------------------- Creation and sending of RTP packets  ---------------- */
 
+// Encrypts pkt into out, which must have room for pkt->data_len plus
+// AIRPLAY_PACKET_TAILROOM bytes. The plaintext in the RTP packet buffer is
+// kept, since each session (or group key) encrypts it separately.
 static int
-packet_encrypt(uint8_t **out, size_t *out_len, struct rtp_packet *pkt, struct airplay_session *rs)
+packet_encrypt(uint8_t *out, size_t *out_len, struct rtp_packet *pkt, gcry_cipher_hd_t hd)
 {
-  uint8_t authtag[16];
-  uint8_t nonce[12] = { 0 };
-  int nonce_offset = 4;
+  uint8_t nonce[AIRPLAY_NONCE_LEN] = { 0 };
   uint8_t *write_ptr;
   int ret;
 
-  // Alloc so authtag and nonce can be appended
-  *out_len = pkt->data_len + sizeof(authtag) + sizeof(nonce) - nonce_offset;
-  *out = malloc(*out_len);
-  write_ptr = *out;
-
   // Using seqnum as nonce not very secure, but means that when we resend
   // packets they will be identical to the original
-  memcpy(nonce + nonce_offset, &pkt->seqnum, sizeof(pkt->seqnum));
+  memcpy(nonce + AIRPLAY_NONCE_OFFSET, &pkt->seqnum, sizeof(pkt->seqnum));
 
   // The RTP header is not encrypted
-  memcpy(write_ptr, pkt->header, pkt->header_len);
-  write_ptr = *out + pkt->header_len;
+  memcpy(out, pkt->header, pkt->header_len);
+  write_ptr = out + pkt->header_len;
 
-  // Timestamp and SSRC are used as AAD = pkt->header + 4, len 8
-  ret = chacha_encrypt(write_ptr, pkt->payload, pkt->payload_len, pkt->header + 4, 8, authtag, sizeof(authtag), nonce, sizeof(nonce), rs->packet_cipher_hd);
+  // Timestamp and SSRC are used as AAD = pkt->header + 4, len 8. The authtag
+  // is written directly after the ciphertext.
+  ret = chacha_encrypt(write_ptr, pkt->payload, pkt->payload_len, pkt->header + 4, 8, write_ptr + pkt->payload_len, AIRPLAY_AUTHTAG_LEN, nonce, sizeof(nonce), hd);
   if (ret < 0)
-    {
-      free(*out);
-      return -1;
-    }
+    return -1;
 
-  write_ptr += pkt->payload_len;
-  memcpy(write_ptr, authtag, sizeof(authtag));
-  write_ptr += sizeof(authtag);
-  memcpy(write_ptr, nonce + nonce_offset, sizeof(nonce) - nonce_offset);
+  write_ptr += pkt->payload_len + AIRPLAY_AUTHTAG_LEN;
+  memcpy(write_ptr, nonce + AIRPLAY_NONCE_OFFSET, sizeof(nonce) - AIRPLAY_NONCE_OFFSET);
+
+  *out_len = pkt->data_len + AIRPLAY_PACKET_TAILROOM;
 
   return 0;
 }
 
-static int
-packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+// Returns the slot of the ring that corresponds to pkt's slot in the RTP
+// session packet buffer, if it holds the encrypted version of pkt
+static struct rtp_packet *
+encrypted_ring_get(struct airplay_encrypted_ring *ring, struct rtp_session *rtp_session, struct rtp_packet *pkt)
+{
+  struct rtp_packet *epkt;
+
+  if (!ring->pktbuf)
+    return NULL;
+
+  epkt = &ring->pktbuf[pkt - rtp_session->pktbuf];
+
+  // Slot must hold the same seqnum, rtptime and marker, otherwise it is stale
+  if (epkt->data_len == 0 || epkt->seqnum != pkt->seqnum || memcmp(epkt->data + 1, pkt->header + 1, 7) != 0)
+    return NULL;
+
+  return epkt;
+}
+
+// Encrypts pkt into the slot of the ring that corresponds to pkt's slot in the
+// RTP session packet buffer
+static struct rtp_packet *
+encrypted_ring_make(struct airplay_encrypted_ring *ring, struct rtp_session *rtp_session, struct rtp_packet *pkt, gcry_cipher_hd_t hd)
 {
-  uint8_t *encrypted;
-  size_t encrypted_len;
+  struct rtp_packet *epkt;
+  size_t slot_size;
+  size_t idx;
   int ret;
 
-  if (!rs)
-    return -1;
+  // The slots are the RTP slots plus room for the auth tag and nonce
+  if (!ring->pktbuf)
+    {
+      slot_size = rtp_session->pktbuf_slot_size + AIRPLAY_PACKET_TAILROOM;
+      ring->pktbuf_size = rtp_session->pktbuf_size;
+      ring->arena_size = ring->pktbuf_size * slot_size;
+      CHECK_NULL(L_AIRPLAY, ring->pktbuf = calloc(ring->pktbuf_size, sizeof(struct rtp_packet)));
+      CHECK_NULL(L_AIRPLAY, ring->arena = malloc(ring->arena_size));
 
-  ret = packet_encrypt(&encrypted, &encrypted_len, pkt, rs);
-  if (ret < 0)
-    return -1;
+      for (idx = 0; idx < ring->pktbuf_size; idx++)
+	{
+	  ring->pktbuf[idx].data = ring->arena + idx * slot_size;
+	  ring->pktbuf[idx].data_size = slot_size;
+	}
+
+      ring->uring_buf_index = airplay_uring_buffer_register(ring->arena, ring->arena_size);
+    }
+
+  epkt = &ring->pktbuf[pkt - rtp_session->pktbuf];
 
-  ret = send(rs->server_fd, encrypted, encrypted_len, 0);
-  free(encrypted);
+  ret = packet_encrypt(epkt->data, &epkt->data_len, pkt, hd);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Send error for '%s': %s\n", rs->devname, strerror(errno));
+      epkt->data_len = 0;
+      return NULL;
+    }
 
-      // Can't free it right away, it would make the ->next in the calling
+  epkt->seqnum = pkt->seqnum;
+
+  return epkt;
+}
+
+// The io_uring buffer index if data is in the ring's arena, otherwise -1
+static int
+encrypted_ring_buf_index(struct airplay_encrypted_ring *ring, uint8_t *data)
+{
+  if (ring->uring_buf_index < 0 || data < ring->arena || data >= ring->arena + ring->arena_size)
+    return -1;
+
+  return ring->uring_buf_index;
+}
+
+// Sessions with the group stream key use the master session's ring, except for
+// packets with the marker bit, since those only go to a device that just
+// joined. They are encrypted with the group key too, but into the own ring.
+static inline struct airplay_encrypted_ring *
+session_ring(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  if (rs->group_key && !(pkt->header[1] & (1 << 7)))
+    return &rs->master_session->encrypted;
+
+  return &rs->encrypted;
+}
+
+static inline gcry_cipher_hd_t
+session_cipher(struct airplay_session *rs)
+{
+  return rs->group_key ? rs->master_session->packet_cipher_hd : rs->packet_cipher_hd;
+}
+
+// Returns the encrypted version of pkt from the session's ring, if it is there
+static struct rtp_packet *
+packet_encrypted_get(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  return encrypted_ring_get(session_ring(rs, pkt), rs->master_session->rtp_session, pkt);
+}
+
+// Encrypts pkt for the session. If the ring is shared by the master session's
+// sessions, the first session that sends the packet encrypts it, and the rest
+// use that.
+static struct rtp_packet *
+packet_encrypted_make(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  struct airplay_master_session *rms = rs->master_session;
+  struct airplay_encrypted_ring *ring = session_ring(rs, pkt);
+  struct rtp_packet *epkt;
+
+  if (ring == &rms->encrypted)
+    {
+      rms->encrypted_total++;
+
+      epkt = encrypted_ring_get(ring, rms->rtp_session, pkt);
+      if (epkt)
+	{
+	  rms->encrypted_shared++;
+	  return epkt;
+	}
+    }
+
+  return encrypted_ring_make(ring, rms->rtp_session, pkt, session_cipher(rs));
+}
+
+static int
+packet_encrypted_send(struct airplay_session *rs, struct rtp_packet *epkt)
+{
+  int ret;
+
+  ret = send(rs->server_fd, epkt->data, epkt->data_len, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Send error for '%s': %s\n", rs->devname, strerror(errno));
+
+      // Can't free it right away, it would make the ->next in the calling
       // master_session and session loops invalid
       deferred_session_failure(rs);
       return -1;
     }
-  else if (ret != encrypted_len)
+  else if (ret != epkt->data_len)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "Partial send (%d) for '%s'\n", ret, rs->devname);
+      return -1;
+    }
+
+/*  DPRINTF(E_DBG, L_AIRPLAY, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
+    rs->master_session->rtp_session->seqnum,
+    rs->master_session->rtp_session->pos,
+    pkt->header[1],
+    rs->master_session->rtp_session->pktbuf_len
+    );
+*/
+  return 0;
+}
+
+static int
+packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  struct rtp_packet *epkt;
+
+  if (!rs)
+    return -1;
+
+  epkt = packet_encrypted_make(rs, pkt);
+  if (!epkt)
+    return -1;
+
+  return packet_encrypted_send(rs, epkt);
+}
+
+static int
+packet_resend(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  struct rtp_packet *epkt;
+
+  epkt = packet_encrypted_get(rs, pkt);
+  if (epkt)
+    {
+      rs->resend_cache_hits++;
+      return packet_encrypted_send(rs, epkt);
+    }
+
+  rs->resend_cache_misses++;
+  return packet_send(rs, pkt);
+}
+
+static socklen_t
+session_addr_make(union net_sockaddr *naddr, struct airplay_session *rs, unsigned short port)
+{
+  *naddr = rs->naddr;
+
+  switch (rs->family)
+    {
+      case AF_INET:
+	naddr->sin.sin_port = htons(port);
+	return sizeof(naddr->sin);
+
+      case AF_INET6:
+	naddr->sin6.sin6_port = htons(port);
+	return sizeof(naddr->sin6);
+
+      default:
+	DPRINTF(E_WARN, L_AIRPLAY, "Unknown family %d\n", rs->family);
+	return 0;
+    }
+}
+
+static void
+send_batch_failure(struct airplay_send_batch *batch, int i, bool is_audio)
+{
+  struct airplay_session *rs = batch->session[i];
+
+  if (!is_audio)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not send playback sync to device '%s': %s\n", rs->devname, strerror(errno));
+      return;
+    }
+
+  // Only the first failed packet for a session is reported
+  if (rs->state == AIRPLAY_STATE_FAILED)
+    return;
+
+  DPRINTF(E_LOG, L_AIRPLAY, "Send error for '%s': %s\n", rs->devname, strerror(errno));
+
+  // Can't free it right away, it would make the ->next in the calling
+  // master_session and session loops invalid
+  deferred_session_failure(rs);
+}
+
+#if AIRPLAY_USE_SENDMMSG
+// Sets up message m for packet i of the batch. Sync packets are sent to the
+// address in the batch, audio on the session's connected socket.
+static void
+send_batch_msg_prepare(struct airplay_send_batch *batch, int m, int i, bool addressed)
+{
+  struct mmsghdr *msg = &batch->msgs[m];
+
+  memset(msg, 0, sizeof(struct mmsghdr));
+  if (addressed)
+    {
+      msg->msg_hdr.msg_name = &batch->addr[i].sa;
+      msg->msg_hdr.msg_namelen = (batch->addr[i].sa.sa_family == AF_INET6) ? sizeof(batch->addr[i].sin6) : sizeof(batch->addr[i].sin);
+    }
+  msg->msg_hdr.msg_iov = &batch->iov[i];
+  msg->msg_hdr.msg_iovlen = 1;
+#if AIRPLAY_USE_SO_TXTIME
+  if (airplay_pacing == AIRPLAY_PACING_TXTIME && batch->txtime[i] && !addressed && batch->session[i]->so_txtime)
+    {
+      struct cmsghdr *cmsg;
+
+      msg->msg_hdr.msg_control = batch->txtime_control[m];
+      msg->msg_hdr.msg_controllen = sizeof(batch->txtime_control[m]);
+      cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(cmsg), &batch->txtime[i], sizeof(uint64_t));
+    }
+#endif
+
+  batch->msg_first[m] = i;
+}
+
+// Sends messages first to first + n - 1 with as few syscalls as possible. If a
+// message can't be sent we only fail the session it was for, and then continue
+// with the remaining messages.
+static void
+send_batch_msgs_send(struct airplay_send_batch *batch, int fd, int first, int n, bool is_audio)
+{
+  int sent;
+  int ret;
+
+  for (sent = 0; sent < n; )
+    {
+      ret = sendmmsg(fd, batch->msgs + first + sent, n - sent, 0);
+      if (is_audio)
+	airplay_send_stats.syscalls++;
+      if (ret < 0)
+	{
+	  // The first message in the remaining batch failed, skip it
+	  send_batch_failure(batch, batch->msg_first[first + sent], is_audio);
+	  sent++;
+	  continue;
+	}
+
+      sent += ret;
+    }
+}
+#endif
+
+// Sends the sync packets in the batch from the control socket, since that is
+// where the devices send their retransmit requests
+static void
+send_batch_flush(struct airplay_send_batch *batch, int fd)
+{
+  int i;
+
+  if (batch->len == 0)
+    return;
+
+#if AIRPLAY_USE_SENDMMSG
+  for (i = 0; i < batch->len; i++)
+    send_batch_msg_prepare(batch, i, i, true);
+
+  send_batch_msgs_send(batch, fd, 0, batch->len, false);
+#else
+  for (i = 0; i < batch->len; i++)
+    {
+      if (sendto(fd, batch->iov[i].iov_base, batch->iov[i].iov_len, 0, &batch->addr[i].sa,
+		 (batch->addr[i].sa.sa_family == AF_INET6) ? sizeof(batch->addr[i].sin6) : sizeof(batch->addr[i].sin)) < 0)
+	send_batch_failure(batch, i, false);
+    }
+#endif
+
+  batch->len = 0;
+}
+
+// Sends the audio packets in the batch on each session's connected data
+// socket, so the device sees the same source port as with packet_send(), and
+// ICMP errors are reported on the socket. Each session's packets are sent with
+// one sendmmsg(), in the order they were added.
+static void
+send_batch_flush_sessions(struct airplay_send_batch *batch)
+{
+  struct airplay_session *rs;
+  int i;
+#if AIRPLAY_USE_SENDMMSG
+  bool taken[AIRPLAY_SEND_BATCH_SIZE] = { false };
+  int first;
+  int nmsgs;
+  int j;
+#endif
+
+  if (batch->len == 0)
+    return;
+
+#if AIRPLAY_USE_SENDMMSG
+  for (i = 0, nmsgs = 0; i < batch->len; i++)
+    {
+      if (taken[i])
+	continue;
+
+      rs = batch->session[i];
+      for (j = i, first = nmsgs; j < batch->len; j++)
+	{
+	  if (taken[j] || batch->session[j] != rs)
+	    continue;
+
+	  send_batch_msg_prepare(batch, nmsgs++, j, false);
+	  taken[j] = true;
+	}
+
+      send_batch_msgs_send(batch, rs->server_fd, first, nmsgs - first, true);
+    }
+#else
+  for (i = 0; i < batch->len; i++)
+    {
+      rs = batch->session[i];
+      airplay_send_stats.syscalls++;
+      if (send(rs->server_fd, batch->iov[i].iov_base, batch->iov[i].iov_len, 0) < 0)
+	send_batch_failure(batch, i, true);
+    }
+#endif
+
+  batch->len = 0;
+}
+
+#if AIRPLAY_USE_UDP_GSO
+// Sends the packets of a GSO message one by one, used if the kernel or the
+// outgoing interface turns out not to support GSO
+static void
+send_batch_gso_fallback(struct airplay_send_batch *batch, int fd, struct mmsghdr *msg, int first)
+{
+  int ret;
+  int i;
+
+  for (i = 0; i < msg->msg_hdr.msg_iovlen; i++)
+    {
+      ret = send(fd, msg->msg_hdr.msg_iov[i].iov_base, msg->msg_hdr.msg_iov[i].iov_len, 0);
+      airplay_send_stats.syscalls++;
+      if (ret < 0)
+	{
+	  send_batch_failure(batch, first, true);
+	  return;
+	}
+    }
+}
+
+// Sends a session's GSO messages first to first + n - 1
+static void
+send_batch_gso_send(struct airplay_send_batch *batch, int fd, int first, int n)
+{
+  struct mmsghdr *msg;
+  int sent;
+  int ret;
+
+  for (sent = 0; sent < n; )
+    {
+      ret = sendmmsg(fd, batch->msgs + first + sent, n - sent, 0);
+      airplay_send_stats.syscalls++;
+      if (ret < 0)
+	{
+	  msg = &batch->msgs[first + sent];
+	  if (msg->msg_hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+	    {
+	      DPRINTF(E_WARN, L_AIRPLAY, "UDP GSO send failed (%s), disabling GSO\n", strerror(errno));
+	      airplay_udp_gso = false;
+	      send_batch_gso_fallback(batch, fd, msg, batch->msg_first[first + sent]);
+	    }
+	  else
+	    send_batch_failure(batch, batch->msg_first[first + sent], true);
+
+	  sent++;
+	  continue;
+	}
+
+      sent += ret;
+    }
+}
+
+// Groups runs of equal size packets for the same device into one GSO message
+// each, and then sends each device's messages with sendmmsg() on its connected
+// socket. The last packet of a run may be shorter than the segment size, the
+// kernel allows that.
+static void
+send_batch_flush_gso(struct airplay_send_batch *batch)
+{
+  bool taken[AIRPLAY_SEND_BATCH_SIZE] = { false };
+  struct mmsghdr *msg;
+  struct cmsghdr *cmsg;
+  struct airplay_session *rs;
+  size_t seg_len;
+  size_t total;
+  int first;
+  int nmsgs;
+  int niov;
+  int nseg;
+  int i;
+  int j;
+  int k;
+
+  if (batch->len == 0)
+    return;
+
+  for (i = 0, nmsgs = 0, niov = 0; i < batch->len; i++)
+    {
+      if (taken[i])
+	continue;
+
+      rs = batch->session[i];
+      first = nmsgs;
+
+      for (k = i; k < batch->len; k++)
+	{
+	  if (taken[k] || batch->session[k] != rs)
+	    continue;
+
+	  seg_len = batch->iov[k].iov_len;
+
+	  msg = &batch->msgs[nmsgs];
+	  memset(msg, 0, sizeof(struct mmsghdr));
+	  msg->msg_hdr.msg_iov = &batch->gso_iov[niov];
+	  batch->msg_first[nmsgs] = k;
+
+	  for (j = k, nseg = 0, total = 0; j < batch->len; j++)
+	    {
+	      if (taken[j] || batch->session[j] != rs)
+		continue;
+	      if (nseg > 0 && (batch->iov[j].iov_len > seg_len || nseg == AIRPLAY_GSO_SEGMENTS_MAX || total + batch->iov[j].iov_len > AIRPLAY_GSO_BYTES_MAX))
+		break;
+
+	      batch->gso_iov[niov++] = batch->iov[j];
+	      taken[j] = true;
+	      nseg++;
+	      total += batch->iov[j].iov_len;
+
+	      if (batch->iov[j].iov_len < seg_len)
+		break;
+	    }
+
+	  msg->msg_hdr.msg_iovlen = nseg;
+	  if (nseg > 1)
+	    {
+	      msg->msg_hdr.msg_control = batch->gso_control[nmsgs];
+	      msg->msg_hdr.msg_controllen = sizeof(batch->gso_control[nmsgs]);
+	      cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+	      cmsg->cmsg_level = SOL_UDP;
+	      cmsg->cmsg_type = UDP_SEGMENT;
+	      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	      *(uint16_t *)CMSG_DATA(cmsg) = seg_len;
+	    }
+
+	  airplay_send_stats.gso_msgs++;
+	  nmsgs++;
+	}
+
+      send_batch_gso_send(batch, rs->server_fd, first, nmsgs - first);
+    }
+
+  batch->len = 0;
+}
+#endif
+
+static inline void
+send_batch_move(struct airplay_send_batch *dst, int dst_i, struct airplay_send_batch *src, int src_i)
+{
+  dst->session[dst_i] = src->session[src_i];
+  dst->addr[dst_i] = src->addr[src_i];
+  dst->iov[dst_i] = src->iov[src_i];
+  dst->txtime[dst_i] = src->txtime[src_i];
+}
+
+// Removes the session's packets, needed when packets can stay in the batch
+// after a write, i.e. with timer pacing
+static void
+send_batch_session_remove(struct airplay_send_batch *batch, struct airplay_session *rs)
+{
+  int keep;
+  int i;
+
+  for (i = 0, keep = 0; i < batch->len; i++)
+    {
+      if (batch->session[i] == rs)
+	continue;
+
+      if (keep != i)
+	send_batch_move(batch, keep, batch, i);
+      keep++;
+    }
+
+  batch->len = keep;
+}
+
+// Timer pacing: sends the packets that are due, keeps the rest in the batch
+// and sets the timer for the first of those
+static void
+send_batch_flush_paced(struct airplay_send_batch *batch)
+{
+  struct airplay_send_batch *due = &airplay_data_due_batch;
+  struct timespec ts;
+  struct timeval tv;
+  uint64_t now;
+  uint64_t next = UINT64_MAX;
+  int keep;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  due->len = 0;
+  for (i = 0, keep = 0; i < batch->len; i++)
+    {
+      if (batch->txtime[i] <= now + AIRPLAY_PACING_SLACK_MS * 1000000ULL)
+	{
+	  send_batch_move(due, due->len, batch, i);
+	  due->len++;
+	  continue;
+	}
+
+      if (batch->txtime[i] < next)
+	next = batch->txtime[i];
+
+      if (keep != i)
+	send_batch_move(batch, keep, batch, i);
+      keep++;
+    }
+
+  batch->len = keep;
+
+  airplay_send_stats.packets += due->len;
+  send_batch_flush_sessions(due);
+
+  if (keep == 0)
+    return;
+
+  tv.tv_sec = (next - now) / 1000000000ULL;
+  tv.tv_usec = ((next - now) % 1000000000ULL) / 1000;
+  evtimer_add(airplay_pacing_timer, &tv);
+}
+
+// Failed io_uring send, the tag is the device id, or 0 for sync packets
+static void
+uring_send_error_cb(uint64_t tag, int err)
+{
+  struct airplay_session *rs;
+
+  if (tag == 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not send playback sync: %s\n", strerror(err));
+      return;
+    }
+
+  rs = session_find_by_device_id(tag);
+  if (!rs || rs->state == AIRPLAY_STATE_FAILED)
+    return;
+
+  DPRINTF(E_LOG, L_AIRPLAY, "Send error for '%s': %s\n", rs->devname, strerror(err));
+  deferred_session_failure(rs);
+}
+
+// Queues the batch on the io_uring and submits it. Completions are reaped with
+// the next submit, errors are reported to uring_send_error_cb(). Like with
+// sendmmsg(), audio goes out on the sessions' connected sockets and sync
+// packets on the control socket.
+static void
+send_batch_flush_uring(struct airplay_send_batch *batch, int fd, bool is_audio)
+{
+  struct airplay_session *rs;
+  uint8_t *data;
+  int buf_index;
+  int ret;
+  int i;
+
+  for (i = 0; i < batch->len; i++)
+    {
+      rs = batch->session[i];
+      data = batch->iov[i].iov_base;
+
+      // Packets that were copied to the batch are not in a registered arena
+      buf_index = encrypted_ring_buf_index(&rs->encrypted, data);
+      if (buf_index < 0 && rs->group_key)
+	buf_index = encrypted_ring_buf_index(&rs->master_session->encrypted, data);
+
+      if (is_audio)
+	ret = airplay_uring_sendto(rs->server_fd, data, batch->iov[i].iov_len, NULL, 0, buf_index, rs->device_id);
+      else
+	ret = airplay_uring_sendto(fd, data, batch->iov[i].iov_len, &batch->addr[i].sa,
+				   (batch->addr[i].sa.sa_family == AF_INET6) ? sizeof(batch->addr[i].sin6) : sizeof(batch->addr[i].sin),
+				   buf_index, 0);
+      // The network is not keeping up, the device can ask for a retransmit
+      if (ret < 0 && errno == ENOBUFS && is_audio)
+	continue;
+      if (ret < 0)
+	send_batch_failure(batch, i, is_audio);
+    }
+
+  airplay_uring_submit();
+  if (is_audio)
+    airplay_send_stats.syscalls++;
+
+  batch->len = 0;
+}
+
+static void
+packets_flush(void)
+{
+  struct timespec start;
+  struct timespec end;
+
+  // Sync packets first, new sessions must have the start sync before audio
+  if (airplay_uring_is_active())
+    send_batch_flush_uring(&airplay_sync_batch, airplay_control_svc.fd, false);
+  else
+    send_batch_flush(&airplay_sync_batch, airplay_control_svc.fd);
+
+  if (airplay_data_batch.len == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  airplay_send_stats.flushes++;
+
+  if (airplay_uring_is_active())
+    {
+      airplay_send_stats.packets += airplay_data_batch.len;
+      send_batch_flush_uring(&airplay_data_batch, -1, true);
+    }
+  else if (airplay_pacing == AIRPLAY_PACING_TIMER)
+    send_batch_flush_paced(&airplay_data_batch);
+#if AIRPLAY_USE_UDP_GSO
+  else if (airplay_udp_gso)
+    {
+      airplay_send_stats.packets += airplay_data_batch.len;
+      send_batch_flush_gso(&airplay_data_batch);
+    }
+#endif
+  else
+    {
+      airplay_send_stats.packets += airplay_data_batch.len;
+      send_batch_flush_sessions(&airplay_data_batch);
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  airplay_send_stats.flush_nsec += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+}
+
+static void
+pacing_timer_cb(int fd, short what, void *arg)
+{
+  packets_flush();
+}
+
+// Departure time for an audio packet: the time it should play according to
+// cur_stamp, minus the time the device buffers. For the packets of a write
+// that is about now and the duration of the write ahead.
+static uint64_t
+packet_txtime(struct airplay_master_session *rms, struct rtp_packet *pkt)
+{
+  struct timespec ts;
+  uint32_t rtptime;
+  int64_t offset_nsec;
+  uint64_t txtime;
+  uint64_t now;
+
+  if (airplay_pacing == AIRPLAY_PACING_OFF)
+    return 0;
+
+  memcpy(&rtptime, pkt->header + 4, sizeof(rtptime));
+  rtptime = be32toh(rtptime);
+
+  offset_nsec = (int64_t)((int32_t)(rtptime - rms->cur_stamp.pos) - rms->output_buffer_samples) * 1000000000 / rms->quality.sample_rate;
+  txtime = (uint64_t)rms->cur_stamp.ts.tv_sec * 1000000000ULL + rms->cur_stamp.ts.tv_nsec + offset_nsec;
+
+  // If the mapping is off we would rather send too early than hold packets
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (txtime < now)
+    return now;
+  if (txtime > now + AIRPLAY_PACING_AHEAD_MAX_MS * 1000000ULL)
+    return now + AIRPLAY_PACING_AHEAD_MAX_MS * 1000000ULL;
+
+  return txtime;
+}
+
+// Adds a packet to the batch. If copy is true the data is copied (it must not
+// be longer than AIRPLAY_SEND_BATCH_COPY_LEN), otherwise the caller must make
+// sure it stays valid until the batch is flushed. The port is only used for
+// packets that are not sent on the session's connected socket, i.e. sync.
+static void
+send_batch_add(struct airplay_send_batch *batch, struct airplay_session *rs, unsigned short port, uint8_t *data, size_t len, bool copy, uint64_t txtime)
+{
+  int i;
+
+  if (copy && len > AIRPLAY_SEND_BATCH_COPY_LEN)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Bug! Packet of %zu bytes for '%s' is too large to be copied to the send batch\n", len, rs->devname);
+      return;
+    }
+
+  if (batch->len == AIRPLAY_SEND_BATCH_SIZE)
+    packets_flush();
+
+  // With timer pacing nothing may be due yet, so send regardless. Only the
+  // data batch can be in that situation.
+  if (batch->len == AIRPLAY_SEND_BATCH_SIZE)
+    send_batch_flush_sessions(batch);
+
+  i = batch->len;
+
+  if (port != 0 && session_addr_make(&batch->addr[i], rs, port) == 0)
+    return;
+
+  if (copy)
+    {
+      memcpy(batch->copy[i], data, len);
+      data = batch->copy[i];
+    }
+
+  batch->session[i] = rs;
+  batch->iov[i].iov_base = data;
+  batch->iov[i].iov_len = len;
+  batch->txtime[i] = txtime;
+  batch->len++;
+}
+
+static void
+control_packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  // The sync packet buffer is reused for all sessions, so must be copied
+  send_batch_add(&airplay_sync_batch, rs, rs->control_port, pkt->data, pkt->data_len, true, 0);
+}
+
+// Like packet_send(), but the packet is added to the batch that is sent when
+// airplay_write() is done
+static int
+packet_send_batched(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  struct rtp_packet *epkt;
+
+  epkt = packet_encrypted_make(rs, pkt);
+  if (!epkt)
+    return -1;
+
+  send_batch_add(&airplay_data_batch, rs, 0, epkt->data, epkt->data_len, false, packet_txtime(rs->master_session, pkt));
+  return 0;
+}
+
+
+/* ---------------------- Buffered audio (stream type 103) ------------------ */
+
+static void
+buffered_write_cb(int fd, short what, void *arg);
+
+static int
+buffered_connect(struct airplay_session *rs)
+{
+  int sndbuf = AIRPLAY_BUFFERED_AUDIO_SIZE / 2;
+  int flags;
+
+  rs->server_fd = net_connect(rs->address, rs->data_port, SOCK_STREAM, "AirPlay buffered data");
+  if (rs->server_fd < 0)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "Could not connect to buffered data port\n");
+      return -1;
+    }
+
+  // We never want to block the player thread, instead we keep what the socket
+  // can't take and write it when there is room. A large send buffer lets the
+  // kernel hold most of what the receiver hasn't read yet.
+  flags = fcntl(rs->server_fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(rs->server_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not make buffered data socket for '%s' non-blocking: %s\n", rs->devname, strerror(errno));
+      return -1;
+    }
+
+  if (setsockopt(rs->server_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Could not set send buffer size for '%s': %s\n", rs->devname, strerror(errno));
+
+  CHECK_NULL(L_AIRPLAY, rs->buffered_out = evbuffer_new());
+  CHECK_NULL(L_AIRPLAY, rs->buffered_ev = event_new(evbase_player, rs->server_fd, EV_WRITE, buffered_write_cb, rs));
+
+  rs->buffered_pending = 0;
+
+  return 0;
+}
+
+static int
+buffered_write(struct airplay_session *rs)
+{
+  int ret;
+
+  // evbuffer_write() uses writev(), so the whole batch is one syscall
+  ret = evbuffer_write(rs->buffered_out, rs->server_fd);
+  if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Write error for '%s': %s\n", rs->devname, strerror(errno));
+      deferred_session_failure(rs);
+      return -1;
+    }
+
+  rs->buffered_pending = 0;
+
+  if (evbuffer_get_length(rs->buffered_out) == 0)
+    return 0;
+
+  if (evbuffer_get_length(rs->buffered_out) > AIRPLAY_BUFFERED_PENDING_MAX)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Device '%s' is not reading buffered audio, giving up\n", rs->devname);
+      deferred_session_failure(rs);
+      return -1;
+    }
+
+  if (!event_pending(rs->buffered_ev, EV_WRITE, NULL))
+    event_add(rs->buffered_ev, NULL);
+
+  return 0;
+}
+
+static void
+buffered_write_cb(int fd, short what, void *arg)
+{
+  struct airplay_session *rs = arg;
+
+  buffered_write(rs);
+}
+
+// Each packet is framed with a 2 byte length (which includes itself), followed
+// by the same encrypted packet we would send with UDP
+static void
+buffered_packet_add(struct airplay_session *rs, struct rtp_packet *pkt)
+{
+  struct evbuffer_iovec iov;
+  size_t len;
+  uint16_t frame_len;
+  uint8_t *frame;
+  int ret;
+
+  ret = evbuffer_reserve_space(rs->buffered_out, sizeof(frame_len) + pkt->data_len + AIRPLAY_PACKET_TAILROOM, &iov, 1);
+  if (ret != 1)
+    return;
+
+  frame = (uint8_t *)iov.iov_base + sizeof(frame_len);
+  ret = packet_encrypt(frame, &len, pkt, rs->packet_cipher_hd);
+  if (ret < 0)
+    return;
+
+  // The packet is shared with the other sessions and kept for retransmits, so
+  // the payload type is only changed in our copy of the header. It is not part
+  // of the AAD, so this doesn't affect the auth tag.
+  frame[1] = AIRPLAY_RTP_PAYLOADTYPE_BUFFERED;
+
+  frame_len = htobe16(sizeof(frame_len) + len);
+  memcpy(iov.iov_base, &frame_len, sizeof(frame_len));
+
+  iov.iov_len = sizeof(frame_len) + len;
+  evbuffer_commit_space(rs->buffered_out, &iov, 1);
+
+  rs->buffered_pending++;
+}
+
+// Writes if there is a full batch, or always if force is set, e.g. when the
+// receiver has just joined and should start buffering right away
+static void
+buffered_flush(struct airplay_session *rs, bool force)
+{
+  // Still waiting for the socket to have room
+  if (event_pending(rs->buffered_ev, EV_WRITE, NULL))
+    return;
+
+  if (rs->buffered_pending == 0 || (!force && rs->buffered_pending < AIRPLAY_BUFFERED_BATCH_PACKETS))
+    return;
+
+  buffered_write(rs);
+}
+
+// Merges the range into r if they overlap or are adjacent. Seqnums wrap, so
+// the offsets are computed mod 2^16.
+static bool
+resend_range_merge(struct airplay_resend_range *r, uint16_t seqnum, uint16_t len)
+{
+  uint16_t offset;
+  uint32_t end;
+
+  offset = seqnum - r->seqnum;
+  if (offset <= r->len)
+    {
+      end = MAX(r->len, offset + len);
+      r->len = MIN(end, UINT16_MAX);
+      return true;
+    }
+
+  offset = r->seqnum - seqnum;
+  if (offset <= len)
+    {
+      end = MAX(len, offset + r->len);
+      r->seqnum = seqnum;
+      r->len = MIN(end, UINT16_MAX);
+      return true;
+    }
+
+  return false;
+}
+
+// Adds what a session counted since prev to the totals, which other threads
+// may read with airplay_resend_stats_get()
+static void
+resend_stats_publish(struct airplay_resend_stats *cur, struct airplay_resend_stats *prev)
+{
+  __atomic_add_fetch(&airplay_resend_stats.requested, cur->requested - prev->requested, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&airplay_resend_stats.sent, cur->sent - prev->sent, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&airplay_resend_stats.suppressed, cur->suppressed - prev->suppressed, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&airplay_resend_stats.throttled, cur->throttled - prev->throttled, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&airplay_resend_stats.out_of_buffer, cur->out_of_buffer - prev->out_of_buffer, __ATOMIC_RELAXED);
+}
+
+// Sends the packets of the pending ranges, minus those that were resent
+// recently and those that exceed the device's budget
+static void
+resend_run(struct airplay_session *rs)
+{
+  struct rtp_session *rtp_session;
+  struct airplay_resend_stats prev;
+  struct airplay_resend_range *r;
+  struct rtp_packet *pkt;
+  struct timespec ts;
+  uint64_t now_ms;
+  size_t idx;
+  uint16_t s;
+  int i;
+  int j;
+  int ret;
+
+  if (rs->resend_nranges == 0 || !rs->master_session)
+    return;
+
+  // Sized for the packet ring of the current master session
+  rtp_session = rs->master_session->rtp_session;
+  if (rs->resend_sent_size != rtp_session->pktbuf_size)
+    {
+      free(rs->resend_sent_ms);
+      CHECK_NULL(L_AIRPLAY, rs->resend_sent_ms = calloc(rtp_session->pktbuf_size, sizeof(uint64_t)));
+      rs->resend_sent_size = rtp_session->pktbuf_size;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now_ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+  rs->resend_tokens += (now_ms - rs->resend_refill_ms) * AIRPLAY_RESEND_RATE / 1000.0;
+  if (rs->resend_tokens > AIRPLAY_RESEND_BURST)
+    rs->resend_tokens = AIRPLAY_RESEND_BURST;
+  rs->resend_refill_ms = now_ms;
+
+  prev = rs->resend_stats;
+
+  for (i = 0; i < rs->resend_nranges; i++)
+    {
+      r = &rs->resend_ranges[i];
+
+      // Note that seqnum may wrap around, so we don't use it for counting
+      for (j = 0, s = r->seqnum; j < r->len; j++, s++)
+	{
+	  pkt = rtp_packet_get(rtp_session, s);
+	  if (!pkt)
+	    {
+	      rs->resend_stats.out_of_buffer++;
+	      continue;
+	    }
+
+	  idx = pkt - rtp_session->pktbuf;
+	  if (rs->resend_sent_ms[idx] && now_ms - rs->resend_sent_ms[idx] < AIRPLAY_RESEND_SUPPRESS_MS)
+	    {
+	      rs->resend_stats.suppressed++;
+	      continue;
+	    }
+
+	  if (rs->resend_tokens < 1)
+	    {
+	      rs->resend_stats.throttled++;
+	      continue;
+	    }
+
+	  ret = packet_resend(rs, pkt);
+	  if (ret < 0)
+	    goto out;
+
+	  rs->resend_tokens -= 1;
+	  rs->resend_sent_ms[idx] = now_ms;
+	  rs->resend_stats.sent++;
+	}
+    }
+
+ out:
+  DPRINTF(E_DBG, L_AIRPLAY, "Retransmit to '%s': %d range(s), %" PRIu64 " sent, %" PRIu64 " suppressed, %" PRIu64 " throttled\n",
+    rs->devname, rs->resend_nranges, rs->resend_stats.sent - prev.sent, rs->resend_stats.suppressed - prev.suppressed,
+    rs->resend_stats.throttled - prev.throttled);
+
+  if (rs->resend_stats.out_of_buffer > prev.out_of_buffer)
+    DPRINTF(E_WARN, L_AIRPLAY, "Device '%s' requested %" PRIu64 " packet(s) outside buffer range (next seqnum %" PRIu16 ", len %zu)\n",
+      rs->devname, rs->resend_stats.out_of_buffer - prev.out_of_buffer, rtp_session->seqnum, rtp_session->pktbuf_len);
+
+  resend_stats_publish(&rs->resend_stats, &prev);
+
+  rs->resend_nranges = 0;
+}
+
+static void
+resend_timer_cb(int fd, short what, void *arg)
+{
+  struct airplay_session *rs = arg;
+
+  resend_run(rs);
+}
+
+// Queues a retransmit request, the packets are sent when the coalescing timer
+// fires
+static void
+resend_request_add(struct airplay_session *rs, uint16_t seqnum, uint16_t len)
+{
+  struct timeval tv = { 0, AIRPLAY_RESEND_COALESCE_MS * 1000 };
+  struct airplay_resend_stats prev;
+  struct airplay_resend_range *r;
+  size_t pktbuf_size;
+  int i;
+
+  // TCP takes care of that
+  if (rs->buffered || !rs->master_session || len == 0)
+    return;
+
+  pktbuf_size = rs->master_session->rtp_session->pktbuf_size;
+
+  DPRINTF(E_SPAM, L_AIRPLAY, "Got retransmit request from '%s': seqnum %" PRIu16 " (len %" PRIu16 "), next RTP session seqnum %" PRIu16 "\n",
+    rs->devname, seqnum, len, rs->master_session->rtp_session->seqnum);
+
+  prev = rs->resend_stats;
+
+  rs->resend_stats.requested += len;
+  if (len > pktbuf_size)
+    {
+      rs->resend_stats.out_of_buffer += len - pktbuf_size;
+      len = pktbuf_size;
+    }
+
+  resend_stats_publish(&rs->resend_stats, &prev);
+
+  for (i = 0; i < rs->resend_nranges; i++)
+    {
+      if (resend_range_merge(&rs->resend_ranges[i], seqnum, len))
+	break;
+    }
+
+  if (i == rs->resend_nranges)
+    {
+      // No room, so send what we have now instead of waiting for the timer
+      if (rs->resend_nranges == AIRPLAY_RESEND_RANGES_MAX)
+	resend_run(rs);
+
+      r = &rs->resend_ranges[rs->resend_nranges++];
+      r->seqnum = seqnum;
+      r->len = len;
+    }
+
+  if (!evtimer_pending(rs->resend_timer, NULL))
+    evtimer_add(rs->resend_timer, &tv);
+}
+
+// Like packet_encode(), but adds the previous frames as RFC 2198 redundant
+// blocks. Only used with ALAC.
+static int
+packet_encode_red(struct airplay_master_session *rms, const uint8_t *pcm)
+{
+  struct rtp_packet *pkt;
+  int len;
+
+  len = alac_encoder_encode(rms->alac_encoder, rms->red_primary, alac_encoder_max_len(rms->alac_encoder), pcm, rms->samples_per_packet);
+  if (len < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not ALAC encode frame\n");
+      return -1;
+    }
+
+  pkt = rtp_packet_red_next(rms->rtp_session, len, rms->samples_per_packet, AIRPLAY_RTP_PAYLOADTYPE_RED, AIRPLAY_RTP_PAYLOADTYPE, rms->red_depth, AIRPLAY_RED_PAYLOAD_MAX);
+  if (!pkt)
+    return -1;
+
+  memcpy(pkt->primary, rms->red_primary, len);
+
+  rms->red_packets++;
+  if (pkt->primary - pkt->payload > 1)
+    rms->red_packets_covered++;
+
+  rtp_packet_commit(rms->rtp_session, pkt);
+
+  return 0;
+}
+
+// Encodes a packet worth of PCM into the next packet and commits it to the
+// retransmit buffer. Touches only the master session, so can run on a worker
+// thread.
+static int
+packet_encode(struct airplay_master_session *rms, const uint8_t *pcm)
+{
+  struct rtp_packet *pkt;
+  int len;
+
+  if (rms->red_depth > 0)
+    return packet_encode_red(rms, pcm);
+
+  if (rms->format == MEDIA_FORMAT_PCM)
+    {
+      pkt = rtp_packet_next(rms->rtp_session, rms->rawbuf_size, rms->samples_per_packet, AIRPLAY_RTP_PAYLOADTYPE, 0);
+      if (!pkt)
+	return -1;
+
+      pcm_to_be(pkt->payload, pcm, rms->rawbuf_size, rms->quality.bits_per_sample);
+    }
+  else
+    {
+      // Reserve room for the largest possible frame, encode straight into the
+      // packet and then trim it to the actual length
+      pkt = rtp_packet_next(rms->rtp_session, alac_encoder_max_len(rms->alac_encoder), rms->samples_per_packet, AIRPLAY_RTP_PAYLOADTYPE, 0);
+      if (!pkt)
+	return -1;
+
+      len = alac_encoder_encode(rms->alac_encoder, pkt->payload, pkt->payload_len, pcm, rms->samples_per_packet);
+      if (len < 0)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Could not ALAC encode frame\n");
+	  return -1;
+	}
+
+      pkt->payload_len = len;
+      pkt->primary_len = len;
+      pkt->data_len = pkt->header_len + len;
+    }
+
+  // Commits packet to retransmit buffer, and prepares the session for the next packet
+  rtp_packet_commit(rms->rtp_session, pkt);
+
+  return 0;
+}
+
+static inline size_t
+input_len(struct airplay_master_session *rms)
+{
+  return evbuffer_get_length(rms->input_buffer) + rms->input_direct_len;
+}
+
+// Returns the next packet worth of input. Normally that is a slice of the
+// player's buffer, so no copy is made. Only a packet that straddles two writes
+// is assembled in input_buffer and copied to rawbuf.
+static const uint8_t *
+input_slice_get(struct airplay_master_session *rms)
+{
+  const uint8_t *slice;
+  size_t buffered;
+  size_t len;
+
+  buffered = evbuffer_get_length(rms->input_buffer);
+  if (buffered == 0 && rms->input_direct_len >= rms->rawbuf_size)
+    {
+      slice = rms->input_direct;
+      rms->input_direct += rms->rawbuf_size;
+      rms->input_direct_len -= rms->rawbuf_size;
+    }
+  else
+    {
+      if (buffered < rms->rawbuf_size)
+	{
+	  len = MIN(rms->rawbuf_size - buffered, rms->input_direct_len);
+	  evbuffer_add(rms->input_buffer, rms->input_direct, len);
+	  rms->input_direct += len;
+	  rms->input_direct_len -= len;
+	}
+
+      if (evbuffer_get_length(rms->input_buffer) < rms->rawbuf_size)
+	return NULL;
+
+      evbuffer_remove(rms->input_buffer, rms->rawbuf, rms->rawbuf_size);
+      slice = rms->rawbuf;
+    }
+
+  rms->input_buffer_samples -= rms->samples_per_packet;
+  return slice;
+}
+
+// Keeps what is left of the player's buffer (less than a packet) until the next
+// write, since the player may reuse the buffer when we return
+static void
+input_direct_stash(struct airplay_master_session *rms)
+{
+  if (rms->input_direct_len > 0)
+    evbuffer_add(rms->input_buffer, rms->input_direct, rms->input_direct_len);
+
+  rms->input_direct = NULL;
+  rms->input_direct_len = 0;
+}
+
+// Encodes as many packets as we have input for, up to a max. The packets end up
+// consecutively in the retransmit buffer, starting at rms->encoded_first (a
+// packet that fails to encode isn't committed, so its slot is reused).
+static void
+master_session_encode(struct airplay_master_session *rms)
+{
+  const uint8_t *pcm;
+
+  while (rms->encoded_len < AIRPLAY_ENCODE_PACKETS_MAX(rms) && input_len(rms) >= rms->rawbuf_size)
+    {
+      pcm = input_slice_get(rms);
+      if (!pcm)
+	break;
+
+      if (packet_encode(rms, pcm) == 0)
+	rms->encoded_len++;
+    }
+}
+
+static void
+encode_job_cb(struct evthr *thr, void *arg, void *shared)
+{
+  struct airplay_master_session *rms = arg;
+
+  master_session_encode(rms);
+
+  pthread_mutex_lock(&airplay_encode_barrier.mutex);
+  airplay_encode_barrier.pending--;
+  if (airplay_encode_barrier.pending == 0)
+    pthread_cond_signal(&airplay_encode_barrier.cond);
+  pthread_mutex_unlock(&airplay_encode_barrier.mutex);
+}
+
+// Encodes input for all master sessions. The first master session is encoded
+// by the calling thread, the others are handed to the worker pool, and then we
+// wait for all of them to finish. Returns true if there is more input than
+// could be encoded in one go.
+static bool
+master_sessions_encode(void)
+{
+  struct airplay_master_session *rms;
+  struct airplay_master_session *inline_rms = NULL;
+  bool more = false;
+
+  for (rms = airplay_master_sessions; rms; rms = rms->next)
+    {
+      rms->encoded_first = rms->rtp_session->pktbuf_next;
+      rms->encoded_len = 0;
+
+      if (input_len(rms) < rms->rawbuf_size)
+	continue;
+
+      if (!inline_rms)
+	{
+	  inline_rms = rms;
+	  continue;
+	}
+
+      if (airplay_encode_pool)
+	{
+	  pthread_mutex_lock(&airplay_encode_barrier.mutex);
+	  airplay_encode_barrier.pending++;
+	  pthread_mutex_unlock(&airplay_encode_barrier.mutex);
+
+	  if (evthr_pool_defer(airplay_encode_pool, encode_job_cb, rms) == EVTHR_RES_OK)
+	    continue;
+
+	  pthread_mutex_lock(&airplay_encode_barrier.mutex);
+	  airplay_encode_barrier.pending--;
+	  pthread_mutex_unlock(&airplay_encode_barrier.mutex);
+	}
+
+      master_session_encode(rms);
+    }
+
+  if (!inline_rms)
+    return false;
+
+  master_session_encode(inline_rms);
+
+  pthread_mutex_lock(&airplay_encode_barrier.mutex);
+  while (airplay_encode_barrier.pending > 0)
+    pthread_cond_wait(&airplay_encode_barrier.cond, &airplay_encode_barrier.mutex);
+  pthread_mutex_unlock(&airplay_encode_barrier.mutex);
+
+  for (rms = airplay_master_sessions; rms; rms = rms->next)
     {
-      DPRINTF(E_WARN, L_AIRPLAY, "Partial send (%d) for '%s'\n", ret, rs->devname);
-      return -1;
+      if (input_len(rms) >= rms->rawbuf_size)
+	more = true;
     }
 
-/*  DPRINTF(E_DBG, L_AIRPLAY, "RTP PACKET seqnum %u, rtptime %u, payload 0x%x, pktbuf_s %zu\n",
-    rs->master_session->rtp_session->seqnum,
-    rs->master_session->rtp_session->pos,
-    pkt->header[1],
-    rs->master_session->rtp_session->pktbuf_len
-    );
-*/
-  return 0;
+  return more;
 }
 
 static void
-control_packet_send(struct airplay_session *rs, struct rtp_packet *pkt)
+packets_gso_pad_run(struct airplay_master_session *rms, int first, int n, size_t payload_len)
 {
-  socklen_t addrlen;
-  int ret;
+  struct rtp_session *rtp_session = rms->rtp_session;
+  struct rtp_packet *pkt;
+  size_t pad;
+  int i;
 
-  switch (rs->family)
+  for (i = first; i < first + n; i++)
     {
-      case AF_INET:
-	rs->naddr.sin.sin_port = htons(rs->control_port);
-	addrlen = sizeof(rs->naddr.sin);
-	break;
+      pkt = &rtp_session->pktbuf[(rms->encoded_first + i) % rtp_session->pktbuf_size];
 
-      case AF_INET6:
-	rs->naddr.sin6.sin6_port = htons(rs->control_port);
-	addrlen = sizeof(rs->naddr.sin6);
-	break;
+      pad = payload_len - pkt->payload_len;
+      if (pad == 0)
+	continue;
 
-      default:
-	DPRINTF(E_WARN, L_AIRPLAY, "Unknown family %d\n", rs->family);
-	return;
+      memset(pkt->payload + pkt->payload_len, 0, pad);
+      pkt->payload_len += pad;
+      pkt->data_len += pad;
+      airplay_send_stats.gso_padding += pad;
     }
-
-  ret = sendto(rs->control_svc->fd, pkt->data, pkt->data_len, 0, &rs->naddr.sa, addrlen);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_AIRPLAY, "Could not send playback sync to device '%s': %s\n", rs->devname, strerror(errno));
 }
 
+// Splits the packets of the write into runs that can each be sent as one GSO
+// message per device, and pads the ALAC frames of each run to the same size,
+// see AIRPLAY_GSO_PAD_RATIO. The slots have room, since they are made for the
+// largest frame.
 static void
-packets_resend(struct airplay_session *rs, uint16_t seqnum, int len)
+packets_gso_pad(struct airplay_master_session *rms)
 {
-  struct rtp_session *rtp_session;
+  struct rtp_session *rtp_session = rms->rtp_session;
   struct rtp_packet *pkt;
-  uint16_t s;
+  size_t run_max;
+  size_t run_bytes;
+  size_t max;
+  size_t bytes;
+  int run_first;
+  int run_len;
   int i;
-  bool pkt_missing = false;
 
-  rtp_session = rs->master_session->rtp_session;
+  for (i = 0, run_first = 0, run_len = 0, run_max = 0, run_bytes = 0; i < rms->encoded_len; i++)
+    {
+      pkt = &rtp_session->pktbuf[(rms->encoded_first + i) % rtp_session->pktbuf_size];
 
-  DPRINTF(E_DBG, L_AIRPLAY, "Got retransmit request from '%s': seqnum %" PRIu16 " (len %d), next RTP session seqnum %" PRIu16 " (len %zu)\n",
-    rs->devname, seqnum, len, rtp_session->seqnum, rtp_session->pktbuf_len);
+      max = MAX(run_max, pkt->payload_len);
+      bytes = run_bytes + pkt->payload_len;
 
-  // Note that seqnum may wrap around, so we don't use it for counting
-  for (i = 0, s = seqnum; i < len; i++, s++)
-    {
-      pkt = rtp_packet_get(rtp_session, s);
-      if (pkt)
-	packet_send(rs, pkt);
-      else
-	pkt_missing = true;
+      if (run_len > 0 && (run_len == AIRPLAY_GSO_SEGMENTS_MAX ||
+			  (run_len + 1) * (pkt->header_len + max + AIRPLAY_PACKET_TAILROOM) > AIRPLAY_GSO_BYTES_MAX ||
+			  (run_len + 1) * max - bytes > bytes / AIRPLAY_GSO_PAD_RATIO))
+	{
+	  packets_gso_pad_run(rms, run_first, run_len, run_max);
+	  run_first = i;
+	  run_len = 0;
+	  max = pkt->payload_len;
+	  bytes = pkt->payload_len;
+	}
+
+      run_max = max;
+      run_bytes = bytes;
+      run_len++;
     }
 
-  if (pkt_missing)
-    DPRINTF(E_WARN, L_AIRPLAY, "Device '%s' retransmit request for seqnum %" PRIu16 " (len %d) is outside buffer range (next seqnum %" PRIu16 ", len %zu)\n",
-      rs->devname, seqnum, len, rtp_session->seqnum, rtp_session->pktbuf_len);
+  if (run_len > 0)
+    packets_gso_pad_run(rms, run_first, run_len, run_max);
 }
 
-static int
+// Sends the packets that master_sessions_encode() made to the sessions
+static void
 packets_send(struct airplay_master_session *rms)
 {
+  struct rtp_session *rtp_session = rms->rtp_session;
   struct rtp_packet *pkt;
   struct airplay_session *rs;
-  int len;
-
-  len = alac_encode(rms->encoded_buffer, rms->encode_ctx, rms->rawbuf, rms->rawbuf_size, rms->samples_per_packet, &rms->quality);
-  if (len < 0)
-    return -1;
-
-  pkt = rtp_packet_next(rms->rtp_session, len, rms->samples_per_packet, AIRPLAY_RTP_PAYLOADTYPE, 0);
+  int i;
 
-  evbuffer_remove(rms->encoded_buffer, pkt->payload, pkt->payload_len);
+  // LPCM packets are all the same size already. With redundancy the size also
+  // depends on the number of blocks, and the primary block has no length field.
+  if (airplay_udp_gso && rms->format == MEDIA_FORMAT_ALAC && rms->alac_uncompressed && rms->red_depth == 0)
+    packets_gso_pad(rms);
 
-  for (rs = airplay_sessions; rs; rs = rs->next)
+  for (i = 0; i < rms->encoded_len; i++)
     {
-      if (rs->master_session != rms)
-	continue;
+      pkt = &rtp_session->pktbuf[(rms->encoded_first + i) % rtp_session->pktbuf_size];
 
-      // Device just joined
-      if (rs->state == AIRPLAY_STATE_CONNECTED)
-	{
-	  pkt->header[1] = (1 << 7) | AIRPLAY_RTP_PAYLOADTYPE;
-	  packet_send(rs, pkt);
-	}
-      else if (rs->state == AIRPLAY_STATE_STREAMING)
+      for (rs = airplay_sessions; rs; rs = rs->next)
 	{
-	  pkt->header[1] = AIRPLAY_RTP_PAYLOADTYPE;
-	  packet_send(rs, pkt);
+	  if (rs->master_session != rms)
+	    continue;
+
+	  if (rs->buffered)
+	    {
+	      if (rs->state == AIRPLAY_STATE_CONNECTED || rs->state == AIRPLAY_STATE_STREAMING)
+		buffered_packet_add(rs, pkt);
+	    }
+	  // Device just joined
+	  else if (rs->state == AIRPLAY_STATE_CONNECTED)
+	    {
+	      pkt->header[1] |= (1 << 7);
+	      packet_send_batched(rs, pkt);
+	    }
+	  else if (rs->state == AIRPLAY_STATE_STREAMING)
+	    {
+	      pkt->header[1] &= ~(1 << 7);
+	      packet_send_batched(rs, pkt);
+	    }
 	}
     }
 
-  // Commits packet to retransmit buffer, and prepares the session for the next packet
-  rtp_packet_commit(rms->rtp_session, pkt);
-
-  return 0;
+  rms->encoded_len = 0;
 }
 
 // Overview of rtptimes as they should be when starting a stream, and assuming
@@ -2051,6 +3947,17 @@ timestamp_set(struct airplay_master_session *rms, struct timespec ts)
   rms->cur_stamp.pos = rms->rtp_session->pos + rms->input_buffer_samples - rms->output_buffer_samples;
 }
 
+// The sync packet is shared by the sessions, but since it is copied to the
+// send batch it is fine that the next session overwrites it
+static inline struct rtp_packet *
+sync_packet_next(struct airplay_session *rs, struct airplay_master_session *rms, char type)
+{
+  if (rs->timing_ptp)
+    return rtp_sync_packet_ptp_next(rms->rtp_session, rms->cur_stamp, type, airplay_ptp_clock_id());
+
+  return rtp_sync_packet_next(rms->rtp_session, rms->cur_stamp, type);
+}
+
 static void
 packets_sync_send(struct airplay_master_session *rms)
 {
@@ -2067,13 +3974,14 @@ packets_sync_send(struct airplay_master_session *rms)
 
   for (rs = airplay_sessions; rs; rs = rs->next)
     {
-      if (rs->master_session != rms)
+      // Buffered sessions are synced with the anchor time
+      if (rs->master_session != rms || rs->buffered)
 	continue;
 
       // A device has joined and should get an init sync packet
       if (rs->state == AIRPLAY_STATE_CONNECTED)
 	{
-	  sync_pkt = rtp_sync_packet_next(rms->rtp_session, rms->cur_stamp, 0x90);
+	  sync_pkt = sync_packet_next(rs, rms, 0x90);
 	  control_packet_send(rs, sync_pkt);
 
 	  DPRINTF(E_DBG, L_AIRPLAY, "Start sync packet sent to '%s': cur_pos=%" PRIu32 ", cur_ts=%ld.%09ld, clock=%ld.%09ld, rtptime=%" PRIu32 "\n",
@@ -2081,7 +3989,7 @@ packets_sync_send(struct airplay_master_session *rms)
 	}
       else if (is_sync_time && rs->state == AIRPLAY_STATE_STREAMING)
 	{
-	  sync_pkt = rtp_sync_packet_next(rms->rtp_session, rms->cur_stamp, 0x80);
+	  sync_pkt = sync_packet_next(rs, rms, 0x80);
 	  control_packet_send(rs, sync_pkt);
 	}
     }
@@ -2105,7 +4013,7 @@ service_stop(struct airplay_service *svc)
 }
 
 static int
-service_start(struct airplay_service *svc, event_callback_fn cb, unsigned short port, const char *log_service_name)
+service_start(struct airplay_service *svc, struct event_base *evbase, event_callback_fn cb, unsigned short port, const char *log_service_name)
 {
   memset(svc, 0, sizeof(struct airplay_service));
 
@@ -2116,7 +4024,7 @@ service_start(struct airplay_service *svc, event_callback_fn cb, unsigned short
       goto error;
     }
 
-  svc->ev = event_new(evbase_player, svc->fd, EV_READ | EV_PERSIST, cb, svc);
+  svc->ev = event_new(evbase, svc->fd, EV_READ | EV_PERSIST, cb, svc);
   if (!svc->ev)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Could not create event for '%s' service\n", log_service_name);
@@ -2134,50 +4042,110 @@ service_start(struct airplay_service *svc, event_callback_fn cb, unsigned short
   return -1;
 }
 
-static void
-timing_svc_cb(int fd, short what, void *arg)
+static inline struct msghdr *
+recv_batch_msg(struct airplay_recv_batch *batch, int i)
 {
-  struct airplay_service *svc = arg;
-  union net_sockaddr peer_addr;
-  socklen_t peer_addrlen = sizeof(peer_addr);
-  char address[INET6_ADDRSTRLEN];
-  uint8_t req[32];
-  uint8_t res[32];
-  struct ntp_stamp recv_stamp;
-  struct ntp_stamp xmit_stamp;
+#if AIRPLAY_USE_SENDMMSG
+  return &batch->msgs[i].msg_hdr;
+#else
+  return &batch->msgs[i];
+#endif
+}
+
+// Reads up to AIRPLAY_RECV_BATCH_SIZE datagrams without blocking. Returns the
+// number read, 0 if there was nothing to read, or -1 on error.
+static int
+recv_batch_read(struct airplay_recv_batch *batch, int fd)
+{
+  struct msghdr *msg;
   int ret;
+  int i;
 
-  ret = timing_get_clock_ntp(&recv_stamp);
-  if (ret < 0)
+  for (i = 0; i < AIRPLAY_RECV_BATCH_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get receive timestamp\n");
-      return;
+      msg = recv_batch_msg(batch, i);
+      memset(msg, 0, sizeof(struct msghdr));
+      batch->iov[i].iov_base = batch->buf[i];
+      batch->iov[i].iov_len = sizeof(batch->buf[i]);
+      msg->msg_name = &batch->addr[i];
+      msg->msg_namelen = sizeof(batch->addr[i]);
+      msg->msg_iov = &batch->iov[i];
+      msg->msg_iovlen = 1;
+      msg->msg_control = batch->control[i];
+      msg->msg_controllen = sizeof(batch->control[i]);
     }
 
-  peer_addrlen = sizeof(peer_addr);
-  ret = recvfrom(svc->fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
+  batch->len = 0;
+
+#if AIRPLAY_USE_SENDMMSG
+  ret = recvmmsg(fd, batch->msgs, AIRPLAY_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
   if (ret < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  for (i = 0; i < ret; i++)
+    batch->pkt_len[i] = batch->msgs[i].msg_len;
+  batch->len = ret;
+#else
+  for (i = 0; i < AIRPLAY_RECV_BATCH_SIZE; i++)
     {
-      net_address_get(address, sizeof(address), &peer_addr);
-      DPRINTF(E_LOG, L_AIRPLAY, "Error reading timing request from %s: %s\n", address, strerror(errno));
-      return;
+      ret = recvmsg(fd, &batch->msgs[i], MSG_DONTWAIT);
+      if (ret < 0)
+	break;
+
+      batch->pkt_len[i] = ret;
+      batch->len++;
     }
 
-  if (ret != 32)
+  if (batch->len == 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    return -1;
+#endif
+
+  return batch->len;
+}
+
+// Validates request i of the batch and makes the reply, except for the
+// transmit timestamp, which is added by timing_replies_send()
+static void
+timing_reply_make(struct airplay_recv_batch *batch, int i)
+{
+  char address[INET6_ADDRSTRLEN];
+  uint8_t *req = batch->buf[i];
+  uint8_t *res;
+  struct timespec recv_ts;
+  struct ntp_stamp recv_stamp;
+  int ret;
+
+  if (batch->pkt_len[i] != AIRPLAY_TIMING_PACKET_LEN)
     {
-      net_address_get(address, sizeof(address), &peer_addr);
-      DPRINTF(E_WARN, L_AIRPLAY, "Got timing request from %s with size %d\n", address, ret);
+      net_address_get(address, sizeof(address), &batch->addr[i]);
+      DPRINTF(E_WARN, L_AIRPLAY, "Got timing request from %s with size %d\n", address, batch->pkt_len[i]);
       return;
     }
 
   if ((req[0] != 0x80) || (req[1] != 0xd2))
     {
-      net_address_get(address, sizeof(address), &peer_addr);
+      net_address_get(address, sizeof(address), &batch->addr[i]);
       DPRINTF(E_WARN, L_AIRPLAY, "Packet header from %s doesn't match timing request (got 0x%02x%02x, expected 0x80d2)\n", address, req[0], req[1]);
       return;
     }
 
-  memset(res, 0, sizeof(res));
+  // Prefer the kernel's receive timestamp, since the request may have waited
+  // in the socket buffer
+  ret = net_rx_timestamp_get(&recv_ts, recv_batch_msg(batch, i));
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get receive timestamp: %s\n", strerror(errno));
+      return;
+    }
+  else if (ret > 0)
+    airplay_timing_stats.kernel_stamps++;
+
+  res = batch->replies[batch->replies_len];
+  batch->reply_to[batch->replies_len] = i;
+  batch->reply_recv_ts[batch->replies_len] = recv_ts;
+  batch->replies_len++;
+
+  memset(res, 0, AIRPLAY_TIMING_PACKET_LEN);
 
   /* Header */
   res[0] = 0x80;
@@ -2188,13 +4156,38 @@ timing_svc_cb(int fd, short what, void *arg)
   memcpy(res + 8, req + 24, 8);
 
   /* Receive timestamp */
+  timespec_to_ntp(&recv_ts, &recv_stamp);
   recv_stamp.sec = htobe32(recv_stamp.sec);
   recv_stamp.frac = htobe32(recv_stamp.frac);
   memcpy(res + 16, &recv_stamp.sec, 4);
   memcpy(res + 20, &recv_stamp.frac, 4);
+}
+
+static void
+timing_reply_failure(struct airplay_recv_batch *batch, int r)
+{
+  char address[INET6_ADDRSTRLEN];
+
+  net_address_get(address, sizeof(address), &batch->addr[batch->reply_to[r]]);
+  DPRINTF(E_LOG, L_AIRPLAY, "Could not send timing reply to %s: %s\n", address, strerror(errno));
+}
+
+static void
+timing_replies_send(struct airplay_recv_batch *batch, int fd)
+{
+  struct timespec xmit_ts;
+  struct ntp_stamp xmit_stamp;
+  struct msghdr *req_msg;
+  uint64_t latency_nsec;
+  int sent;
+  int ret;
+  int r;
 
-  /* Transmit timestamp */
-  ret = timing_get_clock_ntp(&xmit_stamp);
+  if (batch->replies_len == 0)
+    return;
+
+  /* Transmit timestamp, taken as late as possible */
+  ret = clock_gettime(CLOCK_MONOTONIC, &xmit_ts);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get transmit timestamp, falling back to receive timestamp\n");
@@ -2202,75 +4195,257 @@ timing_svc_cb(int fd, short what, void *arg)
       /* Still better than failing altogether
        * recv/xmit are close enough that it shouldn't matter much
        */
-      memcpy(res + 24, &recv_stamp.sec, 4);
-      memcpy(res + 28, &recv_stamp.frac, 4);
+      xmit_ts = batch->reply_recv_ts[batch->replies_len - 1];
     }
-  else
+
+  timespec_to_ntp(&xmit_ts, &xmit_stamp);
+  xmit_stamp.sec = htobe32(xmit_stamp.sec);
+  xmit_stamp.frac = htobe32(xmit_stamp.frac);
+
+  for (r = 0; r < batch->replies_len; r++)
     {
-      xmit_stamp.sec = htobe32(xmit_stamp.sec);
-      xmit_stamp.frac = htobe32(xmit_stamp.frac);
-      memcpy(res + 24, &xmit_stamp.sec, 4);
-      memcpy(res + 28, &xmit_stamp.frac, 4);
+      memcpy(batch->replies[r] + 24, &xmit_stamp.sec, 4);
+      memcpy(batch->replies[r] + 28, &xmit_stamp.frac, 4);
+
+      batch->replies_iov[r].iov_base = batch->replies[r];
+      batch->replies_iov[r].iov_len = AIRPLAY_TIMING_PACKET_LEN;
     }
 
-  ret = sendto(svc->fd, res, sizeof(res), 0, &peer_addr.sa, peer_addrlen);
-  if (ret < 0)
+#if AIRPLAY_USE_SENDMMSG
+  for (r = 0; r < batch->replies_len; r++)
     {
-      net_address_get(address, sizeof(address), &peer_addr);
-      DPRINTF(E_LOG, L_AIRPLAY, "Could not send timing reply to %s: %s\n", address, strerror(errno));
-      return;
+      req_msg = recv_batch_msg(batch, batch->reply_to[r]);
+
+      memset(&batch->replies_msgs[r], 0, sizeof(struct mmsghdr));
+      batch->replies_msgs[r].msg_hdr.msg_name = req_msg->msg_name;
+      batch->replies_msgs[r].msg_hdr.msg_namelen = req_msg->msg_namelen;
+      batch->replies_msgs[r].msg_hdr.msg_iov = &batch->replies_iov[r];
+      batch->replies_msgs[r].msg_hdr.msg_iovlen = 1;
+    }
+
+  for (sent = 0; sent < batch->replies_len; )
+    {
+      ret = sendmmsg(fd, batch->replies_msgs + sent, batch->replies_len - sent, 0);
+      if (ret < 0)
+	{
+	  // The first message in the remaining batch failed, skip it
+	  timing_reply_failure(batch, sent);
+	  sent++;
+	  continue;
+	}
+
+      sent += ret;
+    }
+#else
+  for (r = 0, sent = 0; r < batch->replies_len; r++)
+    {
+      req_msg = recv_batch_msg(batch, batch->reply_to[r]);
+
+      ret = sendto(fd, batch->replies[r], AIRPLAY_TIMING_PACKET_LEN, 0, req_msg->msg_name, req_msg->msg_namelen);
+      if (ret < 0)
+	timing_reply_failure(batch, r);
+    }
+#endif
+
+  for (r = 0; r < batch->replies_len; r++)
+    {
+      latency_nsec = (uint64_t)(xmit_ts.tv_sec - batch->reply_recv_ts[r].tv_sec) * 1000000000 + (xmit_ts.tv_nsec - batch->reply_recv_ts[r].tv_nsec);
+
+      airplay_timing_stats.replies++;
+      airplay_timing_stats.latency_nsec += latency_nsec;
+      if (latency_nsec > airplay_timing_stats.latency_nsec_max)
+	airplay_timing_stats.latency_nsec_max = latency_nsec;
+
+      DPRINTF(E_SPAM, L_AIRPLAY, "Timing reply sent %" PRIu64 " ns after request was received\n", latency_nsec);
     }
+
+  batch->replies_len = 0;
 }
 
 static void
-control_svc_cb(int fd, short what, void *arg)
+timing_svc_cb(int fd, short what, void *arg)
 {
   struct airplay_service *svc = arg;
-  union net_sockaddr peer_addr = { 0 };
-  socklen_t peer_addrlen = sizeof(peer_addr);
-  char address[INET6_ADDRSTRLEN];
-  struct airplay_session *rs;
-  uint8_t req[8];
-  uint16_t seq_start;
-  uint16_t seq_len;
+  struct airplay_recv_batch *batch = &airplay_timing_recv;
+  int rounds;
+  int ret;
+  int i;
+
+  for (rounds = 0; rounds < AIRPLAY_RECV_ROUNDS_MAX; rounds++)
+    {
+      ret = recv_batch_read(batch, svc->fd);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Error reading timing request: %s\n", strerror(errno));
+	  return;
+	}
+
+      if (ret == 0)
+	break;
+
+      airplay_timing_stats.batches++;
+
+      for (i = 0; i < batch->len; i++)
+	timing_reply_make(batch, i);
+
+      timing_replies_send(batch, svc->fd);
+
+      // Socket is drained
+      if (ret < AIRPLAY_RECV_BATCH_SIZE)
+	break;
+    }
+}
+
+static void *
+timing_thread(void *arg)
+{
+  struct sched_param param;
+  int ret;
+
+  // Needs privileges (or CAP_SYS_NICE), so failing is normal
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+  ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (ret != 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Timing thread will run without real-time priority: %s\n", strerror(ret));
+
+  event_base_loop(evbase_timing, EVLOOP_NO_EXIT_ON_EMPTY);
+
+  pthread_exit(NULL);
+}
+
+static int
+timing_service_start(unsigned short port)
+{
   int ret;
 
-  ret = recvfrom(svc->fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
+  CHECK_NULL(L_AIRPLAY, evbase_timing = event_base_new());
+
+  ret = service_start(&airplay_timing_svc, evbase_timing, timing_svc_cb, port, "AirPlay timing");
+  if (ret < 0)
+    goto error;
+
+  // Not fatal, without kernel timestamps we read the clock after recvmsg()
+  ret = net_rx_timestamps_enable(airplay_timing_svc.fd);
   if (ret < 0)
+    DPRINTF(E_WARN, L_AIRPLAY, "No kernel receive timestamps for timing requests: %s\n", strerror(errno));
+
+  memset(&airplay_timing_stats, 0, sizeof(struct airplay_timing_stats));
+
+  // Also not fatal, devices will then use NTP
+  ret = airplay_ptp_init(evbase_timing, airplay_device_id);
+  if (ret < 0)
+    DPRINTF(E_WARN, L_AIRPLAY, "Could not start PTP, all devices will use NTP timing\n");
+
+  ret = pthread_create(&tid_timing, NULL, timing_thread, NULL);
+  if (ret != 0)
     {
-      DPRINTF(E_LOG, L_AIRPLAY, "Error reading control request: %s\n", strerror(errno));
-      return;
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not spawn timing thread: %s\n", strerror(ret));
+      airplay_ptp_deinit();
+      goto error;
     }
 
-  if (ret != 8)
+  thread_setname(tid_timing, "airplay timing");
+
+  return 0;
+
+ error:
+  service_stop(&airplay_timing_svc);
+  event_base_free(evbase_timing);
+  evbase_timing = NULL;
+  return -1;
+}
+
+static void
+timing_service_stop(void)
+{
+  int ret;
+
+  if (!evbase_timing)
+    return;
+
+  event_base_loopbreak(evbase_timing);
+
+  ret = pthread_join(tid_timing, NULL);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_AIRPLAY, "Could not join timing thread: %s\n", strerror(ret));
+
+  airplay_ptp_deinit();
+  service_stop(&airplay_timing_svc);
+  event_base_free(evbase_timing);
+  evbase_timing = NULL;
+
+  if (airplay_timing_stats.replies > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Timing stats: %" PRIu64 " replies in %" PRIu64 " batches, %" PRIu64 " with kernel receive timestamp, %" PRIu64 " ns average and %" PRIu64 " ns max service latency\n",
+      airplay_timing_stats.replies, airplay_timing_stats.batches, airplay_timing_stats.kernel_stamps,
+      airplay_timing_stats.latency_nsec / airplay_timing_stats.replies, airplay_timing_stats.latency_nsec_max);
+}
+
+static void
+control_request_handle(uint8_t *req, int len, union net_sockaddr *peer_addr)
+{
+  char address[INET6_ADDRSTRLEN];
+  struct airplay_session *rs;
+  uint16_t seq_start;
+  uint16_t seq_len;
+
+  if (len != 8)
     {
-      net_address_get(address, sizeof(address), &peer_addr);
-      DPRINTF(E_WARN, L_AIRPLAY, "Got control request from %s with size %d\n", address, ret);
+      net_address_get(address, sizeof(address), peer_addr);
+      DPRINTF(E_WARN, L_AIRPLAY, "Got control request from %s with size %d\n", address, len);
       return;
     }
 
   if ((req[0] != 0x80) || (req[1] != 0xd5))
     {
-      net_address_get(address, sizeof(address), &peer_addr);
+      net_address_get(address, sizeof(address), peer_addr);
       DPRINTF(E_WARN, L_AIRPLAY, "Packet header from %s doesn't match retransmit request (got 0x%02x%02x, expected 0x80d5)\n", address, req[0], req[1]);
       return;
     }
 
-  rs = session_find_by_address(&peer_addr);
+  rs = session_find_by_address(peer_addr);
   if (!rs)
     {
-      net_address_get(address, sizeof(address), &peer_addr);
+      net_address_get(address, sizeof(address), peer_addr);
       DPRINTF(E_WARN, L_AIRPLAY, "Control request from %s; not a AirPlay client\n", address);
       return;
     }
 
-  memcpy(&seq_start, req + 4, 2);
-  memcpy(&seq_len, req + 6, 2);
+  memcpy(&seq_start, req + 4, 2);
+  memcpy(&seq_len, req + 6, 2);
+
+  seq_start = be16toh(seq_start);
+  seq_len = be16toh(seq_len);
+
+  resend_request_add(rs, seq_start, seq_len);
+}
+
+static void
+control_svc_cb(int fd, short what, void *arg)
+{
+  struct airplay_service *svc = arg;
+  struct airplay_recv_batch *batch = &airplay_control_recv;
+  int rounds;
+  int ret;
+  int i;
+
+  for (rounds = 0; rounds < AIRPLAY_RECV_ROUNDS_MAX; rounds++)
+    {
+      ret = recv_batch_read(batch, svc->fd);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Error reading control request: %s\n", strerror(errno));
+	  return;
+	}
 
-  seq_start = be16toh(seq_start);
-  seq_len = be16toh(seq_len);
+      // Requests in the batch for the same device are coalesced by the
+      // retransmit scheduler
+      for (i = 0; i < batch->len; i++)
+	control_request_handle(batch->buf[i], batch->pkt_len[i], &batch->addr[i]);
 
-  packets_resend(rs, seq_start, seq_len);
+      if (ret < AIRPLAY_RECV_BATCH_SIZE)
+	break;
+    }
 }
 
 
@@ -2295,6 +4470,60 @@ payload_make_flush(struct evrtsp_request *req, struct airplay_session *rs, void
   return 0;
 }
 
+// Sets the rate and, if playing, the anchor: rtpTime should play at the given
+// time in the PTP timeline. We use the same mapping as the sync packets.
+static int
+payload_make_rate_anchor(struct evrtsp_request *req, struct airplay_session *rs, bool play)
+{
+  struct airplay_master_session *rms = rs->master_session;
+  struct timespec lookahead;
+  struct timespec ts;
+  plist_t root;
+  uint8_t *data;
+  size_t len;
+  int ret;
+
+  if (!rs->buffered)
+    return 1; // skip this request
+
+  // See AIRPLAY_BUFFERED_LOOKAHEAD_MAX_MS
+  lookahead.tv_sec = rs->buffered_lookahead_ms / 1000;
+  lookahead.tv_nsec = (rs->buffered_lookahead_ms % 1000) * 1000000;
+  ts = timespec_add(rms->cur_stamp.ts, lookahead);
+
+  root = plist_new_dict();
+  wplist_dict_add_uint(root, "rate", play ? 1 : 0);
+  if (play)
+    {
+      wplist_dict_add_uint(root, "rtpTime", rms->cur_stamp.pos);
+      wplist_dict_add_uint(root, "networkTimeSecs", ts.tv_sec);
+      wplist_dict_add_uint(root, "networkTimeFrac", (uint64_t)((double)ts.tv_nsec * 18446744073.709551616)); // 2^64 / 1e9
+      wplist_dict_add_uint(root, "networkTimeTimelineID", airplay_ptp_clock_id());
+    }
+
+  ret = wplist_to_bin(&data, &len, root);
+  plist_free(root);
+
+  if (ret < 0)
+    return -1;
+
+  evbuffer_add(req->output_buffer, data, len);
+
+  return 0;
+}
+
+static int
+payload_make_anchor_play(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
+{
+  return payload_make_rate_anchor(req, rs, true);
+}
+
+static int
+payload_make_anchor_pause(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
+{
+  return payload_make_rate_anchor(req, rs, false);
+}
+
 static int
 payload_make_teardown(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
 {
@@ -2465,6 +4694,7 @@ Bit 	Value 	Type
 static int
 payload_make_setup_stream(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
 {
+  struct airplay_master_session *rms = rs->master_session;
   plist_t root;
   plist_t streams;
   plist_t stream;
@@ -2473,17 +4703,25 @@ payload_make_setup_stream(struct evrtsp_request *req, struct airplay_session *rs
   int ret;
 
   stream = plist_new_dict();
-  wplist_dict_add_uint(stream, "audioFormat", 262144); // 0x40000 ALAC/44100/16/2
+  wplist_dict_add_uint(stream, "audioFormat", audio_format_get(rms->format, &rms->quality)); // E.g. 0x40000 ALAC/44100/16/2
   wplist_dict_add_string(stream, "audioMode", "default");
   wplist_dict_add_uint(stream, "controlPort", rs->control_svc->port);
-  wplist_dict_add_uint(stream, "ct", 2); // Compression type, 1 LPCM, 2 ALAC, 3 AAC, 4 AAC ELD, 32 OPUS
+  wplist_dict_add_uint(stream, "ct", (rms->format == MEDIA_FORMAT_PCM) ? 1 : 2); // Compression type, 1 LPCM, 2 ALAC, 3 AAC, 4 AAC ELD, 32 OPUS
   wplist_dict_add_bool(stream, "isMedia", true); // ?
   wplist_dict_add_uint(stream, "latencyMax", 88200); // TODO how do these latencys work?
   wplist_dict_add_uint(stream, "latencyMin", 11025);
-  wplist_dict_add_data(stream, "shk", rs->shared_secret, AIRPLAY_AUDIO_KEY_LEN);
+  wplist_dict_add_data(stream, "shk", rs->group_key ? rms->stream_key : rs->shared_secret, AIRPLAY_AUDIO_KEY_LEN);
   wplist_dict_add_uint(stream, "spf", AIRPLAY_SAMPLES_PER_PACKET); // frames per packet
   wplist_dict_add_uint(stream, "sr", AIRPLAY_QUALITY_SAMPLE_RATE_DEFAULT); // sample rate
-  wplist_dict_add_uint(stream, "type", AIRPLAY_RTP_PAYLOADTYPE); // RTP type, 0x60 = 96 real time, 103 buffered
+  if (rms->red_depth > 0)
+    wplist_dict_add_uint(stream, "redundantAudio", rms->red_depth);
+  if (rs->buffered)
+    {
+      wplist_dict_add_uint(stream, "type", AIRPLAY_RTP_PAYLOADTYPE_BUFFERED);
+      wplist_dict_add_uint(stream, "audioBufferSize", AIRPLAY_BUFFERED_AUDIO_SIZE);
+    }
+  else
+    wplist_dict_add_uint(stream, "type", AIRPLAY_RTP_PAYLOADTYPE); // RTP type, 0x60 = 96 real time, 103 buffered
   wplist_dict_add_bool(stream, "supportsDynamicStreamID", false);
   wplist_dict_add_uint(stream, "streamConnectionID", rs->session_id); // Hopefully fine since we have one stream per session
   streams = plist_new_array();
@@ -2555,12 +4793,30 @@ payload_make_record(struct evrtsp_request *req, struct airplay_session *rs, void
   return 0;
 }
 
+// Our own entry in the PTP peer info/list
+static plist_t
+timing_peer_info_make(const char *address, bool with_override)
+{
+  plist_t info;
+  plist_t addresses;
+
+  addresses = plist_new_array();
+  plist_array_append_item(addresses, plist_new_string(address));
+
+  info = plist_new_dict();
+  plist_dict_set_item(info, "Addresses", addresses);
+  wplist_dict_add_string(info, "ID", address);
+  if (with_override)
+    wplist_dict_add_bool(info, "SupportsClockPortMatchingOverride", false);
+
+  return info;
+}
+
 static int
 payload_make_setup_session(struct evrtsp_request *req, struct airplay_session *rs, void *arg)
 {
   plist_t root;
-  plist_t addresses;
-  plist_t address;
+  plist_t peers;
   char device_id_colon[24];
   uint8_t *data;
   size_t len;
@@ -2568,15 +4824,27 @@ payload_make_setup_session(struct evrtsp_request *req, struct airplay_session *r
 
   device_id_colon_make(device_id_colon, sizeof(device_id_colon), airplay_device_id);
 
-  address = plist_new_string(rs->local_address);
-  addresses = plist_new_array();
-  plist_array_append_item(addresses, address);
-
   root = plist_new_dict();
   wplist_dict_add_string(root, "deviceID", device_id_colon);
   wplist_dict_add_string(root, "sessionUUID", rs->session_uuid);
-  wplist_dict_add_uint(root, "timingPort", rs->timing_svc->port);
-  wplist_dict_add_string(root, "timingProtocol", "NTP"); // If set to "None" then an ATV4 will not respond to stream SETUP request
+
+  // PTP if the receiver supports it and we could get the standard ports
+  rs->timing_ptp = rs->supports_ptp && airplay_ptp_is_available();
+  if (rs->timing_ptp)
+    {
+      peers = plist_new_array();
+      plist_array_append_item(peers, timing_peer_info_make(rs->local_address, true));
+      plist_array_append_item(peers, timing_peer_info_make(rs->address, true));
+
+      wplist_dict_add_string(root, "timingProtocol", "PTP");
+      plist_dict_set_item(root, "timingPeerInfo", timing_peer_info_make(rs->local_address, false));
+      plist_dict_set_item(root, "timingPeerList", peers);
+    }
+  else
+    {
+      wplist_dict_add_uint(root, "timingPort", rs->timing_svc->port);
+      wplist_dict_add_string(root, "timingProtocol", "NTP"); // If set to "None" then an ATV4 will not respond to stream SETUP request
+    }
 
   ret = wplist_to_bin(&data, &len, root);
   plist_free(root);
@@ -2847,6 +5115,23 @@ response_handler_setup_stream(struct evrtsp_request *req, struct airplay_session
   uint64_t uintval;
   int ret;
 
+  if (req->response_code != RTSP_OK)
+    {
+      if (rs->master_session->format != MEDIA_FORMAT_PCM)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Response to SETUP (stream) from '%s' was negative, aborting (%d %s)\n", rs->devname, req->response_code, req->response_code_line);
+	  return AIRPLAY_SEQ_ABORT;
+	}
+
+      DPRINTF(E_WARN, L_AIRPLAY, "Device '%s' did not accept LPCM (%d %s), falling back to ALAC\n", rs->devname, req->response_code, req->response_code_line);
+
+      ret = session_stream_set(rs, MEDIA_FORMAT_ALAC);
+      if (ret < 0)
+	return AIRPLAY_SEQ_ABORT;
+
+      return AIRPLAY_SEQ_SETUP_STREAM;
+    }
+
   DPRINTF(E_INFO, L_AIRPLAY, "Setting up AirPlay session %u (%s -> %s)\n", rs->session_id, rs->local_address, rs->address);
 
   ret = wplist_from_evbuf(&response, req->input_buffer);
@@ -2884,19 +5169,42 @@ response_handler_setup_stream(struct evrtsp_request *req, struct airplay_session
       rs->control_port = uintval;
     }
 
-  if (rs->data_port == 0 || rs->control_port == 0)
+  // Buffered streams have no use for the control port
+  if (rs->data_port == 0 || (rs->control_port == 0 && !rs->buffered))
     {
       DPRINTF(E_LOG, L_AIRPLAY, "Missing port number in reply from '%s' (d=%u, c=%u)\n", rs->devname, rs->data_port, rs->control_port);
       goto error;
     }
 
-  DPRINTF(E_DBG, L_AIRPLAY, "Negotiated UDP streaming session; ports d=%u c=%u t=%u e=%u\n", rs->data_port, rs->control_port, rs->timing_port, rs->events_port);
+  if (rs->buffered)
+    {
+      DPRINTF(E_DBG, L_AIRPLAY, "Negotiated buffered TCP streaming session; ports d=%u e=%u\n", rs->data_port, rs->events_port);
 
-  rs->server_fd = net_connect(rs->address, rs->data_port, SOCK_DGRAM, "AirPlay data");
-  if (rs->server_fd < 0)
+      ret = buffered_connect(rs);
+      if (ret < 0)
+	goto error;
+    }
+  else
     {
-      DPRINTF(E_WARN, L_AIRPLAY, "Could not connect to data port\n");
-      goto error;
+      DPRINTF(E_DBG, L_AIRPLAY, "Negotiated UDP streaming session; ports d=%u c=%u t=%u e=%u\n", rs->data_port, rs->control_port, rs->timing_port, rs->events_port);
+
+      rs->server_fd = net_connect(rs->address, rs->data_port, SOCK_DGRAM, "AirPlay data");
+      if (rs->server_fd < 0)
+	{
+	  DPRINTF(E_WARN, L_AIRPLAY, "Could not connect to data port\n");
+	  goto error;
+	}
+
+#if AIRPLAY_USE_SO_TXTIME
+      if (airplay_pacing == AIRPLAY_PACING_TXTIME)
+	{
+	  struct sock_txtime txtime_cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+
+	  rs->so_txtime = (setsockopt(rs->server_fd, SOL_SOCKET, SO_TXTIME, &txtime_cfg, sizeof(txtime_cfg)) == 0);
+	  if (!rs->so_txtime)
+	    DPRINTF(E_WARN, L_AIRPLAY, "Could not enable SO_TXTIME for '%s', audio will not be paced: %s\n", rs->devname, strerror(errno));
+	}
+#endif
     }
 
   // Reverse connection, used to receive playback events from device
@@ -2985,6 +5293,19 @@ response_handler_setup_session(struct evrtsp_request *req, struct airplay_sessio
       goto error;
     }
 
+  // The receiver will now expect Sync/Announce from us
+  if (rs->timing_ptp && airplay_ptp_peer_add(&rs->naddr, AIRPLAY_PTP_EVENT_PORT, AIRPLAY_PTP_GENERAL_PORT) < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not add '%s' as PTP peer\n", rs->devname);
+      rs->timing_ptp = false;
+      goto error;
+    }
+
+  DPRINTF(E_DBG, L_AIRPLAY, "Using %s timing for '%s'\n", rs->timing_ptp ? "PTP" : "NTP", rs->devname);
+
+  if (session_stream_set(rs, rs->master_session->format) < 0)
+    goto error;
+
   plist_free(response);
   return AIRPLAY_SEQ_CONTINUE;
 
@@ -2996,6 +5317,13 @@ response_handler_setup_session(struct evrtsp_request *req, struct airplay_sessio
 static enum airplay_seq_type
 response_handler_flush(struct evrtsp_request *req, struct airplay_session *rs)
 {
+  // Audio we haven't written yet is from before the flush
+  if (rs->buffered_out)
+    {
+      evbuffer_drain(rs->buffered_out, evbuffer_get_length(rs->buffered_out));
+      rs->buffered_pending = 0;
+    }
+
   rs->state = AIRPLAY_STATE_CONNECTED;
   return AIRPLAY_SEQ_CONTINUE;
 }
@@ -3378,6 +5706,8 @@ static struct airplay_seq_definition airplay_seq_definition[] =
   { AIRPLAY_SEQ_PAIR_VERIFY, session_pair_success, session_failure },
   { AIRPLAY_SEQ_PAIR_TRANSIENT, session_pair_success, session_failure },
   { AIRPLAY_SEQ_FEEDBACK, NULL, session_failure },
+  { AIRPLAY_SEQ_SETUP_STREAM, session_connected, session_failure },
+  { AIRPLAY_SEQ_SEND_ANCHOR, NULL, session_failure },
 };
 
 // The size of the second array dimension MUST at least be the size of largest
@@ -3395,7 +5725,9 @@ static struct airplay_seq_request airplay_seq_request[][7] =
     // and a WWW-Authenticate header, and then we may need re-run with password auth
     { AIRPLAY_SEQ_START_PLAYBACK, "SETUP (session)", EVRTSP_REQ_SETUP, payload_make_setup_session, response_handler_setup_session, "application/x-apple-binary-plist", NULL, true },
     { AIRPLAY_SEQ_START_PLAYBACK, "SETPEERS", EVRTSP_REQ_SETPEERS, payload_make_setpeers, NULL, "/peer-list-changed", NULL, false },
-    { AIRPLAY_SEQ_START_PLAYBACK, "SETUP (stream)", EVRTSP_REQ_SETUP, payload_make_setup_stream, response_handler_setup_stream, "application/x-apple-binary-plist", NULL, false },
+    // proceed_on_rtsp_not_ok is true so that the handler can retry with ALAC
+    // if the device doesn't accept LPCM
+    { AIRPLAY_SEQ_START_PLAYBACK, "SETUP (stream)", EVRTSP_REQ_SETUP, payload_make_setup_stream, response_handler_setup_stream, "application/x-apple-binary-plist", NULL, true },
     { AIRPLAY_SEQ_START_PLAYBACK, "RECORD", EVRTSP_REQ_RECORD, payload_make_record, response_handler_record, NULL, NULL, false },
     // Some devices (e.g. Sonos Symfonisk) don't register the volume if it isn't last
     { AIRPLAY_SEQ_START_PLAYBACK, "SET_PARAMETER (volume)", EVRTSP_REQ_SET_PARAMETER, payload_make_set_volume, response_handler_volume_start, "text/parameters", NULL, true },
@@ -3404,6 +5736,8 @@ static struct airplay_seq_request airplay_seq_request[][7] =
     { AIRPLAY_SEQ_PROBE, "GET /info (probe)", EVRTSP_REQ_GET, NULL, response_handler_info_probe, NULL, "/info", false },
   },
   {
+    // Buffered receivers need to be told to stop playing what they have
+    { AIRPLAY_SEQ_FLUSH, "SETRATEANCHORTIME (pause)", EVRTSP_REQ_SETRATEANCHORTIME, payload_make_anchor_pause, NULL, "application/x-apple-binary-plist", NULL, false },
     { AIRPLAY_SEQ_FLUSH, "FLUSH", EVRTSP_REQ_FLUSH, payload_make_flush, response_handler_flush, NULL, NULL, false },
   },
   {
@@ -3445,6 +5779,15 @@ static struct airplay_seq_request airplay_seq_request[][7] =
   {
     { AIRPLAY_SEQ_FEEDBACK, "POST /feedback", EVRTSP_REQ_POST, NULL, NULL, NULL, "/feedback", true },
   },
+  {
+    // Remainder of the START_PLAYBACK sequence, used for retrying stream setup
+    { AIRPLAY_SEQ_SETUP_STREAM, "SETUP (stream)", EVRTSP_REQ_SETUP, payload_make_setup_stream, response_handler_setup_stream, "application/x-apple-binary-plist", NULL, false },
+    { AIRPLAY_SEQ_SETUP_STREAM, "RECORD", EVRTSP_REQ_RECORD, payload_make_record, response_handler_record, NULL, NULL, false },
+    { AIRPLAY_SEQ_SETUP_STREAM, "SET_PARAMETER (volume)", EVRTSP_REQ_SET_PARAMETER, payload_make_set_volume, response_handler_volume_start, "text/parameters", NULL, true },
+  },
+  {
+    { AIRPLAY_SEQ_SEND_ANCHOR, "SETRATEANCHORTIME", EVRTSP_REQ_SETRATEANCHORTIME, payload_make_anchor_play, NULL, "application/x-apple-binary-plist", NULL, false },
+  },
 };
 
 
@@ -3474,7 +5817,10 @@ sequence_continue_cb(struct evrtsp_request *req, void *arg)
 	  goto error;
 	}
 
-      DPRINTF(E_WARN, L_AIRPLAY, "Response to %s from '%s' was negative, proceeding anyway (%d %s)\n", cur_request->name, rs->devname, req->response_code, req->response_code_line);
+      // The SETUP (stream) handler either falls back to ALAC or aborts, and
+      // logs which
+      if (cur_request->response_handler != response_handler_setup_stream)
+	DPRINTF(E_WARN, L_AIRPLAY, "Response to %s from '%s' was negative, proceeding anyway (%d %s)\n", cur_request->name, rs->devname, req->response_code, req->response_code_line);
     }
 
   // We don't check that the reply CSeq matches the request CSeq, because some
@@ -3797,6 +6143,12 @@ airplay_device_cb(const char *name, const char *type, const char *domain, const
     re->wanted_metadata |= AIRPLAY_MD_WANTS_TEXT;
   if (keyval_get(&features_kv, "Authentication_8"))
     re->supports_auth_setup = 1;
+  if (keyval_get(&features_kv, "SupportsPTP"))
+    re->supports_ptp = 1;
+  if (keyval_get(&features_kv, "SupportsBufferedAudio"))
+    re->supports_buffered_audio = 1;
+  if (keyval_get(&features_kv, "SupportsRFC2198Redundancy"))
+    re->supports_rfc2198_redundancy = 1;
 
   if (keyval_get(&features_kv, "SupportsSystemPairing") || keyval_get(&features_kv, "SupportsCoreUtilsPairingAndEncryption"))
     re->supports_pairing_transient = 1;
@@ -3805,6 +6157,23 @@ airplay_device_cb(const char *name, const char *type, const char *domain, const
 
   keyval_clear(&features_kv);
 
+  cfgopt = devcfg ? cfg_getopt(devcfg, "lpcm") : NULL;
+  if (cfgopt && cfgopt->nvalues == 1)
+    re->wants_lpcm = cfg_opt_getnbool(cfgopt, 0);
+  else
+    re->wants_lpcm = cfg_getbool(cfg_getsec(cfg, "airplay_shared"), "lpcm");
+
+  cfgopt = devcfg ? cfg_getopt(devcfg, "redundancy") : NULL;
+  if (cfgopt && cfgopt->nvalues == 1)
+    re->redundancy = cfg_opt_getnint(cfgopt, 0);
+  else
+    re->redundancy = cfg_getint(cfg_getsec(cfg, "airplay_shared"), "redundancy");
+
+  if (devcfg && cfg_getstr(devcfg, "resampler"))
+    re->resampler = resampler_from_string(cfg_getstr(devcfg, "resampler"), name);
+  else
+    re->resampler = resampler_from_string(cfg_getstr(cfg_getsec(cfg, "airplay_shared"), "resampler"), name);
+
   // Only default audio quality supported so far
   rd->quality.sample_rate = AIRPLAY_QUALITY_SAMPLE_RATE_DEFAULT;
   rd->quality.bits_per_sample = AIRPLAY_QUALITY_BITS_PER_SAMPLE_DEFAULT;
@@ -3911,7 +6280,10 @@ airplay_device_start(struct output_device *device, int callback_id)
 static int
 airplay_device_stop(struct output_device *device, int callback_id)
 {
-  struct airplay_session *rs = device->session;
+  struct airplay_session *rs = session_find_by_device_id(device->id);
+
+  if (!rs)
+    return 0; // No session, so already stopped
 
   rs->callback_id = callback_id;
 
@@ -3923,9 +6295,9 @@ airplay_device_stop(struct output_device *device, int callback_id)
 static int
 airplay_device_flush(struct output_device *device, int callback_id)
 {
-  struct airplay_session *rs = device->session;
+  struct airplay_session *rs = session_find_by_device_id(device->id);
 
-  if (rs->state != AIRPLAY_STATE_STREAMING)
+  if (!rs || rs->state != AIRPLAY_STATE_STREAMING)
     return 0; // No-op, nothing to flush
 
   rs->callback_id = callback_id;
@@ -3938,9 +6310,10 @@ airplay_device_flush(struct output_device *device, int callback_id)
 static void
 airplay_device_cb_set(struct output_device *device, int callback_id)
 {
-  struct airplay_session *rs = device->session;
+  struct airplay_session *rs = session_find_by_device_id(device->id);
 
-  rs->callback_id = callback_id;
+  if (rs)
+    rs->callback_id = callback_id;
 }
 
 static void
@@ -3972,6 +6345,7 @@ airplay_write(struct output_buffer *obuf)
 {
   struct airplay_master_session *rms;
   struct airplay_session *rs;
+  bool more;
   int i;
 
   for (rms = airplay_master_sessions; rms; rms = rms->next)
@@ -3988,19 +6362,35 @@ airplay_write(struct output_buffer *obuf)
 	  // Sends sync packets to new sessions, and if it is sync time then also to old sessions
 	  packets_sync_send(rms);
 
-	  // TODO avoid this copy
-	  evbuffer_add(rms->input_buffer, obuf->data[i].buffer, obuf->data[i].bufsize);
+	  // Packets are encoded straight from the player's buffer, see input_slice_get()
+	  rms->input_direct = obuf->data[i].buffer;
+	  rms->input_direct_len = obuf->data[i].bufsize;
 	  rms->input_buffer_samples += obuf->data[i].samples;
+	}
+    }
 
-	  // Send as many packets as we have data for (one packet requires rawbuf_size bytes)
-	  while (evbuffer_get_length(rms->input_buffer) >= rms->rawbuf_size)
-	    {
-	      evbuffer_remove(rms->input_buffer, rms->rawbuf, rms->rawbuf_size);
-	      rms->input_buffer_samples -= rms->samples_per_packet;
+  // Send as many packets as we have data for (one packet requires rawbuf_size
+  // bytes). The qualities are encoded in parallel, but sending is done from
+  // here, since the sessions share the send batch.
+  do
+    {
+      more = master_sessions_encode();
 
-	      packets_send(rms);
-	    }
-	}
+      for (rms = airplay_master_sessions; rms; rms = rms->next)
+	packets_send(rms);
+    }
+  while (more);
+
+  for (rms = airplay_master_sessions; rms; rms = rms->next)
+    input_direct_stash(rms);
+
+  // One sendmmsg() for all the sync and audio packets collected above
+  packets_flush();
+
+  for (rs = airplay_sessions; rs; rs = rs->next)
+    {
+      if (rs->buffered && rs->buffered_out)
+	buffered_flush(rs, rs->state == AIRPLAY_STATE_CONNECTED);
     }
 
   // Check for devices that have joined since last write (we have already sent them
@@ -4015,10 +6405,179 @@ airplay_write(struct output_buffer *obuf)
 	evtimer_add(keep_alive_timer, &keep_alive_tv);
 
       rs->state = AIRPLAY_STATE_STREAMING;
+
+      // The receiver now has audio, so tell it when to play it
+      if (rs->buffered)
+	sequence_start(AIRPLAY_SEQ_SEND_ANCHOR, rs, NULL, "anchor");
       // Make a cb?
     }
 }
 
+// Receiver side of the redundancy self test. Marks the packet as received and
+// the packets it has redundant copies of as recovered. Returns -1 if a block
+// is not a copy of the primary encoding of the packet it claims to be.
+static int
+redundancy_selftest_receive(bool *have, uint16_t first_seqnum, struct rtp_session *rtp_session, struct rtp_packet *pkt, int samples_per_packet)
+{
+  struct rtp_packet *orig;
+  uint32_t offset[RTP_RED_DEPTH_MAX];
+  uint32_t len[RTP_RED_DEPTH_MAX];
+  uint32_t hdr;
+  uint16_t seqnum;
+  uint8_t *ptr;
+  int n;
+  int i;
+
+  have[(uint16_t)(pkt->seqnum - first_seqnum)] = true;
+
+  if ((pkt->header[1] & 0x7f) != AIRPLAY_RTP_PAYLOADTYPE_RED)
+    return 0;
+
+  ptr = pkt->payload;
+  for (n = 0; *ptr & 0x80; n++)
+    {
+      if (n == RTP_RED_DEPTH_MAX)
+	return -1;
+
+      memcpy(&hdr, ptr, 4);
+      hdr = be32toh(hdr);
+      offset[n] = (hdr >> 10) & 0x3fff;
+      len[n] = hdr & 0x3ff;
+      ptr += 4;
+    }
+
+  // Header of the primary
+  ptr++;
+
+  for (i = 0; i < n; i++)
+    {
+      seqnum = pkt->seqnum - offset[i] / samples_per_packet;
+      orig = rtp_packet_get(rtp_session, seqnum);
+      if (!orig || orig->primary_len != len[i] || memcmp(orig->primary, ptr, len[i]) != 0)
+	return -1;
+
+      have[(uint16_t)(seqnum - first_seqnum)] = true;
+      ptr += len[i];
+    }
+
+  return (ptr == pkt->primary) ? 0 : -1;
+}
+
+int
+airplay_redundancy_selftest(int loss_percent)
+{
+  struct airplay_master_session *rms;
+  struct rtp_packet *pkt;
+  uint16_t first_seqnum;
+  uint32_t loss_seed;
+  uint32_t noise_seed;
+  uint64_t frame_bytes;
+  int16_t *pcm;
+  bool *have;
+  bool lost;
+  int missing[AIRPLAY_SELFTEST_RED_DEPTH_MAX + 1];
+  int lost_count;
+  int depth;
+  int ret;
+  int i;
+  int j;
+
+  CHECK_NULL(L_AIRPLAY, pcm = malloc(AIRPLAY_SAMPLES_PER_PACKET * 2 * sizeof(int16_t)));
+  CHECK_NULL(L_AIRPLAY, have = malloc(AIRPLAY_SELFTEST_PACKETS * sizeof(bool)));
+
+  ret = 0;
+  for (depth = 0; depth <= AIRPLAY_SELFTEST_RED_DEPTH_MAX; depth++)
+    {
+      rms = master_session_make(&airplay_quality_default, MEDIA_FORMAT_ALAC, depth, OUTPUT_RESAMPLER_BALANCED);
+      if (!rms)
+	{
+	  ret = -1;
+	  break;
+	}
+
+      rms->sessions_count++;
+
+      memset(have, 0, AIRPLAY_SELFTEST_PACKETS * sizeof(bool));
+      first_seqnum = rms->rtp_session->seqnum;
+
+      // Same audio and same losses for each depth
+      loss_seed = 1;
+      noise_seed = 1;
+      lost_count = 0;
+      frame_bytes = 0;
+
+      for (i = 0; i < AIRPLAY_SELFTEST_PACKETS && ret == 0; i++)
+	{
+	  // A quiet tone with a bit of noise, so that frames are small enough to
+	  // carry previous ones, like with most music at a moderate volume
+	  for (j = 0; j < AIRPLAY_SAMPLES_PER_PACKET; j++)
+	    {
+	      noise_seed = noise_seed * 1103515245 + 12345;
+	      pcm[2 * j] = 2000 * sin(2 * M_PI * 440 * (i * AIRPLAY_SAMPLES_PER_PACKET + j) / 44100.0) + (int)((noise_seed >> 16) & 0x3f) - 32;
+	      pcm[2 * j + 1] = pcm[2 * j];
+	    }
+
+	  ret = packet_encode(rms, (uint8_t *)pcm);
+	  if (ret < 0)
+	    break;
+
+	  pkt = rtp_packet_get(rms->rtp_session, rms->rtp_session->seqnum - 1);
+	  frame_bytes += pkt->primary_len;
+
+	  loss_seed = loss_seed * 1103515245 + 12345;
+	  lost = ((loss_seed >> 16) % 100) < loss_percent;
+	  if (lost)
+	    {
+	      lost_count++;
+	      continue;
+	    }
+
+	  ret = redundancy_selftest_receive(have, first_seqnum, rms->rtp_session, pkt, rms->samples_per_packet);
+	  if (ret < 0)
+	    DPRINTF(E_LOG, L_AIRPLAY, "Redundancy self test: Bad redundant block in packet %" PRIu16 "\n", pkt->seqnum);
+	}
+
+      // The receiver would ask for a retransmit of anything it didn't get
+      missing[depth] = 0;
+      for (i = 0; i < AIRPLAY_SELFTEST_PACKETS; i++)
+	{
+	  if (!have[i])
+	    missing[depth]++;
+	}
+
+      if (ret == 0)
+	DPRINTF(E_LOG, L_AIRPLAY, "Redundancy self test: Depth %d, %d%% loss, avg frame %" PRIu64 " bytes: %d of %d packets lost, "
+	  "%d retransmits (%" PRIu64 " of %" PRIu64 " packets carried previous frames)\n", depth, loss_percent, frame_bytes / AIRPLAY_SELFTEST_PACKETS,
+	  lost_count, AIRPLAY_SELFTEST_PACKETS, missing[depth], rms->red_packets_covered, rms->red_packets);
+
+      master_session_cleanup(rms);
+
+      if (ret < 0)
+	break;
+
+      if (depth > 0 && lost_count > 0 && missing[depth] >= missing[0])
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Redundancy self test: Depth %d did not reduce the number of retransmits\n", depth);
+	  ret = -1;
+	  break;
+	}
+    }
+
+  free(have);
+  free(pcm);
+  return ret;
+}
+
+void
+airplay_resend_stats_get(struct airplay_resend_stats *stats)
+{
+  stats->requested = __atomic_load_n(&airplay_resend_stats.requested, __ATOMIC_RELAXED);
+  stats->sent = __atomic_load_n(&airplay_resend_stats.sent, __ATOMIC_RELAXED);
+  stats->suppressed = __atomic_load_n(&airplay_resend_stats.suppressed, __ATOMIC_RELAXED);
+  stats->throttled = __atomic_load_n(&airplay_resend_stats.throttled, __ATOMIC_RELAXED);
+  stats->out_of_buffer = __atomic_load_n(&airplay_resend_stats.out_of_buffer, __ATOMIC_RELAXED);
+}
+
 static int
 airplay_init(void)
 {
@@ -4026,6 +6585,7 @@ airplay_init(void)
   int i;
   int timing_port;
   int control_port;
+  int probe_fd;
 
   airplay_device_id = libhash;
 
@@ -4041,9 +6601,13 @@ airplay_init(void)
     }
 
   CHECK_NULL(L_AIRPLAY, keep_alive_timer = evtimer_new(evbase_player, airplay_keep_alive_timer_cb, NULL));
+  CHECK_NULL(L_AIRPLAY, airplay_pacing_timer = evtimer_new(evbase_player, pacing_timer_cb, NULL));
+
+  hashidx_init(&airplay_sessions_by_addr, AIRPLAY_SESSIONS_INDEX_SIZE);
+  hashidx_init(&airplay_sessions_by_device, AIRPLAY_SESSIONS_INDEX_SIZE);
 
   timing_port = cfg_getint(cfg_getsec(cfg, "airplay_shared"), "timing_port");
-  ret = service_start(&airplay_timing_svc, timing_svc_cb, timing_port, "AirPlay timing");
+  ret = timing_service_start(timing_port);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "AirPlay time synchronization failed to start\n");
@@ -4051,18 +6615,86 @@ airplay_init(void)
     }
 
   control_port = cfg_getint(cfg_getsec(cfg, "airplay_shared"), "control_port");
-  ret = service_start(&airplay_control_svc, control_svc_cb, control_port, "AirPlay control");
+  ret = service_start(&airplay_control_svc, evbase_player, control_svc_cb, control_port, "AirPlay control");
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "AirPlay playback control failed to start\n");
       goto out_stop_timing;
     }
 
+  // Audio is sent on each session's connected socket, so the kernel features
+  // are checked with a throwaway socket
+  probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  airplay_udp_gso = false;
+#if AIRPLAY_USE_UDP_GSO
+  if (probe_fd >= 0 && cfg_getbool(cfg_getsec(cfg, "airplay_shared"), "udp_gso"))
+    {
+      // A zero segment size is a no-op, but tells us if the kernel knows GSO
+      int gso_size = 0;
+
+      ret = setsockopt(probe_fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+      if (ret < 0)
+	DPRINTF(E_WARN, L_AIRPLAY, "UDP GSO requested but not supported by the kernel: %s\n", strerror(errno));
+      else
+	airplay_udp_gso = true;
+    }
+#endif
+
+  airplay_pacing = AIRPLAY_PACING_OFF;
+  if (cfg_getbool(cfg_getsec(cfg, "airplay_shared"), "paced_send"))
+    {
+#if AIRPLAY_USE_SO_TXTIME
+      struct sock_txtime txtime_cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+
+      ret = (probe_fd >= 0) ? setsockopt(probe_fd, SOL_SOCKET, SO_TXTIME, &txtime_cfg, sizeof(txtime_cfg)) : -1;
+      if (ret < 0)
+	DPRINTF(E_WARN, L_AIRPLAY, "SO_TXTIME not supported by the kernel (%s), will pace audio with a timer\n", strerror(errno));
+      else
+	airplay_pacing = AIRPLAY_PACING_TXTIME;
+#endif
+      if (airplay_pacing == AIRPLAY_PACING_OFF)
+	airplay_pacing = AIRPLAY_PACING_TIMER;
+
+      if (airplay_udp_gso)
+	DPRINTF(E_INFO, L_AIRPLAY, "Not using UDP GSO, since audio is paced\n");
+      airplay_udp_gso = false;
+    }
+
+  if (probe_fd >= 0)
+    close(probe_fd);
+
+  // Falls back to sendmmsg() if not built with liburing or not supported by
+  // the kernel. Sends are not paced or segmented when using io_uring.
+  if (cfg_getbool(cfg_getsec(cfg, "airplay_shared"), "io_uring"))
+    {
+      ret = airplay_uring_init(AIRPLAY_URING_ENTRIES, AIRPLAY_URING_BUFFERS_MAX, uring_send_error_cb);
+      if (ret < 0)
+	DPRINTF(E_WARN, L_AIRPLAY, "Could not use io_uring, will send audio with the default method\n");
+      else
+	{
+	  airplay_pacing = AIRPLAY_PACING_OFF;
+	  airplay_udp_gso = false;
+	}
+    }
+
+  memset(&airplay_send_stats, 0, sizeof(struct airplay_send_stats));
+  memset(&airplay_resend_stats, 0, sizeof(struct airplay_resend_stats));
+
+  // Not fatal either, without the pool all encoding is done by the player thread
+  airplay_encode_pool = evthr_pool_wexit_new(AIRPLAY_ENCODE_THREADS, NULL, NULL, NULL);
+  if (!airplay_encode_pool || evthr_pool_start(airplay_encode_pool) < 0)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "Could not start encoding threads, will encode serially\n");
+      evthr_pool_free(airplay_encode_pool);
+      airplay_encode_pool = NULL;
+    }
+
   ret = airplay_events_init();
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_AIRPLAY, "AirPlay events failed to start\n");
-      goto out_stop_control;
+      goto out_stop_data;
     }
 
   ret = mdns_browse("_airplay._tcp", airplay_device_cb, MDNS_CONNECTION_TEST);
@@ -4076,12 +6708,22 @@ airplay_init(void)
 
  out_stop_events:
   airplay_events_deinit();
- out_stop_control:
+ out_stop_data:
+  airplay_uring_deinit();
+  if (airplay_encode_pool)
+    {
+      evthr_pool_stop(airplay_encode_pool);
+      evthr_pool_free(airplay_encode_pool);
+      airplay_encode_pool = NULL;
+    }
   service_stop(&airplay_control_svc);
  out_stop_timing:
-  service_stop(&airplay_timing_svc);
+  timing_service_stop();
  out_free_timer:
+  hashidx_free(&airplay_sessions_by_addr);
+  hashidx_free(&airplay_sessions_by_device);
   event_free(keep_alive_timer);
+  event_free(airplay_pacing_timer);
 
   return -1;
 }
@@ -4091,11 +6733,37 @@ airplay_deinit(void)
 {
   struct airplay_session *rs;
 
+  // Before the sessions, since it waits for sends from their packet rings, and
+  // before the control service, whose socket the sync packets are sent on
+  airplay_uring_deinit();
+
   airplay_events_deinit();
   service_stop(&airplay_control_svc);
-  service_stop(&airplay_timing_svc);
+  timing_service_stop();
+
+  if (airplay_encode_pool)
+    {
+      evthr_pool_stop(airplay_encode_pool);
+      evthr_pool_free(airplay_encode_pool);
+      airplay_encode_pool = NULL;
+    }
+
+  if (airplay_send_stats.flushes > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Audio send stats (%s): %" PRIu64 " packets, %" PRIu64 " syscalls, %" PRIu64 " ns per write\n",
+      airplay_uring_is_active() ? "io_uring" : (airplay_pacing == AIRPLAY_PACING_TXTIME) ? "txtime" : (airplay_pacing == AIRPLAY_PACING_TIMER) ? "timer paced" : airplay_udp_gso ? "gso" : "batched",
+      airplay_send_stats.packets, airplay_send_stats.syscalls,
+      airplay_send_stats.flush_nsec / airplay_send_stats.flushes);
+  if (airplay_send_stats.gso_msgs > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "UDP GSO: %.1f packets per message, %" PRIu64 " bytes of ALAC padding\n",
+      (double)airplay_send_stats.packets / airplay_send_stats.gso_msgs, airplay_send_stats.gso_padding);
+
+  if (airplay_resend_stats.requested > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "Retransmit stats: %" PRIu64 " requested, %" PRIu64 " sent, %" PRIu64 " suppressed, %" PRIu64 " throttled, %" PRIu64 " out of buffer\n",
+      airplay_resend_stats.requested, airplay_resend_stats.sent, airplay_resend_stats.suppressed,
+      airplay_resend_stats.throttled, airplay_resend_stats.out_of_buffer);
 
   event_free(keep_alive_timer);
+  event_free(airplay_pacing_timer);
 
   for (rs = airplay_sessions; airplay_sessions; rs = airplay_sessions)
     {
@@ -4103,6 +6771,9 @@ airplay_deinit(void)
 
       session_free(rs);
     }
+
+  hashidx_free(&airplay_sessions_by_addr);
+  hashidx_free(&airplay_sessions_by_device);
 }
 
 struct output_definition output_airplay =
@@ -4152,33 +6823,36 @@ uint64_t airplay_get_ntp(struct ntp_timestamp* ntp)
 }
 
 /* ---------------------------- Module management ------------------------ */
+static void
+airplay_create_cb(int fd, short what, void *arg)
+{
+  struct output_device *dev = arg;
+
+  DPRINTF(E_DBG, L_AIRPLAY, "About to call airplay_device_start()\n");
+  airplay_device_start(dev, 0);
+}
+
 int airplay_create(struct output_device *dev, char *DACP_id)
 {
   int ret;
 
   DPRINTF(E_DBG, L_AIRPLAY, "Creating AirPlay session for host %s with DACP ID '%s'\n", dev->name, DACP_id);
-  
-  ret = airplay_init();
+
+  // The module itself is initialised by the player through outputs_init(). The
+  // sessions belong to the player thread, so start the device from there.
+  ret = event_base_once(evbase_player, -1, EV_TIMEOUT, airplay_create_cb, dev, NULL);
   if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_MAIN, "AirPlay init failed\n");
-      goto airplay_fail;
+      DPRINTF(E_FATAL, L_AIRPLAY, "Could not schedule start of AirPlay device %s\n", dev->name);
+      return -1;
     }
-  DPRINTF(E_DBG, L_AIRPLAY, "AirPlay init succeeded\n");
-
-  DPRINTF(E_DBG, L_AIRPLAY, "About to call airplay_device_start()\n");
-  airplay_device_start(dev, 0);
-  DPRINTF(E_DBG, L_AIRPLAY, "AirPlay session created for host %s with DACP ID '%s'\n", dev->name, DACP_id);
-	return 0;
 
-airplay_fail:
-  airplay_deinit();
-  return ret;
+  return 0;
 }
 
+// The module is deinitialised by the player through outputs_deinit()
 int airplay_destroy(void)
 {
   DPRINTF(E_DBG, L_AIRPLAY, "Destroying AirPlay session\n");
-  airplay_deinit();
   return 0;
 }
\ No newline at end of file
@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include "misc.h"
 #include "rtp_common.h"
+#include "outputs.h"
 
 #define DEFAULT_FRAMES_PER_CHUNK 352
 
@@ -64,6 +65,16 @@ struct airplay_extra
   uint16_t wanted_metadata;
   bool supports_auth_setup;
   bool supports_pairing_transient;
+  bool supports_ptp;
+  bool supports_buffered_audio;
+  bool supports_rfc2198_redundancy;
+
+  // Stream uncompressed LPCM instead of ALAC, if the device accepts it
+  bool wants_lpcm;
+  // Number of previous frames to repeat in each packet (RFC 2198), 0 is off
+  int redundancy;
+  // How the player's audio is resampled if the rate differs from the device's
+  enum output_resampler resampler;
 };
 
 /* NTP timestamp definitions */
@@ -73,6 +84,25 @@ struct airplay_extra
 #define MS2NTP(ms) (((((uint64_t) (ms)) << 22) / 1000) << 10)
 #define MS2TS(ms, rate) ((((uint64_t) (ms)) * (rate)) / 1000)
 
+// Retransmit counters in packets, summed over all devices since airplay_init()
+struct airplay_resend_stats
+{
+  uint64_t requested;
+  uint64_t sent;
+  // Resent recently, so not sent again
+  uint64_t suppressed;
+  // Over the device's budget
+  uint64_t throttled;
+  // No longer (or not yet) in the packet buffer
+  uint64_t out_of_buffer;
+};
+
 uint64_t airplay_get_ntp(struct ntp_timestamp* ntp);
+// Safe to call from any thread
+void airplay_resend_stats_get(struct airplay_resend_stats *stats);
+// Encodes a test tone with redundancy depth 0, 1 and 2 and sends it through a
+// simulated link with the given packet loss. Returns 0 if the receiver needs
+// fewer retransmits with redundancy. Call before airplay_init().
+int airplay_redundancy_selftest(int loss_percent);
 int airplay_create(struct output_device *dev, char *DACP_id);
 int airplay_destroy(void);
\ No newline at end of file
@@ -0,0 +1,932 @@
+/*
+ * Minimal IEEE 1588 (PTPv2) master for AirPlay 2 receivers that announce
+ * SupportsPTP. We only act as master, with unicast to the receivers of the
+ * session: two-step Sync + Follow_Up and Announce, and Delay_Resp to the
+ * receivers' Delay_Req. The timescale is CLOCK_MONOTONIC, same as the NTP
+ * timing service, so RTP sync packets can use the same timestamps for both.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+
+#include "logger.h"
+#include "misc.h"
+#include "airplay_ptp.h"
+
+// If we can't bind the standard (privileged) ports we use these instead. A
+// receiver won't find us there, but a local test peer can.
+#define PTP_UNPRIVILEGED_PORT_OFFSET 10000
+
+// Sync interval is 2^-3 s, like Apple devices use. Announce every 8th Sync.
+#define PTP_SYNC_INTERVAL_MS     125
+#define PTP_SYNC_LOG_INTERVAL    -3
+#define PTP_ANNOUNCE_EACH_NSYNC  8
+#define PTP_ANNOUNCE_LOG_INTERVAL 0
+
+// Lower is better in the best master clock algorithm. Receivers usually
+// announce 248, so we should win.
+#define PTP_PRIORITY1            128
+#define PTP_PRIORITY2            128
+#define PTP_CLOCK_CLASS          248
+#define PTP_CLOCK_ACCURACY       0xfe // Unknown
+#define PTP_CLOCK_VARIANCE       0xffff
+#define PTP_TIME_SOURCE          0xa0 // Internal oscillator
+
+#define PTP_HEADER_LEN           34
+#define PTP_SYNC_LEN             44
+#define PTP_FOLLOW_UP_LEN        44
+#define PTP_DELAY_REQ_LEN        44
+#define PTP_DELAY_RESP_LEN       54
+#define PTP_ANNOUNCE_LEN         64
+
+#define PTP_FLAG_TWO_STEP        0x0200
+#define PTP_FLAG_UNICAST         0x0400
+
+// Master and slave share the clock in the self test, so the measured offset is
+// only the asymmetry of stamping in user space
+#define PTP_SELFTEST_OFFSET_MAX_NS 1000000
+
+enum ptp_msg_type
+{
+  PTP_MSG_SYNC       = 0x0,
+  PTP_MSG_DELAY_REQ  = 0x1,
+  PTP_MSG_FOLLOW_UP  = 0x8,
+  PTP_MSG_DELAY_RESP = 0x9,
+  PTP_MSG_ANNOUNCE   = 0xb,
+  PTP_MSG_SIGNALING  = 0xc,
+};
+
+// Deprecated in v2, but still required to be set
+enum ptp_control
+{
+  PTP_CONTROL_SYNC       = 0,
+  PTP_CONTROL_DELAY_REQ  = 1,
+  PTP_CONTROL_FOLLOW_UP  = 2,
+  PTP_CONTROL_DELAY_RESP = 3,
+  PTP_CONTROL_OTHER      = 5,
+};
+
+struct ptp_service
+{
+  int fd;
+  unsigned short port;
+  struct event *ev;
+};
+
+struct ptp_peer
+{
+  // Address in the family of our sockets, port not set
+  union net_sockaddr naddr;
+  socklen_t naddr_len;
+  unsigned short event_port;
+  unsigned short general_port;
+  // Sessions with this address, e.g. two devices behind the same receiver
+  int refcount;
+
+  struct ptp_peer *next;
+};
+
+struct ptp_stats
+{
+  uint64_t syncs;
+  uint64_t announces;
+  uint64_t delay_reqs;
+  uint64_t kernel_stamps;
+  uint64_t foreign_msgs;
+};
+
+static struct ptp_service ptp_event_svc = { .fd = -1 };
+static struct ptp_service ptp_general_svc = { .fd = -1 };
+static struct event *ptp_sync_timer;
+static int ptp_family;
+static uint64_t ptp_clock_id;
+
+static uint16_t ptp_sync_seqid;
+static uint16_t ptp_announce_seqid;
+static int ptp_sync_count;
+static struct ptp_stats ptp_stats;
+
+// Peers are added and removed by the player thread, but used by the thread
+// running the event base
+static struct ptp_peer *ptp_peers;
+static pthread_mutex_t ptp_peers_lck = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ------------------------------- Helpers ---------------------------------- */
+
+// Converts to the family of our sockets, so that addresses can be compared and
+// given to sendto(). Mapped ipv4 addresses are used if the sockets are ipv6.
+static int
+ptp_addr_normalize(union net_sockaddr *out, socklen_t *out_len, union net_sockaddr *in)
+{
+  memset(out, 0, sizeof(union net_sockaddr));
+
+  if (in->sa.sa_family == ptp_family)
+    {
+      memcpy(out, in, (ptp_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    }
+  else if (in->sa.sa_family == AF_INET && ptp_family == AF_INET6)
+    {
+      out->sin6.sin6_family = AF_INET6;
+      out->sin6.sin6_addr.s6_addr[10] = 0xff;
+      out->sin6.sin6_addr.s6_addr[11] = 0xff;
+      memcpy(out->sin6.sin6_addr.s6_addr + 12, &in->sin.sin_addr, 4);
+    }
+  else if (in->sa.sa_family == AF_INET6 && ptp_family == AF_INET && IN6_IS_ADDR_V4MAPPED(&in->sin6.sin6_addr))
+    {
+      out->sin.sin_family = AF_INET;
+      memcpy(&out->sin.sin_addr, in->sin6.sin6_addr.s6_addr + 12, 4);
+    }
+  else
+    return -1;
+
+  if (ptp_family == AF_INET6)
+    {
+      out->sin6.sin6_port = 0;
+      *out_len = sizeof(struct sockaddr_in6);
+    }
+  else
+    {
+      out->sin.sin_port = 0;
+      *out_len = sizeof(struct sockaddr_in);
+    }
+
+  return 0;
+}
+
+static bool
+ptp_addr_equal(union net_sockaddr *a, union net_sockaddr *b)
+{
+  if (a->sa.sa_family != b->sa.sa_family)
+    return false;
+  if (a->sa.sa_family == AF_INET6)
+    return (memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(struct in6_addr)) == 0);
+
+  return (a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr);
+}
+
+static void
+ptp_addr_port_set(union net_sockaddr *naddr, unsigned short port)
+{
+  if (naddr->sa.sa_family == AF_INET6)
+    naddr->sin6.sin6_port = htons(port);
+  else
+    naddr->sin.sin_port = htons(port);
+}
+
+// Must be called with ptp_peers_lck held
+static struct ptp_peer *
+ptp_peer_find(union net_sockaddr *naddr)
+{
+  struct ptp_peer *peer;
+
+  for (peer = ptp_peers; peer; peer = peer->next)
+    {
+      if (ptp_addr_equal(&peer->naddr, naddr))
+	return peer;
+    }
+
+  return NULL;
+}
+
+static inline void
+ptp_put16(uint8_t *p, uint16_t val)
+{
+  val = htobe16(val);
+  memcpy(p, &val, 2);
+}
+
+static inline void
+ptp_put32(uint8_t *p, uint32_t val)
+{
+  val = htobe32(val);
+  memcpy(p, &val, 4);
+}
+
+static inline void
+ptp_put64(uint8_t *p, uint64_t val)
+{
+  val = htobe64(val);
+  memcpy(p, &val, 8);
+}
+
+// PTP timestamps are 48 bit seconds and 32 bit nanoseconds
+static void
+ptp_timestamp_put(uint8_t *p, struct timespec *ts)
+{
+  uint64_t sec = (uint64_t)ts->tv_sec;
+
+  ptp_put16(p, (uint16_t)(sec >> 32));
+  ptp_put32(p + 2, (uint32_t)sec);
+  ptp_put32(p + 6, (uint32_t)ts->tv_nsec);
+}
+
+static void
+ptp_timestamp_get(struct timespec *ts, uint8_t *p)
+{
+  uint16_t sec_hi;
+  uint32_t sec_lo;
+  uint32_t nsec;
+
+  memcpy(&sec_hi, p, 2);
+  memcpy(&sec_lo, p + 2, 4);
+  memcpy(&nsec, p + 6, 4);
+
+  ts->tv_sec = ((uint64_t)be16toh(sec_hi) << 32) | be32toh(sec_lo);
+  ts->tv_nsec = be32toh(nsec);
+}
+
+static void
+ptp_header_make(uint8_t *buf, enum ptp_msg_type type, uint16_t len, uint16_t flags, uint16_t seqid, enum ptp_control control, int8_t log_interval)
+{
+  memset(buf, 0, len);
+
+  buf[0] = type & 0x0f;
+  buf[1] = 0x02; // versionPTP
+  ptp_put16(buf + 2, len);
+  buf[4] = 0; // domainNumber
+  ptp_put16(buf + 6, flags);
+  // correctionField (8-15) is zero
+  ptp_put64(buf + 20, ptp_clock_id); // sourcePortIdentity: clockIdentity
+  ptp_put16(buf + 28, 1);            // sourcePortIdentity: portNumber
+  ptp_put16(buf + 30, seqid);
+  buf[32] = control;
+  buf[33] = (uint8_t)log_interval;
+}
+
+static int
+ptp_send(struct ptp_service *svc, uint8_t *buf, size_t len, union net_sockaddr *naddr, socklen_t naddr_len, unsigned short port)
+{
+  union net_sockaddr dst = *naddr;
+  char address[INET6_ADDRSTRLEN];
+  int ret;
+
+  ptp_addr_port_set(&dst, port);
+
+  ret = sendto(svc->fd, buf, len, 0, &dst.sa, naddr_len);
+  if (ret < 0)
+    {
+      net_address_get(address, sizeof(address), &dst);
+      DPRINTF(E_DBG, L_AIRPLAY, "Could not send PTP message to %s: %s\n", address, strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/* --------------------------- Master messages ------------------------------ */
+
+static void
+ptp_sync_send(struct ptp_peer *peer, uint16_t seqid)
+{
+  uint8_t sync[PTP_SYNC_LEN];
+  uint8_t follow_up[PTP_FOLLOW_UP_LEN];
+  struct timespec ts;
+  int ret;
+
+  // Two-step, so the origin timestamp of the Sync is zero and the precise one
+  // goes in the Follow_Up
+  ptp_header_make(sync, PTP_MSG_SYNC, sizeof(sync), PTP_FLAG_TWO_STEP | PTP_FLAG_UNICAST, seqid, PTP_CONTROL_SYNC, PTP_SYNC_LOG_INTERVAL);
+
+  // As close to the send as possible
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  ret = ptp_send(&ptp_event_svc, sync, sizeof(sync), &peer->naddr, peer->naddr_len, peer->event_port);
+  if (ret < 0)
+    return;
+
+  ptp_header_make(follow_up, PTP_MSG_FOLLOW_UP, sizeof(follow_up), PTP_FLAG_UNICAST, seqid, PTP_CONTROL_FOLLOW_UP, PTP_SYNC_LOG_INTERVAL);
+  ptp_timestamp_put(follow_up + PTP_HEADER_LEN, &ts);
+
+  ptp_send(&ptp_general_svc, follow_up, sizeof(follow_up), &peer->naddr, peer->naddr_len, peer->general_port);
+}
+
+static void
+ptp_announce_send(struct ptp_peer *peer, uint16_t seqid)
+{
+  uint8_t announce[PTP_ANNOUNCE_LEN];
+  uint8_t *body = announce + PTP_HEADER_LEN;
+
+  ptp_header_make(announce, PTP_MSG_ANNOUNCE, sizeof(announce), PTP_FLAG_UNICAST, seqid, PTP_CONTROL_OTHER, PTP_ANNOUNCE_LOG_INTERVAL);
+
+  // originTimestamp (0-9) and currentUtcOffset (10-11) are zero, since our
+  // timescale is arbitrary
+  body[13] = PTP_PRIORITY1;
+  body[14] = PTP_CLOCK_CLASS;
+  body[15] = PTP_CLOCK_ACCURACY;
+  ptp_put16(body + 16, PTP_CLOCK_VARIANCE);
+  body[18] = PTP_PRIORITY2;
+  ptp_put64(body + 19, ptp_clock_id);
+  ptp_put16(body + 27, 0); // stepsRemoved
+  body[29] = PTP_TIME_SOURCE;
+
+  ptp_send(&ptp_general_svc, announce, sizeof(announce), &peer->naddr, peer->naddr_len, peer->general_port);
+}
+
+static void
+ptp_sync_timer_cb(int fd, short what, void *arg)
+{
+  struct ptp_peer *peer;
+  bool announce;
+
+  announce = (ptp_sync_count % PTP_ANNOUNCE_EACH_NSYNC == 0);
+  ptp_sync_count++;
+
+  pthread_mutex_lock(&ptp_peers_lck);
+  if (!ptp_peers)
+    {
+      pthread_mutex_unlock(&ptp_peers_lck);
+      return;
+    }
+
+  // Announce first, so a new peer knows who we are when the Sync arrives
+  if (announce)
+    {
+      for (peer = ptp_peers; peer; peer = peer->next)
+	ptp_announce_send(peer, ptp_announce_seqid);
+
+      ptp_announce_seqid++;
+      ptp_stats.announces++;
+    }
+
+  for (peer = ptp_peers; peer; peer = peer->next)
+    ptp_sync_send(peer, ptp_sync_seqid);
+
+  pthread_mutex_unlock(&ptp_peers_lck);
+
+  ptp_sync_seqid++;
+  ptp_stats.syncs++;
+}
+
+
+/* ---------------------------- Incoming messages --------------------------- */
+
+static void
+ptp_delay_req_handle(uint8_t *req, union net_sockaddr *peer_addr, socklen_t peer_addrlen, struct timespec *recv_ts)
+{
+  uint8_t res[PTP_DELAY_RESP_LEN];
+  struct ptp_peer *peer;
+  unsigned short port;
+  uint16_t seqid;
+
+  pthread_mutex_lock(&ptp_peers_lck);
+  peer = ptp_peer_find(peer_addr);
+  port = peer ? peer->general_port : AIRPLAY_PTP_GENERAL_PORT;
+  pthread_mutex_unlock(&ptp_peers_lck);
+
+  memcpy(&seqid, req + 30, 2);
+  seqid = be16toh(seqid);
+
+  ptp_header_make(res, PTP_MSG_DELAY_RESP, sizeof(res), PTP_FLAG_UNICAST, seqid, PTP_CONTROL_DELAY_RESP, PTP_SYNC_LOG_INTERVAL);
+
+  // Copy the domain and correction field, then add receiveTimestamp and the
+  // requestingPortIdentity
+  res[4] = req[4];
+  memcpy(res + 8, req + 8, 8);
+  ptp_timestamp_put(res + PTP_HEADER_LEN, recv_ts);
+  memcpy(res + PTP_HEADER_LEN + 10, req + 20, 10);
+
+  ptp_send(&ptp_general_svc, res, sizeof(res), peer_addr, peer_addrlen, port);
+
+  ptp_stats.delay_reqs++;
+}
+
+static void
+ptp_event_cb(int fd, short what, void *arg)
+{
+  union net_sockaddr peer_addr;
+  char address[INET6_ADDRSTRLEN];
+  uint8_t req[128];
+  uint8_t control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct timeval))];
+  struct iovec iov = { .iov_base = req, .iov_len = sizeof(req) };
+  struct msghdr msg;
+  struct timespec recv_ts;
+  int ret;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &peer_addr;
+  msg.msg_namelen = sizeof(peer_addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ret = recvmsg(fd, &msg, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Error reading PTP event message: %s\n", strerror(errno));
+      return;
+    }
+
+  if (ret < PTP_HEADER_LEN || (req[1] & 0x0f) != 2)
+    {
+      net_address_get(address, sizeof(address), &peer_addr);
+      DPRINTF(E_DBG, L_AIRPLAY, "Ignoring invalid PTP message from %s (size %d)\n", address, ret);
+      return;
+    }
+
+  if ((req[0] & 0x0f) != PTP_MSG_DELAY_REQ)
+    {
+      // Probably a Sync from a receiver that thinks it should be master
+      ptp_stats.foreign_msgs++;
+      return;
+    }
+
+  if (ret < PTP_DELAY_REQ_LEN)
+    return;
+
+  ret = net_rx_timestamp_get(&recv_ts, &msg);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get receive timestamp for PTP Delay_Req: %s\n", strerror(errno));
+      return;
+    }
+  else if (ret > 0)
+    ptp_stats.kernel_stamps++;
+
+  ptp_delay_req_handle(req, &peer_addr, msg.msg_namelen, &recv_ts);
+}
+
+static void
+ptp_general_cb(int fd, short what, void *arg)
+{
+  union net_sockaddr peer_addr;
+  socklen_t peer_addrlen = sizeof(peer_addr);
+  char address[INET6_ADDRSTRLEN];
+  uint8_t req[256];
+  uint64_t gm_id;
+  int ret;
+
+  ret = recvfrom(fd, req, sizeof(req), 0, &peer_addr.sa, &peer_addrlen);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Error reading PTP general message: %s\n", strerror(errno));
+      return;
+    }
+
+  if (ret < PTP_HEADER_LEN || (req[1] & 0x0f) != 2)
+    return;
+
+  ptp_stats.foreign_msgs++;
+
+  // We don't run the best master clock algorithm, but it is good to know if a
+  // receiver doesn't accept us as master
+  if ((req[0] & 0x0f) == PTP_MSG_ANNOUNCE && ret >= PTP_ANNOUNCE_LEN)
+    {
+      memcpy(&gm_id, req + PTP_HEADER_LEN + 19, 8);
+      gm_id = be64toh(gm_id);
+
+      net_address_get(address, sizeof(address), &peer_addr);
+      DPRINTF(E_SPAM, L_AIRPLAY, "PTP Announce from %s, grandmaster %016" PRIx64 " priority1 %u%s\n",
+	address, gm_id, req[PTP_HEADER_LEN + 13], (gm_id == ptp_clock_id) ? " (us)" : "");
+    }
+}
+
+
+/* -------------------------------- Self test ------------------------------- */
+
+// Local stand-in for a receiver (PTP slave), with the sockets on loopback
+struct ptp_selftest_slave
+{
+  int event_fd;
+  int general_fd;
+  unsigned short event_port;
+  unsigned short general_port;
+  uint64_t clock_id;
+};
+
+static int
+ptp_selftest_socket(unsigned short *port)
+{
+  struct sockaddr_in sin = { .sin_family = AF_INET };
+  socklen_t len = sizeof(sin);
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
+static int64_t
+ptp_selftest_ns(struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// Runs the engine's event base while waiting for a message of the given type
+// on fd. If seqid is not negative the message must also have that sequence id.
+// Returns the length, and stamps the arrival in ts.
+static int
+ptp_selftest_recv(struct event_base *evbase, int fd, enum ptp_msg_type type, int seqid, uint8_t *buf, size_t size, struct timespec *ts)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  struct timespec now;
+  struct timespec deadline;
+  uint16_t msg_seqid;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += 2;
+
+  do
+    {
+      event_base_loop(evbase, EVLOOP_NONBLOCK);
+
+      if (poll(&pfd, 1, 5) <= 0)
+	goto next;
+
+      ret = recv(fd, buf, size, 0);
+      clock_gettime(CLOCK_MONOTONIC, ts);
+      if (ret < PTP_HEADER_LEN || (buf[0] & 0x0f) != type)
+	goto next;
+
+      memcpy(&msg_seqid, buf + 30, 2);
+      if (seqid >= 0 && be16toh(msg_seqid) != seqid)
+	goto next;
+
+      return ret;
+
+     next:
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+  while (ptp_selftest_ns(&now) < ptp_selftest_ns(&deadline));
+
+  return -1;
+}
+
+// Plays one round of the delay request-response mechanism as the slave, and
+// returns the offset and path delay that the slave would compute
+static int
+ptp_selftest_round(struct event_base *evbase, struct ptp_selftest_slave *slave, int64_t *offset_ns, int64_t *delay_ns)
+{
+  union net_sockaddr master = { .sin = { .sin_family = AF_INET } };
+  uint8_t buf[256];
+  uint8_t req[PTP_DELAY_REQ_LEN];
+  struct timespec t1;
+  struct timespec t2;
+  struct timespec t3;
+  struct timespec t4;
+  struct timespec ts;
+  uint16_t seqid;
+  uint64_t id;
+  int ret;
+
+  // Sync is two-step, so t1 comes in the Follow_Up with the same sequence id
+  ret = ptp_selftest_recv(evbase, slave->event_fd, PTP_MSG_SYNC, -1, buf, sizeof(buf), &t2);
+  if (ret < PTP_SYNC_LEN)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: No Sync received\n");
+      return -1;
+    }
+
+  memcpy(&seqid, buf + 30, 2);
+  seqid = be16toh(seqid);
+
+  ret = ptp_selftest_recv(evbase, slave->general_fd, PTP_MSG_FOLLOW_UP, seqid, buf, sizeof(buf), &ts);
+  if (ret < PTP_FOLLOW_UP_LEN)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: No Follow_Up for Sync %hu\n", seqid);
+      return -1;
+    }
+
+  ptp_timestamp_get(&t1, buf + PTP_HEADER_LEN);
+
+  // Delay_Req with our own port identity, which the Delay_Resp must echo
+  ptp_header_make(req, PTP_MSG_DELAY_REQ, sizeof(req), 0, seqid, PTP_CONTROL_DELAY_REQ, 0x7f);
+  ptp_put64(req + 20, slave->clock_id);
+
+  master.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ptp_addr_port_set(&master, ptp_event_svc.port);
+
+  clock_gettime(CLOCK_MONOTONIC, &t3);
+
+  ret = sendto(slave->event_fd, req, sizeof(req), 0, &master.sa, sizeof(master.sin));
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: Could not send Delay_Req: %s\n", strerror(errno));
+      return -1;
+    }
+
+  ret = ptp_selftest_recv(evbase, slave->general_fd, PTP_MSG_DELAY_RESP, seqid, buf, sizeof(buf), &ts);
+  if (ret < PTP_DELAY_RESP_LEN)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: No Delay_Resp for Delay_Req %hu\n", seqid);
+      return -1;
+    }
+
+  memcpy(&id, buf + PTP_HEADER_LEN + 10, 8);
+  if (be64toh(id) != slave->clock_id)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: Delay_Resp is for %016" PRIx64 ", not us\n", be64toh(id));
+      return -1;
+    }
+
+  ptp_timestamp_get(&t4, buf + PTP_HEADER_LEN);
+
+  *offset_ns = ((ptp_selftest_ns(&t2) - ptp_selftest_ns(&t1)) - (ptp_selftest_ns(&t4) - ptp_selftest_ns(&t3))) / 2;
+  *delay_ns = ((ptp_selftest_ns(&t2) - ptp_selftest_ns(&t1)) + (ptp_selftest_ns(&t4) - ptp_selftest_ns(&t3))) / 2;
+
+  return 0;
+}
+
+/* ---------------------------------- API ----------------------------------- */
+
+int
+airplay_ptp_peer_add(union net_sockaddr *naddr, unsigned short event_port, unsigned short general_port)
+{
+  struct ptp_peer *peer;
+  union net_sockaddr addr;
+  socklen_t addr_len;
+  char address[INET6_ADDRSTRLEN];
+  int refcount;
+  int ret;
+
+  if (ptp_event_svc.fd < 0)
+    return -1;
+
+  ret = ptp_addr_normalize(&addr, &addr_len, naddr);
+  if (ret < 0)
+    {
+      net_address_get(address, sizeof(address), naddr);
+      DPRINTF(E_LOG, L_AIRPLAY, "Can't be PTP master for %s, address family not supported by our sockets\n", address);
+      return -1;
+    }
+
+  pthread_mutex_lock(&ptp_peers_lck);
+
+  peer = ptp_peer_find(&addr);
+  if (!peer)
+    {
+      CHECK_NULL(L_AIRPLAY, peer = calloc(1, sizeof(struct ptp_peer)));
+      peer->naddr = addr;
+      peer->naddr_len = addr_len;
+      peer->next = ptp_peers;
+      ptp_peers = peer;
+    }
+
+  peer->event_port = event_port;
+  peer->general_port = general_port;
+  refcount = ++peer->refcount;
+
+  pthread_mutex_unlock(&ptp_peers_lck);
+
+  net_address_get(address, sizeof(address), naddr);
+  DPRINTF(E_DBG, L_AIRPLAY, "Added PTP peer %s (ports %hu/%hu, %d sessions)\n", address, event_port, general_port, refcount);
+
+  return 0;
+}
+
+void
+airplay_ptp_peer_remove(union net_sockaddr *naddr)
+{
+  struct ptp_peer *peer;
+  struct ptp_peer *prev;
+  union net_sockaddr addr;
+  socklen_t addr_len;
+  int ret;
+
+  ret = ptp_addr_normalize(&addr, &addr_len, naddr);
+  if (ret < 0)
+    return;
+
+  pthread_mutex_lock(&ptp_peers_lck);
+
+  for (prev = NULL, peer = ptp_peers; peer; prev = peer, peer = peer->next)
+    {
+      if (!ptp_addr_equal(&peer->naddr, &addr))
+	continue;
+
+      peer->refcount--;
+      if (peer->refcount > 0)
+	break;
+
+      if (prev)
+	prev->next = peer->next;
+      else
+	ptp_peers = peer->next;
+
+      free(peer);
+      break;
+    }
+
+  pthread_mutex_unlock(&ptp_peers_lck);
+}
+
+bool
+airplay_ptp_is_available(void)
+{
+  return (ptp_event_svc.port == AIRPLAY_PTP_EVENT_PORT && ptp_general_svc.port == AIRPLAY_PTP_GENERAL_PORT);
+}
+
+uint64_t
+airplay_ptp_clock_id(void)
+{
+  return ptp_clock_id;
+}
+
+static void
+ptp_service_stop(struct ptp_service *svc)
+{
+  if (svc->ev)
+    event_free(svc->ev);
+
+  if (svc->fd >= 0)
+    close(svc->fd);
+
+  svc->ev = NULL;
+  svc->fd = -1;
+  svc->port = 0;
+}
+
+static int
+ptp_service_start(struct ptp_service *svc, struct event_base *evbase, event_callback_fn cb, unsigned short port, const char *log_service_name)
+{
+  unsigned short fallback_port = port + PTP_UNPRIVILEGED_PORT_OFFSET;
+
+  svc->fd = net_bind(&port, SOCK_DGRAM, log_service_name);
+  if (svc->fd < 0)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "Could not bind %s to port %hu, trying unprivileged port %hu\n", log_service_name, port, fallback_port);
+
+      port = fallback_port;
+      svc->fd = net_bind(&port, SOCK_DGRAM, log_service_name);
+      if (svc->fd < 0)
+	goto error;
+    }
+
+  CHECK_NULL(L_AIRPLAY, svc->ev = event_new(evbase, svc->fd, EV_READ | EV_PERSIST, cb, svc));
+  event_add(svc->ev, NULL);
+
+  svc->port = port;
+
+  return 0;
+
+ error:
+  ptp_service_stop(svc);
+  return -1;
+}
+
+int
+airplay_ptp_init(struct event_base *evbase, uint64_t clock_id)
+{
+  union net_sockaddr naddr;
+  socklen_t naddr_len = sizeof(naddr);
+  struct timeval tv = { .tv_sec = 0, .tv_usec = PTP_SYNC_INTERVAL_MS * 1000 };
+  int ret;
+
+  ptp_clock_id = clock_id;
+  ptp_sync_seqid = 0;
+  ptp_announce_seqid = 0;
+  ptp_sync_count = 0;
+  memset(&ptp_stats, 0, sizeof(struct ptp_stats));
+
+  ret = ptp_service_start(&ptp_event_svc, evbase, ptp_event_cb, AIRPLAY_PTP_EVENT_PORT, "PTP event");
+  if (ret < 0)
+    goto error;
+
+  ret = ptp_service_start(&ptp_general_svc, evbase, ptp_general_cb, AIRPLAY_PTP_GENERAL_PORT, "PTP general");
+  if (ret < 0)
+    goto error;
+
+  ret = getsockname(ptp_event_svc.fd, &naddr.sa, &naddr_len);
+  if (ret < 0)
+    goto error;
+
+  ptp_family = naddr.sa.sa_family;
+
+  // Not fatal, then Delay_Req are stamped when we read them
+  ret = net_rx_timestamps_enable(ptp_event_svc.fd);
+  if (ret < 0)
+    DPRINTF(E_WARN, L_AIRPLAY, "No kernel receive timestamps for PTP: %s\n", strerror(errno));
+
+  CHECK_NULL(L_AIRPLAY, ptp_sync_timer = event_new(evbase, -1, EV_PERSIST, ptp_sync_timer_cb, NULL));
+  event_add(ptp_sync_timer, &tv);
+
+  DPRINTF(E_INFO, L_AIRPLAY, "PTP master running on ports %hu/%hu with clock id %016" PRIx64 "\n", ptp_event_svc.port, ptp_general_svc.port, ptp_clock_id);
+
+  return 0;
+
+ error:
+  ptp_service_stop(&ptp_general_svc);
+  ptp_service_stop(&ptp_event_svc);
+  return -1;
+}
+
+void
+airplay_ptp_deinit(void)
+{
+  struct ptp_peer *peer;
+
+  if (ptp_sync_timer)
+    event_free(ptp_sync_timer);
+  ptp_sync_timer = NULL;
+
+  ptp_service_stop(&ptp_general_svc);
+  ptp_service_stop(&ptp_event_svc);
+
+  pthread_mutex_lock(&ptp_peers_lck);
+  while ((peer = ptp_peers))
+    {
+      ptp_peers = peer->next;
+      free(peer);
+    }
+  pthread_mutex_unlock(&ptp_peers_lck);
+
+  if (ptp_stats.syncs > 0)
+    DPRINTF(E_DBG, L_AIRPLAY, "PTP stats: %" PRIu64 " syncs, %" PRIu64 " announces, %" PRIu64 " delay requests (%" PRIu64 " kernel stamped), %" PRIu64 " foreign messages\n",
+      ptp_stats.syncs, ptp_stats.announces, ptp_stats.delay_reqs, ptp_stats.kernel_stamps, ptp_stats.foreign_msgs);
+}
+
+int
+airplay_ptp_selftest(int rounds)
+{
+  struct ptp_selftest_slave slave = { .event_fd = -1, .general_fd = -1, .clock_id = 0x5e1f7e57c10c0001ULL };
+  union net_sockaddr naddr = { .sin = { .sin_family = AF_INET } };
+  struct event_base *evbase;
+  int64_t offset_ns;
+  int64_t delay_ns;
+  int64_t offset_max = 0;
+  int ret = -1;
+  int i;
+
+  CHECK_NULL(L_AIRPLAY, evbase = event_base_new());
+
+  // Unless we are privileged this tests the fallback ports as well
+  if (airplay_ptp_init(evbase, 0x5e1f7e57c10c0000ULL) < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: Could not start the engine\n");
+      goto out;
+    }
+
+  slave.event_fd = ptp_selftest_socket(&slave.event_port);
+  slave.general_fd = ptp_selftest_socket(&slave.general_port);
+  if (slave.event_fd < 0 || slave.general_fd < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: Could not create loopback sockets: %s\n", strerror(errno));
+      goto out;
+    }
+
+  naddr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (airplay_ptp_peer_add(&naddr, slave.event_port, slave.general_port) < 0)
+    goto out;
+
+  for (i = 0; i < rounds; i++)
+    {
+      if (ptp_selftest_round(evbase, &slave, &offset_ns, &delay_ns) < 0)
+	goto out;
+
+      DPRINTF(E_DBG, L_AIRPLAY, "PTP self test: Round %d offset %" PRIi64 " ns, path delay %" PRIi64 " ns\n", i, offset_ns, delay_ns);
+
+      // Same clock on both ends, so anything but a small offset is a bug
+      if (offset_ns > PTP_SELFTEST_OFFSET_MAX_NS || offset_ns < -PTP_SELFTEST_OFFSET_MAX_NS || delay_ns < 0)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: Bad offset %" PRIi64 " ns or path delay %" PRIi64 " ns\n", offset_ns, delay_ns);
+	  goto out;
+	}
+
+      offset_max = MAX(offset_max, (offset_ns < 0) ? -offset_ns : offset_ns);
+    }
+
+  DPRINTF(E_LOG, L_AIRPLAY, "PTP self test: %d rounds of Sync, Follow_Up and Delay_Req/Delay_Resp on ports %hu/%hu ok, max offset %" PRIi64 " ns\n",
+    rounds, ptp_event_svc.port, ptp_general_svc.port, offset_max);
+
+  ret = 0;
+
+ out:
+  airplay_ptp_deinit();
+  if (slave.event_fd >= 0)
+    close(slave.event_fd);
+  if (slave.general_fd >= 0)
+    close(slave.general_fd);
+  event_base_free(evbase);
+  return ret;
+}
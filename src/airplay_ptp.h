@@ -0,0 +1,45 @@
+#ifndef __AIRPLAY_PTP_H__
+#define __AIRPLAY_PTP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// IEEE 1588 UDP ports for event (Sync, Delay_Req) and general messages
+#define AIRPLAY_PTP_EVENT_PORT   319
+#define AIRPLAY_PTP_GENERAL_PORT 320
+
+union net_sockaddr;
+struct event_base;
+
+// Adds a receiver that we should be master for. The ports are normally the
+// standard ports above, but may be something else for a local test peer.
+// Peers are counted per address, so each add must be matched by a remove.
+int
+airplay_ptp_peer_add(union net_sockaddr *naddr, unsigned short event_port, unsigned short general_port);
+
+void
+airplay_ptp_peer_remove(union net_sockaddr *naddr);
+
+// True if the engine is running on the standard ports, so receivers can use it
+bool
+airplay_ptp_is_available(void);
+
+// The clock is CLOCK_MONOTONIC, the same as the NTP timing service uses
+uint64_t
+airplay_ptp_clock_id(void);
+
+// The engine runs on the given event base, which must be dispatched by a
+// thread that does not block
+int
+airplay_ptp_init(struct event_base *evbase, uint64_t clock_id);
+
+void
+airplay_ptp_deinit(void);
+
+// Runs the engine against a slave stand-in on loopback, which does the given
+// number of Sync, Follow_Up and Delay_Req/Delay_Resp exchanges. Must not be
+// called while the engine is running. Returns 0 if all went as expected.
+int
+airplay_ptp_selftest(int rounds);
+
+#endif  /* !__AIRPLAY_PTP_H__ */
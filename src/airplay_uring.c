@@ -0,0 +1,463 @@
+/*
+ * Optional io_uring transmit backend for AirPlay audio. Sends are queued as
+ * SQEs and submitted with one syscall, and completions are reaped when the
+ * next batch is submitted, so the player thread doesn't wait for the network.
+ * Small packets are copied, so the caller doesn't have to wait either before it
+ * reuses its send buffers.
+ * Packets in registered buffers (the sessions' encrypted packet rings) are sent
+ * zero-copy if the kernel has IORING_OP_SEND_ZC (Linux 6.0+).
+ *
+ * Only built with liburing (HAVE_LIBURING), otherwise airplay_uring_init()
+ * fails and the caller uses the sendmmsg() path.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
+#include "logger.h"
+#include "misc.h"
+#include "airplay_uring.h"
+
+#ifdef HAVE_LIBURING
+
+#define URING_REAP_BATCH 64
+
+// A send that has not completed yet. IORING_OP_SENDMSG reads the msghdr when
+// the SQE is issued, so it is kept until the completion, and so is the address.
+// Small packets that are not in a registered buffer are copied, so the caller
+// can reuse its memory right away.
+struct uring_msg
+{
+  struct msghdr msg;
+  struct iovec iov;
+  union net_sockaddr addr;
+  uint64_t tag;
+  uint8_t copy[AIRPLAY_URING_COPY_LEN];
+};
+
+struct uring_stats
+{
+  uint64_t sends;
+  uint64_t sends_zc;
+  uint64_t submits;
+  uint64_t errors;
+  uint64_t waits;
+  uint64_t full;
+};
+
+static struct io_uring uring_ring;
+static bool uring_active;
+static bool uring_zc;
+static airplay_uring_error_cb uring_error_cb;
+
+// Registered buffers, iov_base is NULL for a free slot
+static struct iovec *uring_buffers;
+static unsigned uring_buffers_max;
+
+// The user_data of an SQE is the index of its message, which is returned to
+// the free list when the send completes
+static struct uring_msg *uring_msgs;
+static unsigned uring_msgs_size;
+static unsigned *uring_msgs_free;
+static unsigned uring_msgs_nfree;
+
+// Prepared but not submitted, submitted without completion, and zero-copy
+// sends where the kernel still uses the buffer
+static unsigned uring_queued;
+static unsigned uring_inflight;
+static unsigned uring_notifs;
+
+static struct uring_stats uring_stats;
+
+
+static void
+uring_cqe_handle(struct io_uring_cqe *cqe)
+{
+  struct uring_msg *m;
+
+  // Zero-copy send no longer uses the buffer. The message was already released
+  // with the send's own completion.
+  if (cqe->flags & IORING_CQE_F_NOTIF)
+    {
+      uring_notifs--;
+      return;
+    }
+
+  uring_inflight--;
+  if (cqe->flags & IORING_CQE_F_MORE)
+    uring_notifs++;
+
+  m = &uring_msgs[cqe->user_data];
+
+  if (cqe->res < 0)
+    {
+      uring_stats.errors++;
+      if (uring_error_cb)
+	uring_error_cb(m->tag, -cqe->res);
+    }
+
+  uring_msgs_free[uring_msgs_nfree++] = cqe->user_data;
+}
+
+static void
+uring_reap(void)
+{
+  struct io_uring_cqe *cqes[URING_REAP_BATCH];
+  unsigned n;
+  unsigned i;
+
+  do
+    {
+      n = io_uring_peek_batch_cqe(&uring_ring, cqes, URING_REAP_BATCH);
+      for (i = 0; i < n; i++)
+	uring_cqe_handle(cqes[i]);
+
+      io_uring_cq_advance(&uring_ring, n);
+    }
+  while (n == URING_REAP_BATCH);
+}
+
+// Waits until there are no sends in flight, and if with_notifs also until the
+// kernel is done with all zero-copy buffers
+static void
+uring_wait(bool with_notifs)
+{
+  struct io_uring_cqe *cqe;
+  int ret;
+
+  airplay_uring_submit();
+
+  // Can't wait for SQEs that the kernel didn't take
+  if (uring_queued > 0)
+    return;
+
+  if (uring_inflight > 0 || (with_notifs && uring_notifs > 0))
+    uring_stats.waits++;
+
+  while (uring_inflight > 0 || (with_notifs && uring_notifs > 0))
+    {
+      ret = io_uring_wait_cqe(&uring_ring, &cqe);
+      if (ret == -EINTR)
+	continue;
+      else if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_AIRPLAY, "Error waiting for io_uring completion: %s\n", strerror(-ret));
+	  return;
+	}
+
+      uring_cqe_handle(cqe);
+      io_uring_cqe_seen(&uring_ring, cqe);
+    }
+}
+
+int
+airplay_uring_sendto(int fd, const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen, int buf_index, uint64_t tag)
+{
+  struct io_uring_sqe *sqe;
+  struct uring_msg *m;
+  unsigned idx;
+
+  if (!uring_active)
+    return -1;
+
+  // A message must be free before we take an SQE, since a taken SQE will be
+  // submitted with the next io_uring_submit()
+  if (uring_msgs_nfree == 0)
+    {
+      airplay_uring_submit();
+      if (uring_msgs_nfree == 0)
+	{
+	  uring_stats.full++;
+	  errno = ENOBUFS;
+	  return -1;
+	}
+    }
+
+  // Ring is full, make room
+  sqe = io_uring_get_sqe(&uring_ring);
+  if (!sqe)
+    {
+      airplay_uring_submit();
+      sqe = io_uring_get_sqe(&uring_ring);
+      if (!sqe)
+	{
+	  errno = ENOBUFS;
+	  return -1;
+	}
+    }
+
+  idx = uring_msgs_free[--uring_msgs_nfree];
+  m = &uring_msgs[idx];
+  m->tag = tag;
+
+  if (buf_index < 0 && len <= sizeof(m->copy))
+    {
+      memcpy(m->copy, buf, len);
+      buf = m->copy;
+    }
+
+  if (addr)
+    {
+      addrlen = MIN(addrlen, sizeof(m->addr));
+      memcpy(&m->addr, addr, addrlen);
+    }
+
+  if (buf_index >= 0 && uring_zc)
+    {
+      io_uring_prep_send_zc_fixed(sqe, fd, buf, len, 0, 0, buf_index);
+      if (addr)
+	io_uring_prep_send_set_addr(sqe, &m->addr.sa, addrlen);
+      uring_stats.sends_zc++;
+    }
+  else
+    {
+      m->iov.iov_base = (void *)buf;
+      m->iov.iov_len = len;
+      memset(&m->msg, 0, sizeof(m->msg));
+      if (addr)
+	{
+	  m->msg.msg_name = &m->addr;
+	  m->msg.msg_namelen = addrlen;
+	}
+      m->msg.msg_iov = &m->iov;
+      m->msg.msg_iovlen = 1;
+
+      io_uring_prep_sendmsg(sqe, fd, &m->msg, 0);
+    }
+
+  io_uring_sqe_set_data64(sqe, idx);
+
+  uring_queued++;
+  uring_inflight++;
+  uring_stats.sends++;
+
+  return 0;
+}
+
+void
+airplay_uring_submit(void)
+{
+  int ret;
+
+  if (!uring_active)
+    return;
+
+  if (uring_queued > 0)
+    {
+      ret = io_uring_submit(&uring_ring);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_AIRPLAY, "Could not submit io_uring sends: %s\n", strerror(-ret));
+      else
+	uring_queued -= MIN((unsigned)ret, uring_queued);
+
+      uring_stats.submits++;
+    }
+
+  uring_reap();
+}
+
+void
+airplay_uring_drain(void)
+{
+  if (!uring_active)
+    return;
+
+  uring_wait(false);
+}
+
+int
+airplay_uring_buffer_register(void *base, size_t len)
+{
+  struct iovec iov = { .iov_base = base, .iov_len = len };
+  unsigned i;
+  int ret;
+
+  if (!uring_active)
+    return -1;
+
+  for (i = 0; i < uring_buffers_max; i++)
+    {
+      if (!uring_buffers[i].iov_base)
+	break;
+    }
+
+  if (i == uring_buffers_max)
+    {
+      DPRINTF(E_DBG, L_AIRPLAY, "No free io_uring buffer slot, packets will be sent without zero-copy\n");
+      return -1;
+    }
+
+  ret = io_uring_register_buffers_update_tag(&uring_ring, i, &iov, NULL, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "Could not register io_uring buffer: %s\n", strerror(-ret));
+      return -1;
+    }
+
+  uring_buffers[i] = iov;
+
+  return i;
+}
+
+void
+airplay_uring_buffer_unregister(int buf_index)
+{
+  struct iovec iov = { .iov_base = NULL, .iov_len = 0 };
+
+  if (!uring_active || buf_index < 0 || buf_index >= uring_buffers_max)
+    return;
+
+  // We don't track which zero-copy sends are from which buffer, so wait for all
+  uring_wait(true);
+
+  io_uring_register_buffers_update_tag(&uring_ring, buf_index, &iov, NULL, 1);
+  uring_buffers[buf_index] = iov;
+}
+
+bool
+airplay_uring_is_active(void)
+{
+  return uring_active;
+}
+
+int
+airplay_uring_init(unsigned entries, unsigned buffers_max, airplay_uring_error_cb cb)
+{
+  struct io_uring_probe *probe;
+  int ret;
+
+  ret = io_uring_queue_init(entries, &uring_ring, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Could not set up io_uring: %s\n", strerror(-ret));
+      return -1;
+    }
+
+  // Sparse table that sessions fill in as they start (Linux 5.19+)
+  ret = io_uring_register_buffers_sparse(&uring_ring, buffers_max);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_AIRPLAY, "No registered buffers for io_uring: %s\n", strerror(-ret));
+      buffers_max = 0;
+    }
+
+  probe = io_uring_get_probe_ring(&uring_ring);
+  uring_zc = probe && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC) && buffers_max > 0;
+  if (probe)
+    io_uring_free_probe(probe);
+
+  uring_buffers_max = buffers_max;
+  if (buffers_max > 0)
+    CHECK_NULL(L_AIRPLAY, uring_buffers = calloc(buffers_max, sizeof(struct iovec)));
+
+  // Each send has one completion, plus a notification if zero-copy, so with
+  // at most this many in flight the completion queue (2 * entries) can't fill
+  uring_msgs_size = entries;
+  CHECK_NULL(L_AIRPLAY, uring_msgs = calloc(uring_msgs_size, sizeof(struct uring_msg)));
+  CHECK_NULL(L_AIRPLAY, uring_msgs_free = calloc(uring_msgs_size, sizeof(unsigned)));
+  for (uring_msgs_nfree = 0; uring_msgs_nfree < uring_msgs_size; uring_msgs_nfree++)
+    uring_msgs_free[uring_msgs_nfree] = uring_msgs_size - 1 - uring_msgs_nfree;
+
+  uring_error_cb = cb;
+  uring_queued = 0;
+  uring_inflight = 0;
+  uring_notifs = 0;
+  memset(&uring_stats, 0, sizeof(struct uring_stats));
+
+  uring_active = true;
+
+  DPRINTF(E_INFO, L_AIRPLAY, "Sending audio with io_uring (%s)\n", uring_zc ? "zero-copy" : "copying");
+
+  return 0;
+}
+
+void
+airplay_uring_deinit(void)
+{
+  if (!uring_active)
+    return;
+
+  uring_wait(true);
+
+  DPRINTF(E_DBG, L_AIRPLAY, "io_uring stats: %" PRIu64 " sends (%" PRIu64 " zero-copy) in %" PRIu64 " submits, %" PRIu64 " errors, %" PRIu64 " waits, %" PRIu64 " dropped (all in flight)\n",
+    uring_stats.sends, uring_stats.sends_zc, uring_stats.submits, uring_stats.errors, uring_stats.waits, uring_stats.full);
+
+  io_uring_queue_exit(&uring_ring);
+
+  free(uring_buffers);
+  uring_buffers = NULL;
+  uring_buffers_max = 0;
+  free(uring_msgs);
+  uring_msgs = NULL;
+  free(uring_msgs_free);
+  uring_msgs_free = NULL;
+
+  uring_active = false;
+}
+
+#else /* !HAVE_LIBURING */
+
+int
+airplay_uring_init(unsigned entries, unsigned buffers_max, airplay_uring_error_cb cb)
+{
+  DPRINTF(E_LOG, L_AIRPLAY, "io_uring was requested, but libairplay2 was built without liburing\n");
+  return -1;
+}
+
+void
+airplay_uring_deinit(void)
+{
+  return;
+}
+
+bool
+airplay_uring_is_active(void)
+{
+  return false;
+}
+
+int
+airplay_uring_buffer_register(void *base, size_t len)
+{
+  return -1;
+}
+
+void
+airplay_uring_buffer_unregister(int buf_index)
+{
+  return;
+}
+
+int
+airplay_uring_sendto(int fd, const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen, int buf_index, uint64_t tag)
+{
+  return -1;
+}
+
+void
+airplay_uring_submit(void)
+{
+  return;
+}
+
+void
+airplay_uring_drain(void)
+{
+  return;
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,57 @@
+#ifndef __AIRPLAY_URING_H__
+#define __AIRPLAY_URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Packets up to this size that are not in a registered buffer are copied by
+// airplay_uring_sendto()
+#define AIRPLAY_URING_COPY_LEN 64
+
+// Called for each send that failed, with the tag given to airplay_uring_sendto()
+// and the errno
+typedef void (*airplay_uring_error_cb)(uint64_t tag, int err);
+
+// Sets up the ring, returns -1 if built without liburing or if the kernel
+// doesn't support io_uring. Up to buffers_max buffers can be registered. The
+// callback is made from airplay_uring_submit() and airplay_uring_drain().
+int
+airplay_uring_init(unsigned entries, unsigned buffers_max, airplay_uring_error_cb cb);
+
+void
+airplay_uring_deinit(void);
+
+bool
+airplay_uring_is_active(void);
+
+// Registers memory that packets will be sent from, so the kernel doesn't have
+// to map it for each send, and sends from it can be zero-copy. Returns the
+// buffer index or -1 if there is no free slot.
+int
+airplay_uring_buffer_register(void *base, size_t len);
+
+// Waits for sends from the buffer to complete, so the memory can be freed
+void
+airplay_uring_buffer_unregister(int buf_index);
+
+// Queues a send, buf_index is -1 if buf is not in a registered buffer. addr is
+// NULL for a connected socket, it is copied. Data that is larger than
+// AIRPLAY_URING_COPY_LEN and not in a registered buffer must be valid until
+// airplay_uring_drain(). Returns -1 if the send could not be queued, with errno
+// ENOBUFS if too many sends are in flight.
+int
+airplay_uring_sendto(int fd, const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen, int buf_index, uint64_t tag);
+
+// Submits the queued sends and reaps the completions that are ready, without
+// waiting for the rest
+void
+airplay_uring_submit(void);
+
+// Waits for all submitted sends to complete, call before freeing memory given
+// to airplay_uring_sendto() that was not copied
+void
+airplay_uring_drain(void);
+
+#endif  /* !__AIRPLAY_URING_H__ */
@@ -0,0 +1,619 @@
+/*
+ * ALAC encoder for AirPlay
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Encodes the fixed size frames that AirPlay uses. The stream format is the
+ * same as Apple's reference encoder produces in "fast" mode: stereo is mixed to
+ * mid/side, each channel goes through an adaptive 8th order predictor whose
+ * coefficients are carried over from frame to frame, and the residuals are
+ * coded with ALAC's adaptive Golomb-Rice coder. The rice parameters are the
+ * defaults (40/10/14), which is what receivers assume for AirPlay.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__SSE4_1__)
+# include <smmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+#include "logger.h"
+#include "misc.h"
+#include "alac.h"
+
+#define ALAC_ELEMENT_SCE            0
+#define ALAC_ELEMENT_CPE            1
+#define ALAC_ELEMENT_END            7
+
+#define ALAC_PREDICTOR_ORDER        8
+#define ALAC_DENSHIFT               9
+#define ALAC_PB_FACTOR              4
+
+// Stereo is mixed to u = (l + r) / 2 and v = l - r
+#define ALAC_MIX_BITS               1
+#define ALAC_MIX_RES                1
+
+#define ALAC_RICE_HISTORY_MULT      40
+#define ALAC_RICE_INITIAL_HISTORY   10
+#define ALAC_RICE_LIMIT             14
+#define ALAC_RICE_THRESHOLD         8
+#define ALAC_RICE_ESCAPE            0x1ff
+
+// Element tag, instance, unused, has size, shift, verbatim, size, end tag
+#define ALAC_FRAME_HEADER_BITS      (3 + 4 + 12 + 1 + 2 + 1 + 32)
+#define ALAC_FRAME_TRAILER_BITS     3
+
+struct alac_bitwriter
+{
+  uint8_t *buf;
+  size_t size;
+  size_t pos;
+  uint64_t acc;
+  int nbits;
+  bool overflow;
+};
+
+struct alac_encoder
+{
+  int bits_per_sample;
+  int channels;
+  int frame_size;
+  bool uncompressed;
+
+  // Number of low bits per sample that are written as is (24 bit input), and
+  // the resulting bits per sample for the predictor incl. the bit that the
+  // stereo mix adds
+  int shift;
+  int chan_bits;
+
+  // Predictor coefficients, adapted sample by sample and kept between frames
+  int16_t coefs[2][ALAC_PREDICTOR_ORDER];
+
+  int32_t *mix[2];
+  int32_t *residual[2];
+  uint8_t *shift_buf;
+};
+
+
+/* ------------------------------- BIT WRITER ------------------------------- */
+
+static inline void
+bits_init(struct alac_bitwriter *bw, uint8_t *buf, size_t size)
+{
+  bw->buf = buf;
+  bw->size = size;
+  bw->pos = 0;
+  bw->acc = 0;
+  bw->nbits = 0;
+  bw->overflow = false;
+}
+
+// Writes the n (max 32) lowest bits of val, msb first
+static inline void
+bits_put(struct alac_bitwriter *bw, int n, uint32_t val)
+{
+  bw->acc = (bw->acc << n) | (val & ((1ULL << n) - 1));
+  bw->nbits += n;
+
+  while (bw->nbits >= 8)
+    {
+      bw->nbits -= 8;
+      if (bw->pos < bw->size)
+	bw->buf[bw->pos++] = bw->acc >> bw->nbits;
+      else
+	bw->overflow = true;
+    }
+}
+
+static inline size_t
+bits_flush(struct alac_bitwriter *bw)
+{
+  if (bw->nbits > 0)
+    bits_put(bw, 8 - bw->nbits, 0);
+
+  return bw->pos;
+}
+
+
+/* -------------------------------- HELPERS --------------------------------- */
+
+static inline int
+ilog2(uint32_t v)
+{
+  return 31 - __builtin_clz(v | 1);
+}
+
+static inline int
+sign_of(int32_t v)
+{
+  return (v > 0) - (v < 0);
+}
+
+static inline int32_t
+sign_extend(int32_t v, int shift)
+{
+  return (int32_t)((uint32_t)v << shift) >> shift;
+}
+
+static inline int32_t
+pcm24_read(const uint8_t *p)
+{
+  return sign_extend(p[0] | (p[1] << 8) | (p[2] << 16), 8);
+}
+
+static size_t
+frame_len_max(struct alac_encoder *enc, int nsamples)
+{
+  size_t bits = ALAC_FRAME_HEADER_BITS + (size_t)nsamples * enc->channels * enc->bits_per_sample + ALAC_FRAME_TRAILER_BITS;
+
+  return (bits + 7) / 8;
+}
+
+static void
+element_header_write(struct alac_bitwriter *bw, struct alac_encoder *enc, int nsamples, bool verbatim)
+{
+  bits_put(bw, 3, (enc->channels == 2) ? ALAC_ELEMENT_CPE : ALAC_ELEMENT_SCE);
+  bits_put(bw, 4, 0); // Element instance
+  bits_put(bw, 12, 0); // Unused
+  // We always include the sample count, like ffmpeg's encoder (which is what
+  // was used before) does for frames of this size
+  bits_put(bw, 1, 1);
+  bits_put(bw, 2, verbatim ? 0 : enc->shift / 8);
+  bits_put(bw, 1, verbatim);
+  bits_put(bw, 32, nsamples);
+}
+
+
+/* ---------------------------- PREDICTOR STAGE ----------------------------- */
+
+// Deinterleaves the input, splits off the low bits of 24 bit samples, and does
+// the stereo mix. Kept free of branches so that the compiler can vectorize it.
+static void
+pcm_split(struct alac_encoder *enc, const uint8_t *pcm, int nsamples)
+{
+  const int16_t *restrict in16 = (const int16_t *)pcm;
+  int32_t *restrict u = enc->mix[0];
+  int32_t *restrict v = enc->mix[1];
+  uint8_t *restrict shift_buf = enc->shift_buf;
+  int32_t l;
+  int32_t r;
+  int i;
+
+  if (enc->bits_per_sample == 16 && enc->channels == 2)
+    {
+      for (i = 0; i < nsamples; i++)
+	{
+	  l = in16[2 * i];
+	  r = in16[2 * i + 1];
+	  u[i] = (l + r) >> ALAC_MIX_BITS;
+	  v[i] = l - r;
+	}
+    }
+  else if (enc->bits_per_sample == 16)
+    {
+      for (i = 0; i < nsamples; i++)
+	u[i] = in16[i];
+    }
+  else if (enc->channels == 2)
+    {
+      for (i = 0; i < nsamples; i++)
+	{
+	  l = pcm24_read(pcm + 6 * i);
+	  r = pcm24_read(pcm + 6 * i + 3);
+	  shift_buf[2 * i] = l & 0xff;
+	  shift_buf[2 * i + 1] = r & 0xff;
+	  l >>= 8;
+	  r >>= 8;
+	  u[i] = (l + r) >> ALAC_MIX_BITS;
+	  v[i] = l - r;
+	}
+    }
+  else
+    {
+      for (i = 0; i < nsamples; i++)
+	{
+	  l = pcm24_read(pcm + 3 * i);
+	  shift_buf[i] = l & 0xff;
+	  u[i] = l >> 8;
+	}
+    }
+}
+
+// Sum of the products of the coefficients and the differences, both ordered
+// oldest sample first. Wraps on overflow like the decoder's arithmetic does.
+static inline int32_t
+predictor_dot(const int32_t *c, const int32_t *d)
+{
+#if defined(__SSE4_1__)
+  __m128i acc;
+
+  acc = _mm_add_epi32(_mm_mullo_epi32(_mm_loadu_si128((const __m128i *)c), _mm_loadu_si128((const __m128i *)d)),
+		      _mm_mullo_epi32(_mm_loadu_si128((const __m128i *)(c + 4)), _mm_loadu_si128((const __m128i *)(d + 4))));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  return _mm_cvtsi128_si32(acc);
+#elif defined(__ARM_NEON)
+  int32x4_t acc;
+  int32x2_t sum;
+
+  acc = vmulq_s32(vld1q_s32(c), vld1q_s32(d));
+  acc = vmlaq_s32(acc, vld1q_s32(c + 4), vld1q_s32(d + 4));
+  sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+
+  return vget_lane_s32(vpadd_s32(sum, sum), 0);
+#else
+  uint32_t sum = 0;
+  int i;
+
+  for (i = 0; i < ALAC_PREDICTOR_ORDER; i++)
+    sum += (uint32_t)c[i] * (uint32_t)d[i];
+
+  return (int32_t)sum;
+#endif
+}
+
+// The differences between the previous ALAC_PREDICTOR_ORDER samples and the
+// sample before them, oldest first
+static inline void
+predictor_diffs(int32_t *d, const int32_t *in, int32_t top)
+{
+#if defined(__SSE4_1__)
+  __m128i t = _mm_set1_epi32(top);
+
+  _mm_storeu_si128((__m128i *)d, _mm_sub_epi32(_mm_loadu_si128((const __m128i *)in), t));
+  _mm_storeu_si128((__m128i *)(d + 4), _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(in + 4)), t));
+#elif defined(__ARM_NEON)
+  int32x4_t t = vdupq_n_s32(top);
+
+  vst1q_s32(d, vsubq_s32(vld1q_s32(in), t));
+  vst1q_s32(d + 4, vsubq_s32(vld1q_s32(in + 4), t));
+#else
+  int i;
+
+  for (i = 0; i < ALAC_PREDICTOR_ORDER; i++)
+    d[i] = in[i] - top;
+#endif
+}
+
+// The adaptive predictor, which must exactly mirror what the decoder does (see
+// unpc_block() in Apple's reference decoder). The first samples are coded as
+// first order differences, after that each sample is predicted from the
+// previous ALAC_PREDICTOR_ORDER samples, and the coefficients are nudged
+// according to the sign of the prediction error. While running, the
+// coefficients are kept as 32 bit in reverse order, so they line up with the
+// samples for the vector dot product.
+static void
+predictor_run(int32_t *restrict res, const int32_t *restrict in, int nsamples, int16_t *coefs, int chan_bits)
+{
+  const int order = ALAC_PREDICTOR_ORDER;
+  const int chan_shift = 32 - chan_bits;
+  const int32_t denhalf = 1 << (ALAC_DENSHIFT - 1);
+  int32_t c[ALAC_PREDICTOR_ORDER] __attribute__((aligned(16)));
+  int32_t d[ALAC_PREDICTOR_ORDER] __attribute__((aligned(16)));
+  int32_t top;
+  int32_t del;
+  int32_t del0;
+  int32_t dd;
+  int sgn;
+  int j;
+  int m;
+
+  res[0] = in[0];
+
+  for (j = 1; j <= order && j < nsamples; j++)
+    res[j] = sign_extend(in[j] - in[j - 1], chan_shift);
+
+  for (m = 0; m < order; m++)
+    c[m] = coefs[order - 1 - m];
+
+  for (j = order + 1; j < nsamples; j++)
+    {
+      top = in[j - order - 1];
+
+      predictor_diffs(d, in + j - order, top);
+
+      del = sign_extend(in[j] - top - ((predictor_dot(c, d) + denhalf) >> ALAC_DENSHIFT), chan_shift);
+      res[j] = del;
+
+      // Oldest sample first, like the decoder. Its coefficients are 16 bit, so
+      // ours must wrap the same way.
+      del0 = del;
+      if (del > 0)
+	{
+	  for (m = 0; m < order; m++)
+	    {
+	      dd = -d[m];
+	      sgn = sign_of(dd);
+	      c[m] = (int16_t)(c[m] - sgn);
+	      del0 -= (m + 1) * ((sgn * dd) >> ALAC_DENSHIFT);
+	      if (del0 <= 0)
+		break;
+	    }
+	}
+      else if (del < 0)
+	{
+	  for (m = 0; m < order; m++)
+	    {
+	      dd = -d[m];
+	      sgn = sign_of(dd);
+	      c[m] = (int16_t)(c[m] + sgn);
+	      del0 -= (m + 1) * ((-sgn * dd) >> ALAC_DENSHIFT);
+	      if (del0 >= 0)
+		break;
+	    }
+	}
+    }
+
+  for (m = 0; m < order; m++)
+    coefs[order - 1 - m] = c[m];
+}
+
+
+/* ----------------------------- ENTROPY STAGE ------------------------------ */
+
+static inline void
+rice_write(struct alac_bitwriter *bw, uint32_t x, int k, int escape_bits)
+{
+  uint32_t divisor;
+  uint32_t q;
+  uint32_t r;
+
+  if (k > ALAC_RICE_LIMIT)
+    k = ALAC_RICE_LIMIT;
+
+  divisor = (1 << k) - 1;
+  q = x / divisor;
+  r = x % divisor;
+
+  if (q > ALAC_RICE_THRESHOLD)
+    {
+      bits_put(bw, 9, ALAC_RICE_ESCAPE);
+      bits_put(bw, escape_bits, x);
+      return;
+    }
+
+  // Unary coded quotient terminated by a zero
+  bits_put(bw, q + 1, ((1 << q) - 1) << 1);
+
+  if (k == 1)
+    return;
+
+  if (r > 0)
+    bits_put(bw, k, r + 1);
+  else
+    bits_put(bw, k - 1, 0);
+}
+
+static void
+residuals_write(struct alac_bitwriter *bw, const int32_t *res, int nsamples, int chan_bits)
+{
+  uint32_t history = ALAC_RICE_INITIAL_HISTORY;
+  uint32_t sign_modifier = 0;
+  uint32_t block_size;
+  uint32_t x;
+  int k;
+  int i;
+
+  for (i = 0; i < nsamples; )
+    {
+      k = ilog2((history >> 9) + 3);
+
+      // Zigzag, so 0, -1, 1, -2... becomes 0, 1, 2, 3...
+      x = ((uint32_t)res[i] << 1) ^ (uint32_t)(res[i] >> 31);
+      i++;
+
+      rice_write(bw, x - sign_modifier, k, chan_bits);
+
+      // The reference encoder clamps on the value that was coded, i.e. after
+      // the sign modifier was taken off
+      history += x * ALAC_RICE_HISTORY_MULT - ((history * ALAC_RICE_HISTORY_MULT) >> 9);
+      if (x - sign_modifier > 0xffff)
+	history = 0xffff;
+      sign_modifier = 0;
+
+      // Runs of zeroes are coded as a block size
+      if (history < 128 && i < nsamples)
+	{
+	  k = 7 - ilog2(history) + ((history + 16) >> 6);
+
+	  // A run that fills the 16 bit block size ends there, and then the next
+	  // value is coded without the sign modifier
+	  for (block_size = 0; i < nsamples && res[i] == 0 && block_size < 0xffff; i++)
+	    block_size++;
+
+	  rice_write(bw, block_size, k, 16);
+	  sign_modifier = (block_size < 0xffff);
+	  history = 0;
+	}
+    }
+}
+
+
+/* ----------------------------- FRAME WRITERS ------------------------------ */
+
+static int
+compressed_write(struct alac_encoder *enc, uint8_t *out, size_t out_size, const uint8_t *pcm, int nsamples)
+{
+  struct alac_bitwriter bw;
+  int ch;
+  int i;
+
+  pcm_split(enc, pcm, nsamples);
+
+  bits_init(&bw, out, out_size);
+
+  element_header_write(&bw, enc, nsamples, false);
+
+  bits_put(&bw, 8, (enc->channels == 2) ? ALAC_MIX_BITS : 0);
+  bits_put(&bw, 8, (enc->channels == 2) ? ALAC_MIX_RES : 0);
+
+  // The coefficients the decoder should start from, i.e. before this frame
+  // adapts them
+  for (ch = 0; ch < enc->channels; ch++)
+    {
+      bits_put(&bw, 4, 0); // Prediction mode
+      bits_put(&bw, 4, ALAC_DENSHIFT);
+      bits_put(&bw, 3, ALAC_PB_FACTOR);
+      bits_put(&bw, 5, ALAC_PREDICTOR_ORDER);
+      for (i = 0; i < ALAC_PREDICTOR_ORDER; i++)
+	bits_put(&bw, 16, (uint16_t)enc->coefs[ch][i]);
+    }
+
+  if (enc->shift)
+    {
+      for (i = 0; i < nsamples * enc->channels; i++)
+	bits_put(&bw, enc->shift, enc->shift_buf[i]);
+    }
+
+  for (ch = 0; ch < enc->channels; ch++)
+    {
+      predictor_run(enc->residual[ch], enc->mix[ch], nsamples, enc->coefs[ch], enc->chan_bits);
+      residuals_write(&bw, enc->residual[ch], nsamples, enc->chan_bits);
+
+      if (bw.overflow)
+	return -1;
+    }
+
+  bits_put(&bw, 3, ALAC_ELEMENT_END);
+  bits_flush(&bw);
+
+  return bw.overflow ? -1 : bw.pos;
+}
+
+static int
+verbatim_write(struct alac_encoder *enc, uint8_t *out, size_t out_size, const uint8_t *pcm, int nsamples)
+{
+  struct alac_bitwriter bw;
+  const int16_t *in16 = (const int16_t *)pcm;
+  int n = nsamples * enc->channels;
+  int i;
+
+  bits_init(&bw, out, out_size);
+
+  element_header_write(&bw, enc, nsamples, true);
+
+  if (enc->bits_per_sample == 16)
+    {
+      for (i = 0; i < n; i++)
+	bits_put(&bw, 16, (uint16_t)in16[i]);
+    }
+  else
+    {
+      for (i = 0; i < n; i++)
+	bits_put(&bw, 24, pcm24_read(pcm + 3 * i));
+    }
+
+  bits_put(&bw, 3, ALAC_ELEMENT_END);
+  bits_flush(&bw);
+
+  return bw.overflow ? -1 : bw.pos;
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+size_t
+alac_encoder_max_len(struct alac_encoder *enc)
+{
+  return frame_len_max(enc, enc->frame_size);
+}
+
+int
+alac_encoder_encode(struct alac_encoder *enc, uint8_t *out, size_t out_size, const uint8_t *pcm, int nsamples)
+{
+  size_t verbatim_len;
+  int len;
+
+  if (nsamples <= 0 || nsamples > enc->frame_size || out_size < alac_encoder_max_len(enc))
+    {
+      DPRINTF(E_LOG, L_XCODE, "Bug! Invalid arguments to ALAC encoder (nsamples=%d, out_size=%zu)\n", nsamples, out_size);
+      return -1;
+    }
+
+  // A compressed frame is only used if it is smaller than the verbatim frame
+  verbatim_len = frame_len_max(enc, nsamples);
+
+  if (!enc->uncompressed)
+    {
+      len = compressed_write(enc, out, verbatim_len, pcm, nsamples);
+      if (len > 0)
+	return len;
+    }
+
+  return verbatim_write(enc, out, out_size, pcm, nsamples);
+}
+
+void
+alac_encoder_free(struct alac_encoder *enc)
+{
+  if (!enc)
+    return;
+
+  free(enc->mix[0]);
+  free(enc->mix[1]);
+  free(enc->residual[0]);
+  free(enc->residual[1]);
+  free(enc->shift_buf);
+  free(enc);
+}
+
+struct alac_encoder *
+alac_encoder_new(int bits_per_sample, int channels, int frame_size, bool uncompressed)
+{
+  struct alac_encoder *enc;
+  int ch;
+
+  if ((bits_per_sample != 16 && bits_per_sample != 24) || (channels != 1 && channels != 2) || frame_size <= ALAC_PREDICTOR_ORDER)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Unsupported ALAC encoder format (bps=%d, channels=%d, frame_size=%d)\n", bits_per_sample, channels, frame_size);
+      return NULL;
+    }
+
+  CHECK_NULL(L_XCODE, enc = calloc(1, sizeof(struct alac_encoder)));
+
+  enc->bits_per_sample = bits_per_sample;
+  enc->channels = channels;
+  enc->frame_size = frame_size;
+  enc->uncompressed = uncompressed;
+  enc->shift = (bits_per_sample > 16) ? bits_per_sample - 16 : 0;
+  enc->chan_bits = bits_per_sample - enc->shift + channels - 1;
+
+  for (ch = 0; ch < channels; ch++)
+    {
+      CHECK_NULL(L_XCODE, enc->mix[ch] = calloc(frame_size, sizeof(int32_t)));
+      CHECK_NULL(L_XCODE, enc->residual[ch] = calloc(frame_size, sizeof(int32_t)));
+
+      // Same starting point as Apple's encoder, anything will do since the
+      // coefficients are sent with each frame
+      enc->coefs[ch][0] = (38 * (1 << ALAC_DENSHIFT)) >> 4;
+      enc->coefs[ch][1] = (-29 * (1 << ALAC_DENSHIFT)) >> 4;
+      enc->coefs[ch][2] = (-2 * (1 << ALAC_DENSHIFT)) >> 4;
+    }
+
+  if (enc->shift)
+    CHECK_NULL(L_XCODE, enc->shift_buf = calloc(frame_size * channels, sizeof(uint8_t)));
+
+  return enc;
+}
@@ -0,0 +1,45 @@
+#ifndef __ALAC_H__
+#define __ALAC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct alac_encoder;
+
+/* Creates an ALAC encoder for fixed size frames of interleaved PCM, which is
+ * the format AirPlay uses. Supported input is 16 bit native endian and 24 bit
+ * packed little endian, mono or stereo. The encoder keeps its predictor state
+ * between frames, so use one encoder per stream.
+ *
+ * @in  bits_per_sample 16 or 24
+ * @in  channels        1 or 2
+ * @in  frame_size      Samples per frame, e.g. 352 for AirPlay
+ * @in  uncompressed    Only output verbatim (uncompressed) frames
+ * @return              New encoder, or NULL if the format is not supported
+ */
+struct alac_encoder *
+alac_encoder_new(int bits_per_sample, int channels, int frame_size, bool uncompressed);
+
+void
+alac_encoder_free(struct alac_encoder *enc);
+
+/* Max size of an encoded frame, i.e. the minimum size of the output buffer
+ * given to alac_encoder_encode()
+ */
+size_t
+alac_encoder_max_len(struct alac_encoder *enc);
+
+/* Encodes one frame. If the compressed frame would be larger than the raw
+ * samples then a verbatim frame is written instead.
+ *
+ * @out out      Buffer for the encoded frame
+ * @in  out_size Size of out, must be at least alac_encoder_max_len()
+ * @in  pcm      Interleaved PCM samples
+ * @in  nsamples Number of samples (per channel) in pcm, max frame_size
+ * @return       Length of the encoded frame, or -1 on error
+ */
+int
+alac_encoder_encode(struct alac_encoder *enc, uint8_t *out, size_t out_size, const uint8_t *pcm, int nsamples);
+
+#endif /* !__ALAC_H__ */
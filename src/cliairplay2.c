@@ -65,7 +65,9 @@
 // from owntones
 #include "logger.h"
 #include "outputs.h"
+#include "player.h"
 #include "airplay.h"
+#include "airplay_ptp.h"
 #include "mdns.h"
 
 
@@ -102,6 +104,17 @@ enum
 	PLAYING
 } status;
 
+// PCM read from stdin, which the player consumes in packet sized slices. When
+// the ring reaches the high watermark we stop reading until the player has
+// drained it to the low watermark.
+#define PCM_RING_SIZE (MS2TS(2000, 44100) * 4)
+#define PCM_RING_SLICE_MAX (DEFAULT_FRAMES_PER_CHUNK * 4 * 8)
+static struct spsc_ringbuffer pcm_ring;
+static struct media_quality pcm_quality = { 44100, 16, 2, 0 };
+static pthread_mutex_t pcm_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcm_ring_cond = PTHREAD_COND_INITIALIZER;
+static bool pcm_ring_full;
+
 // seek to delete this cliraop log_level stuff and use owntones logging solution
 // debug level from tools & other elements
 log_level util_loglevel;
@@ -179,6 +192,11 @@ static int print_usage(char *argv[])
 		   "\t[-dacp <dacp_id>] (DACP id)\n"
 		   "\t[-activeremote <activeremote_id>] (Active Remote id)\n"
 		   "\t[-alac] send ALAC compressed audio\n"
+		   "\t[-lpcm] send uncompressed LPCM audio (falls back to ALAC if rejected)\n"
+		   "\t[-redundancy <n>] repeat the previous <n> ALAC frames in each packet (RFC 2198)\n"
+		   "\t[-bench-resampler] log how fast the 44.1/48 kHz resamplers are and exit\n"
+		   "\t[-selftest-ptp] run the PTP master against a local slave on loopback and exit\n"
+		   "\t[-selftest-redundancy <loss percent>] log how many retransmits redundant audio saves on a lossy link and exit\n"
 
 		   "\t[-et <value>] (et in mDNS: 4 for airport-express and used to detect MFi)\n"
 		   "\t[-md <value>] (md in mDNS: metadata capabilties 0=text, 1=artwork, 2=progress)\n"
@@ -360,6 +378,76 @@ static void *CmdPipeReaderThread(void *args)
 
 	return NULL;
 }
+/*																		  */
+/*----------------------------------------------------------------------------*/
+static void pcm_ring_watermark_cb(struct spsc_ringbuffer *ring, enum spsc_ringbuffer_watermark mark, void *arg)
+{
+	pthread_mutex_lock(&pcm_ring_mutex);
+	pcm_ring_full = (mark == SPSC_RINGBUFFER_HIGH);
+	if (!pcm_ring_full)
+		pthread_cond_signal(&pcm_ring_cond);
+	pthread_mutex_unlock(&pcm_ring_mutex);
+}
+
+/*																		  */
+/*----------------------------------------------------------------------------*/
+static bool pcm_ring_has_consumer(void)
+{
+	struct player_status player_status;
+
+	// only a playing player drains the ring, a paused one will come back
+	player_get_status(&player_status);
+	return player_status.status != PLAY_STOPPED;
+}
+
+/*																		  */
+/*----------------------------------------------------------------------------*/
+static bool pcm_ring_wait(void)
+{
+	struct timespec deadline;
+	bool consumer;
+	bool ok = true;
+
+	while (1)
+	{
+		// sampled before taking pcm_ring_mutex, since player_get_status() takes
+		// the player lock, which the player holds while it drains the ring
+		consumer = pcm_ring_has_consumer();
+
+		pthread_mutex_lock(&pcm_ring_mutex);
+		if (!((pcm_ring_full || spsc_ringbuffer_write_avail(&pcm_ring) == 0) && status != STOPPED && glMainRunning))
+		{
+			pthread_mutex_unlock(&pcm_ring_mutex);
+			break;
+		}
+
+		// nobody will ever drain the ring, so waiting would be forever
+		if (!consumer)
+		{
+			pthread_mutex_unlock(&pcm_ring_mutex);
+			ok = false;
+			break;
+		}
+
+		// the watermark callbacks come from both threads and may cross, so don't
+		// rely on being signalled, recheck the fill level now and then
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100 * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pcm_ring_cond, &pcm_ring_mutex, &deadline);
+
+		if (spsc_ringbuffer_read_avail(&pcm_ring) <= pcm_ring.low_watermark)
+			pcm_ring_full = false;
+		pthread_mutex_unlock(&pcm_ring_mutex);
+	}
+
+	return ok;
+}
+
 /*																		  */
 /*----------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
@@ -378,12 +466,14 @@ int main(int argc, char *argv[])
 	} player = {0};
 	player.port = 5000;
 
+	struct airplay_resend_stats resend_stats;
 	int infile;
 	uint8_t *buf;
-	int i, n = -1, level = 3;
+	size_t len;
+	int i, n = -1, level = 3, redundancy = 0, selftest_redundancy = 0;
 	// airplay2_crypto_t crypto = AIRPLAY2_CLEAR;
 	uint64_t start = 0, start_at = 0, last = 0, frames = 0;
-	bool alac = false, encryption = false, auth = false;
+	bool alac = false, lpcm = false, encryption = false, auth = false, bench = false, selftest_ptp = false;
 	char *passwd = "", *secret = "", *md = "0,1,2", *et = "0,4", *am = "", *pk = "", *pw = "";
 	char *iface = NULL;
 	uint32_t glNetmask;
@@ -442,6 +532,26 @@ int main(int argc, char *argv[])
 		{
 			alac = true;
 		}
+		else if (!strcmp(argv[i], "-lpcm"))
+		{
+			lpcm = true;
+		}
+		else if (!strcmp(argv[i], "-redundancy"))
+		{
+			redundancy = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-bench-resampler"))
+		{
+			bench = true;
+		}
+		else if (!strcmp(argv[i], "-selftest-ptp"))
+		{
+			selftest_ptp = true;
+		}
+		else if (!strcmp(argv[i], "-selftest-redundancy"))
+		{
+			selftest_redundancy = atoi(argv[++i]);
+		}
 		else if (!strcmp(argv[i], "-et"))
 		{
 			et = argv[++i];
@@ -508,12 +618,36 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 		}
 
+	if (bench)
+	{
+		outputs_resampler_benchmark(10);
+		exit(0);
+	}
+
+	if (selftest_ptp)
+	{
+		exit(airplay_ptp_selftest(8) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (selftest_redundancy > 0)
+	{
+		exit(airplay_redundancy_selftest(selftest_redundancy) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
 	ret = platform_init();
 	if (ret < 0) {
 		DPRINTF(E_FATAL, L_MAIN, "Platform init failed\n");
 		return ret;
 	}
 
+	// creates evbase_player and initializes the outputs, so must come before airplay_create
+	ret = player_init();
+	if (ret < 0) {
+		DPRINTF(E_FATAL, L_MAIN, "Player init failed\n");
+		platform_deinit();
+		return ret;
+	}
+
 	DPRINTF(E_LOG, L_MAIN, "player.hostname: %s, fname: %s\n", player.hostname, fname);
 
 	// This obtains host (192.168.4.64), interface (eth0) and netmask (0xffffff00)
@@ -620,6 +754,11 @@ int main(int argc, char *argv[])
 	ap_device.quality.channels = AIRPLAY_QUALITY_CHANNELS_DEFAULT;
 
 	ap_extra.mdns_name = player.hostname;
+	ap_extra.wants_lpcm = lpcm;
+	// We don't get the features from a TXT record here, so asking for it means
+	// the receiver supports it
+	ap_extra.redundancy = redundancy;
+	ap_extra.supports_rfc2198_redundancy = (redundancy > 0);
 	ap_extra.devtype = AIRPLAY_DEV_OTHER;
 	if (!am)
 		ap_extra.devtype = AIRPLAY_DEV_OTHER;
@@ -689,7 +828,19 @@ int main(int argc, char *argv[])
 	// start = airplay_get_ntp(NULL);
 	status = PLAYING;
 
-	buf = malloc(DEFAULT_FRAMES_PER_CHUNK * 4);
+	if (spsc_ringbuffer_init(&pcm_ring, PCM_RING_SIZE, PCM_RING_SLICE_MAX) < 0)
+	{
+		DPRINTF(E_FATAL, L_MAIN, "Could not allocate PCM buffer\n");
+		goto exit;
+	}
+	spsc_ringbuffer_watermarks_set(&pcm_ring, pcm_ring.size / 4, pcm_ring.size * 3 / 4, pcm_ring_watermark_cb, NULL);
+
+	// the player paces the audio to the devices, and plays silence until we have data
+	if (player_input_set(&pcm_ring, &pcm_quality) < 0 || player_playback_start() < 0)
+	{
+		DPRINTF(E_FATAL, L_MAIN, "Could not start playback\n");
+		goto exit;
+	}
 	uint32_t KeepAlive = 0;
 
 	// keep reading audio from stdin until exit/EOF
@@ -722,10 +873,22 @@ int main(int argc, char *argv[])
 		// if (status == PLAYING && airplay2cl_accept_frames(airplay2cl))
 		if (status == PLAYING)
 		{
-			n = read(infile, buf, DEFAULT_FRAMES_PER_CHUNK * 4);
-			if (!n)
+			if (!pcm_ring_wait())
+			{
+				DPRINTF(E_LOG, L_MAIN, "Player stopped taking audio, giving up\n");
+				break;
+			}
+
+			// read straight into the ring, the player takes it from there
+			len = spsc_ringbuffer_write_reserve(&buf, &pcm_ring);
+			if (!len)
+				continue;
+
+			n = read(infile, buf, MIN(len, DEFAULT_FRAMES_PER_CHUNK * 4));
+			if (n <= 0)
 				continue;
 
+			spsc_ringbuffer_write_commit(&pcm_ring, n);
 			// airplay2cl_send_chunk(airplay2cl, buf, n / 4, &playtime);
 			frames += n / 4;
 		}
@@ -737,15 +900,25 @@ int main(int argc, char *argv[])
 	}
 	DPRINTF(E_INFO, L_MAIN, "end of stream reached\n");
 
+	// let the player drain what is left, and then give the devices time to play
+	// out their buffers
+	while (spsc_ringbuffer_read_avail(&pcm_ring) >= STOB(1, pcm_quality.bits_per_sample, pcm_quality.channels) && status != STOPPED && pcm_ring_has_consumer())
+		usleep(10000);
+	if (status != STOPPED)
+		sleep(OUTPUTS_BUFFER_DURATION);
+
 	glMainRunning = false;
-	free(buf);
-	airplay_destroy();
-	platform_deinit();
 	pthread_join(glCmdPipeReaderThread, NULL);
 	goto exit;
 
 exit:
 	DPRINTF(E_INFO, L_MAIN, "exiting...\n");
+	airplay_resend_stats_get(&resend_stats);
+	if (resend_stats.requested)
+		DPRINTF(E_INFO, L_MAIN, "retransmits: %" PRIu64 " requested, %" PRIu64 " sent, %" PRIu64 " suppressed, %" PRIu64 " throttled, %" PRIu64 " out of buffer\n",
+			resend_stats.requested, resend_stats.sent, resend_stats.suppressed, resend_stats.throttled, resend_stats.out_of_buffer);
+	player_deinit();
+	spsc_ringbuffer_free(&pcm_ring);
 	close(cmdPipeFd);
 	unlink(cmdPipeName);
 	airplay_destroy();
@@ -166,6 +166,16 @@ static cfg_opt_t sec_airplay_shared[] =
     CFG_INT("control_port", 0, CFGF_NONE),
     CFG_INT("timing_port", 0, CFGF_NONE),
     CFG_BOOL("uncompressed_alac", cfg_false, CFGF_NONE),
+    CFG_BOOL("udp_gso", cfg_false, CFGF_NONE),
+    CFG_BOOL("paced_send", cfg_false, CFGF_NONE),
+    CFG_BOOL("io_uring", cfg_false, CFGF_NONE),
+    CFG_BOOL("lpcm", cfg_false, CFGF_NONE),
+    CFG_INT("redundancy", 0, CFGF_NONE),
+    CFG_STR("resampler", "balanced", CFGF_NONE),
+    CFG_INT("retransmit_buffer_ms", 8000, CFGF_NONE),
+    CFG_BOOL("hugepages", cfg_false, CFGF_NONE),
+    CFG_BOOL("group_stream_key", cfg_false, CFGF_NONE),
+    CFG_INT("buffered_lookahead_ms", 0, CFGF_NONE),
     CFG_END()
   };
 
@@ -179,6 +189,9 @@ static cfg_opt_t sec_airplay[] =
     CFG_STR("password", NULL, CFGF_NONE),
     CFG_BOOL("raop_disable", cfg_false, CFGF_NONE),
     CFG_STR("nickname", NULL, CFGF_NONE),
+    CFG_BOOL("lpcm", cfg_false, CFGF_NODEFAULT),
+    CFG_INT("redundancy", 0, CFGF_NODEFAULT),
+    CFG_STR("resampler", NULL, CFGF_NODEFAULT),
     CFG_END()
   };
 
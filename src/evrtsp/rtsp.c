@@ -261,6 +261,10 @@ evrtsp_method(enum evrtsp_cmd_type type)
 	  method = "SETPEERS";
 	  break;
 
+	case EVRTSP_REQ_SETRATEANCHORTIME:
+	  method = "SETRATEANCHORTIME";
+	  break;
+
 	default:
 	  method = NULL;
 	  break;
@@ -41,6 +41,11 @@
 #ifndef CLOCK_REALTIME
 #include <sys/time.h>
 #endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 #ifdef HAVE_UUID
 #include <uuid/uuid.h>
 #endif
@@ -527,6 +532,80 @@ net_bind_with_reuseport(short unsigned *port, int type, const char *log_service_
   return net_bind_impl(port, type, log_service_name, true);
 }
 
+int
+net_rx_timestamps_enable(int fd)
+{
+  int on = 1;
+
+#if defined(SO_TIMESTAMPNS)
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#elif defined(SO_TIMESTAMP)
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+// The kernel timestamp is CLOCK_REALTIME, so it is converted by subtracting its
+// age from the monotonic clock
+int
+net_rx_timestamp_get(struct timespec *ts, struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  struct timespec rx;
+  struct timespec now;
+  struct timeval tv;
+  int64_t age_nsec;
+  bool found = false;
+  int ret;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg && !found; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET)
+	continue;
+#ifdef SCM_TIMESTAMPNS
+      if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+	{
+	  memcpy(&rx, CMSG_DATA(cmsg), sizeof(rx));
+	  found = true;
+	}
+#endif
+#ifdef SCM_TIMESTAMP
+      if (cmsg->cmsg_type == SCM_TIMESTAMP)
+	{
+	  memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+	  rx.tv_sec = tv.tv_sec;
+	  rx.tv_nsec = tv.tv_usec * 1000;
+	  found = true;
+	}
+#endif
+    }
+
+  ret = clock_gettime(CLOCK_MONOTONIC, ts);
+  if (ret < 0 || !found)
+    return ret;
+
+  ret = clock_gettime(CLOCK_REALTIME, &now);
+  if (ret < 0)
+    return 0;
+
+  age_nsec = (int64_t)(now.tv_sec - rx.tv_sec) * 1000000000 + (now.tv_nsec - rx.tv_nsec);
+  // Realtime clock was stepped, so the timestamp is useless
+  if (age_nsec < 0 || age_nsec > 1000000000)
+    return 0;
+
+  ts->tv_sec -= age_nsec / 1000000000;
+  ts->tv_nsec -= age_nsec % 1000000000;
+  if (ts->tv_nsec < 0)
+    {
+      ts->tv_sec--;
+      ts->tv_nsec += 1000000000;
+    }
+
+  return 1;
+}
+
 int
 net_evhttp_bind(struct evhttp *evhttp, unsigned short port, const char *log_service_name)
 {
@@ -1522,6 +1601,330 @@ ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf)
   return dstlen;
 }
 
+int
+spsc_ringbuffer_init(struct spsc_ringbuffer *buf, size_t size, size_t slice_max)
+{
+  size_t pow2;
+  int ret;
+
+  if (slice_max == 0 || slice_max > size)
+    {
+      DPRINTF(E_LOG, L_MISC, "Invalid ringbuffer slice size %zu (buffer size %zu)\n", slice_max, size);
+      return -1;
+    }
+
+  memset(buf, 0, sizeof(struct spsc_ringbuffer));
+
+  for (pow2 = 1; pow2 < size; pow2 <<= 1)
+    ;
+
+  // Room for the mirror of the start of the buffer
+  ret = posix_memalign((void **)&buf->buffer, SPSC_RINGBUFFER_CACHELINE, pow2 + slice_max);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Out of memory for ringbuffer of size %zu\n", pow2);
+      return -1;
+    }
+
+  buf->size = pow2;
+  buf->mask = pow2 - 1;
+  buf->slice_max = slice_max;
+  buf->high_watermark = pow2;
+  return 0;
+}
+
+void
+spsc_ringbuffer_free(struct spsc_ringbuffer *buf)
+{
+  if (!buf)
+    return;
+
+  free(buf->buffer);
+  memset(buf, 0, sizeof(struct spsc_ringbuffer));
+}
+
+// Must be called before the producer and consumer are started
+void
+spsc_ringbuffer_watermarks_set(struct spsc_ringbuffer *buf, size_t low, size_t high, spsc_ringbuffer_watermark_cb cb, void *arg)
+{
+  buf->low_watermark = low;
+  buf->high_watermark = MIN(high, buf->size);
+  buf->watermark_cb = cb;
+  buf->watermark_arg = arg;
+}
+
+// The acquire loads pair with the release stores in the commit functions, so
+// the data is visible before the position that publishes it
+size_t
+spsc_ringbuffer_read_avail(struct spsc_ringbuffer *buf)
+{
+  return __atomic_load_n(&buf->write_pos, __ATOMIC_ACQUIRE) - __atomic_load_n(&buf->read_pos, __ATOMIC_RELAXED);
+}
+
+size_t
+spsc_ringbuffer_write_avail(struct spsc_ringbuffer *buf)
+{
+  return buf->size - (__atomic_load_n(&buf->write_pos, __ATOMIC_RELAXED) - __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE));
+}
+
+size_t
+spsc_ringbuffer_write_reserve(uint8_t **dst, struct spsc_ringbuffer *buf)
+{
+  size_t offset;
+  size_t avail;
+  size_t len;
+
+  // Not inside MIN(), which would evaluate it twice
+  avail = spsc_ringbuffer_write_avail(buf);
+
+  offset = __atomic_load_n(&buf->write_pos, __ATOMIC_RELAXED) & buf->mask;
+  len = MIN(avail, buf->size - offset);
+
+  *dst = buf->buffer + offset;
+  return len;
+}
+
+void
+spsc_ringbuffer_write_commit(struct spsc_ringbuffer *buf, size_t len)
+{
+  size_t write_pos;
+  size_t offset;
+  size_t fill;
+
+  if (len == 0)
+    return;
+
+  write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_RELAXED);
+
+  // Keep the mirror in sync if the write touched the start of the buffer
+  offset = write_pos & buf->mask;
+  if (offset < buf->slice_max)
+    memcpy(buf->buffer + buf->size + offset, buf->buffer + offset, MIN(len, buf->slice_max - offset));
+
+  __atomic_store_n(&buf->write_pos, write_pos + len, __ATOMIC_RELEASE);
+
+  fill = write_pos + len - __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE);
+  if (buf->watermark_cb && fill >= buf->high_watermark && fill - len < buf->high_watermark)
+    buf->watermark_cb(buf, SPSC_RINGBUFFER_HIGH, buf->watermark_arg);
+}
+
+size_t
+spsc_ringbuffer_write(struct spsc_ringbuffer *buf, const void *src, size_t srclen)
+{
+  uint8_t *dst;
+  size_t written = 0;
+  size_t len;
+
+  // At most two rounds, the second one if we wrapped around
+  while (written < srclen)
+    {
+      len = spsc_ringbuffer_write_reserve(&dst, buf);
+      if (len == 0)
+	break;
+
+      len = MIN(len, srclen - written);
+      memcpy(dst, (const uint8_t *)src + written, len);
+      spsc_ringbuffer_write_commit(buf, len);
+      written += len;
+    }
+
+  return written;
+}
+
+size_t
+spsc_ringbuffer_read_peek_at(uint8_t **dst, size_t skip, size_t dstlen, struct spsc_ringbuffer *buf)
+{
+  size_t offset;
+  size_t avail;
+
+  avail = spsc_ringbuffer_read_avail(buf);
+  avail = (avail > skip) ? avail - skip : 0;
+
+  offset = (__atomic_load_n(&buf->read_pos, __ATOMIC_RELAXED) + skip) & buf->mask;
+  *dst = buf->buffer + offset;
+
+  // If the slice wraps, the rest of it is in the mirror
+  dstlen = MIN(dstlen, buf->slice_max);
+  return MIN(dstlen, avail);
+}
+
+size_t
+spsc_ringbuffer_read_peek(uint8_t **dst, size_t dstlen, struct spsc_ringbuffer *buf)
+{
+  return spsc_ringbuffer_read_peek_at(dst, 0, dstlen, buf);
+}
+
+void
+spsc_ringbuffer_read_commit(struct spsc_ringbuffer *buf, size_t len)
+{
+  size_t read_pos;
+  size_t fill;
+
+  if (len == 0)
+    return;
+
+  read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&buf->read_pos, read_pos + len, __ATOMIC_RELEASE);
+
+  fill = __atomic_load_n(&buf->write_pos, __ATOMIC_ACQUIRE) - read_pos - len;
+  if (buf->watermark_cb && fill <= buf->low_watermark && fill + len > buf->low_watermark)
+    buf->watermark_cb(buf, SPSC_RINGBUFFER_LOW, buf->watermark_arg);
+}
+
+
+/* ------------------------------- Hash index ------------------------------- */
+
+enum hashidx_state
+{
+  HASHIDX_EMPTY = 0,
+  HASHIDX_USED,
+  HASHIDX_DELETED,
+};
+
+static inline size_t
+hashidx_hash(const uint8_t *key)
+{
+  uint64_t a;
+  uint64_t b;
+  uint64_t h;
+
+  memcpy(&a, key, sizeof(a));
+  memcpy(&b, key + sizeof(a), sizeof(b));
+
+  // Finalizer from splitmix64
+  h = a ^ (b * 0x9e3779b97f4a7c15ULL);
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h = h ^ (h >> 31);
+
+  return (size_t)h;
+}
+
+static void
+hashidx_resize(struct hashidx *idx, size_t size)
+{
+  struct hashidx_entry *old = idx->entries;
+  size_t old_size = idx->size;
+  size_t i;
+
+  CHECK_NULL(L_MISC, idx->entries = calloc(size, sizeof(struct hashidx_entry)));
+  idx->size = size;
+  idx->count = 0;
+  idx->deleted = 0;
+
+  for (i = 0; i < old_size; i++)
+    {
+      if (old[i].state == HASHIDX_USED)
+	hashidx_add(idx, old[i].key, old[i].value);
+    }
+
+  free(old);
+}
+
+int
+hashidx_init(struct hashidx *idx, size_t size_hint)
+{
+  size_t size;
+
+  memset(idx, 0, sizeof(struct hashidx));
+
+  // Keep the load factor below 1/2
+  for (size = 16; size < 2 * size_hint; size <<= 1)
+    ;
+
+  hashidx_resize(idx, size);
+  return 0;
+}
+
+void
+hashidx_free(struct hashidx *idx)
+{
+  if (!idx)
+    return;
+
+  free(idx->entries);
+  memset(idx, 0, sizeof(struct hashidx));
+}
+
+void
+hashidx_add(struct hashidx *idx, const uint8_t *key, void *value)
+{
+  size_t mask;
+  size_t i;
+
+  // Tombstones also lengthen the probes, so count them in the load. If there
+  // are mostly tombstones, rehashing at the same size is enough.
+  if (idx->size == 0)
+    hashidx_resize(idx, 16);
+  else if (2 * (idx->count + idx->deleted + 1) > idx->size)
+    hashidx_resize(idx, (4 * (idx->count + 1) > idx->size) ? idx->size * 2 : idx->size);
+
+  mask = idx->size - 1;
+  for (i = hashidx_hash(key) & mask; idx->entries[i].state == HASHIDX_USED; i = (i + 1) & mask)
+    ; /* EMPTY */
+
+  if (idx->entries[i].state == HASHIDX_DELETED)
+    idx->deleted--;
+
+  memcpy(idx->entries[i].key, key, HASHIDX_KEY_LEN);
+  idx->entries[i].value = value;
+  idx->entries[i].state = HASHIDX_USED;
+  idx->count++;
+}
+
+static struct hashidx_entry *
+hashidx_find(struct hashidx *idx, const uint8_t *key, void *value)
+{
+  struct hashidx_entry *entry;
+  size_t mask;
+  size_t i;
+
+  if (!idx->entries)
+    return NULL;
+
+  mask = idx->size - 1;
+  for (i = hashidx_hash(key) & mask; idx->entries[i].state != HASHIDX_EMPTY; i = (i + 1) & mask)
+    {
+      entry = &idx->entries[i];
+      if (entry->state == HASHIDX_USED && memcmp(entry->key, key, HASHIDX_KEY_LEN) == 0 && (!value || entry->value == value))
+	return entry;
+    }
+
+  return NULL;
+}
+
+void *
+hashidx_get(struct hashidx *idx, const uint8_t *key)
+{
+  struct hashidx_entry *entry;
+
+  entry = hashidx_find(idx, key, NULL);
+
+  return entry ? entry->value : NULL;
+}
+
+void
+hashidx_remove(struct hashidx *idx, const uint8_t *key, void *value)
+{
+  struct hashidx_entry *entry;
+
+  entry = hashidx_find(idx, key, value);
+  if (!entry)
+    return;
+
+  entry->state = HASHIDX_DELETED;
+  entry->value = NULL;
+  idx->count--;
+  idx->deleted++;
+}
+
+void
+hashidx_key_from_u64(uint8_t *key, uint64_t id)
+{
+  memset(key, 0, HASHIDX_KEY_LEN);
+  memcpy(key, &id, sizeof(id));
+}
+
 
 /* ------------------------- Clock utility functions ------------------------ */
 
@@ -1765,6 +2168,49 @@ media_format_to_string(enum media_format format)
   return "unknown";
 }
 
+void
+pcm_to_be(uint8_t *dst, const uint8_t *src, size_t len, int bits_per_sample)
+{
+  size_t i = 0;
+  uint8_t tmp;
+
+  if (bits_per_sample == 24)
+    {
+      // Just swap the outer bytes of each sample
+      for (i = 0; i + 3 <= len; i += 3)
+	{
+	  tmp = src[i];
+	  dst[i] = src[i + 2];
+	  dst[i + 1] = src[i + 1];
+	  dst[i + 2] = tmp;
+	}
+      return;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+# elif defined(__ARM_NEON)
+  for (; i + 16 <= len; i += 16)
+    vst1q_u8(dst + i, vrev16q_u8(vld1q_u8(src + i)));
+# endif
+
+  for (; i + 2 <= len; i += 2)
+    {
+      tmp = src[i];
+      dst[i] = src[i + 1];
+      dst[i + 1] = tmp;
+    }
+#else
+  if (dst != src)
+    memcpy(dst, src, len);
+#endif
+}
+
 
 /* -------------------------- Misc utility functions ------------------------ */
 
@@ -47,6 +47,16 @@ net_bind(short unsigned *port, int type, const char *log_service_name);
 int
 net_bind_with_reuseport(short unsigned *port, int type, const char *log_service_name);
 
+// Asks the kernel to timestamp datagrams received on the socket
+int
+net_rx_timestamps_enable(int fd);
+
+// Gets the time a datagram was received from the control messages of a
+// recvmsg(), converted to CLOCK_MONOTONIC. Returns 1 if the time was the
+// kernel's timestamp, 0 if the clock had to be read instead, -1 on error.
+int
+net_rx_timestamp_get(struct timespec *ts, struct msghdr *msg);
+
 // To avoid polluting namespace too much we don't include event2/http.h here
 struct evhttp;
 
@@ -210,6 +220,128 @@ ringbuffer_write(struct ringbuffer *buf, const void* src, size_t srclen);
 size_t
 ringbuffer_read(uint8_t **dst, size_t dstlen, struct ringbuffer *buf);
 
+// Lock-free single producer/single consumer ring. The size is a power of two
+// so positions can be free running counters that are masked on access. Each
+// counter is only written by one side and has its own cache line, so producer
+// and consumer don't contend. The start of the buffer is mirrored after the
+// end, which means the consumer can always get up to slice_max contiguous bytes
+// without copying, e.g. one packet worth of PCM.
+#define SPSC_RINGBUFFER_CACHELINE 64
+
+enum spsc_ringbuffer_watermark
+{
+  SPSC_RINGBUFFER_LOW,
+  SPSC_RINGBUFFER_HIGH,
+};
+
+struct spsc_ringbuffer;
+
+// Called when the fill level rises to the high watermark (from the producer
+// thread) or falls to the low watermark (from the consumer thread)
+typedef void (*spsc_ringbuffer_watermark_cb)(struct spsc_ringbuffer *buf, enum spsc_ringbuffer_watermark mark, void *arg);
+
+struct spsc_ringbuffer {
+  uint8_t *buffer;
+  size_t size;
+  size_t mask;
+  size_t slice_max;
+
+  size_t low_watermark;
+  size_t high_watermark;
+  spsc_ringbuffer_watermark_cb watermark_cb;
+  void *watermark_arg;
+
+  // Only written by the producer
+  size_t write_pos __attribute__((aligned(SPSC_RINGBUFFER_CACHELINE)));
+
+  // Only written by the consumer
+  size_t read_pos __attribute__((aligned(SPSC_RINGBUFFER_CACHELINE)));
+} __attribute__((aligned(SPSC_RINGBUFFER_CACHELINE)));
+
+// Size is rounded up to a power of two, slice_max is the largest contiguous read
+int
+spsc_ringbuffer_init(struct spsc_ringbuffer *buf, size_t size, size_t slice_max);
+
+void
+spsc_ringbuffer_free(struct spsc_ringbuffer *buf);
+
+void
+spsc_ringbuffer_watermarks_set(struct spsc_ringbuffer *buf, size_t low, size_t high, spsc_ringbuffer_watermark_cb cb, void *arg);
+
+size_t
+spsc_ringbuffer_read_avail(struct spsc_ringbuffer *buf);
+
+size_t
+spsc_ringbuffer_write_avail(struct spsc_ringbuffer *buf);
+
+// Producer: gets a pointer to contiguous free space (e.g. for read()) and
+// returns its length, then spsc_ringbuffer_write_commit() publishes what was
+// actually written
+size_t
+spsc_ringbuffer_write_reserve(uint8_t **dst, struct spsc_ringbuffer *buf);
+
+void
+spsc_ringbuffer_write_commit(struct spsc_ringbuffer *buf, size_t len);
+
+size_t
+spsc_ringbuffer_write(struct spsc_ringbuffer *buf, const void *src, size_t srclen);
+
+// Consumer: returns MIN(dstlen, read_avail) contiguous bytes at *dst, where
+// dstlen must not exceed slice_max. The bytes stay valid until they are
+// released with spsc_ringbuffer_read_commit().
+size_t
+spsc_ringbuffer_read_peek(uint8_t **dst, size_t dstlen, struct spsc_ringbuffer *buf);
+
+// Same, but starting skip bytes after the read position, so the consumer can
+// read ahead of what it has released
+size_t
+spsc_ringbuffer_read_peek_at(uint8_t **dst, size_t skip, size_t dstlen, struct spsc_ringbuffer *buf);
+
+void
+spsc_ringbuffer_read_commit(struct spsc_ringbuffer *buf, size_t len);
+
+
+/* ------------------------------- Hash index ------------------------------- */
+
+// Open addressing (linear probing) index from a fixed size key to a pointer,
+// e.g. a normalised network address or a 64 bit id. The same key may be added
+// more than once (with different values), hashidx_get() then returns one of
+// them.
+#define HASHIDX_KEY_LEN 16
+
+struct hashidx_entry {
+  uint8_t key[HASHIDX_KEY_LEN];
+  void *value;
+  uint8_t state;
+};
+
+struct hashidx {
+  struct hashidx_entry *entries;
+  size_t size;
+  size_t count;
+  size_t deleted;
+};
+
+int
+hashidx_init(struct hashidx *idx, size_t size_hint);
+
+void
+hashidx_free(struct hashidx *idx);
+
+void
+hashidx_add(struct hashidx *idx, const uint8_t *key, void *value);
+
+void *
+hashidx_get(struct hashidx *idx, const uint8_t *key);
+
+// Removes the entry for key that has the given value
+void
+hashidx_remove(struct hashidx *idx, const uint8_t *key, void *value);
+
+// Makes a key from a 64 bit id
+void
+hashidx_key_from_u64(uint8_t *key, uint64_t id);
+
 
 /* ------------------------- Clock utility functions ------------------------ */
 
@@ -304,6 +436,12 @@ media_format_from_string(const char *s);
 const char *
 media_format_to_string(enum media_format format);
 
+// Converts interleaved native endian PCM to big endian (network order), e.g.
+// for RTP L16/L24. 16 bit samples are two bytes, 24 bit are packed three bytes
+// (little endian in src). dst and src may be the same.
+void
+pcm_to_be(uint8_t *dst, const uint8_t *src, size_t len, int bits_per_sample);
+
 
 /* -------------------------- Misc utility functions ------------------------ */
 
@@ -28,15 +28,21 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <math.h>
 
 #include <event2/event.h>
 
 #include "logger.h"
 #include "misc.h"
-#include "transcode.h"
+#ifdef HAVE_TRANSCODE
+# include "transcode.h"
+#endif
+#include "pcm_convert.h"
+#include "evthr.h"
 #include "db.h"
 #include "player.h" //TODO remove me when player_pmap is removed again
-// #include "worker.h"
+#include "worker.h"
 #include "outputs.h"
 
 // extern struct output_definition output_raop;
@@ -89,6 +95,19 @@ static struct output_definition *outputs[] = {
 
 #define OUTPUTS_MAX_CALLBACKS 64
 
+// Worker threads for converting to the subscribed qualities. The player thread
+// does one of the conversions itself.
+#define OUTPUTS_CONVERT_THREADS 2
+
+// Setting up and tearing down the subscriptions' contexts can be slow (ffmpeg),
+// so it is done by its own thread, where it doesn't hold up the conversions
+#define OUTPUTS_SETUP_THREADS 1
+
+// The conversions of a write must be done within this share of the duration of
+// the audio, otherwise they are left out of that write. A late conversion is
+// not waited for, the subscription is skipped until it is done.
+#define OUTPUTS_CONVERT_DEADLINE_DIV 2
+
 struct outputs_callback_register
 {
   output_status_cb cb;
@@ -102,16 +121,128 @@ struct outputs_callback_register
   enum output_device_state state;
 };
 
+struct output_slice
+{
+  int refcount;
+  // Holds the data, NULL for outputs_input_slice
+  struct evbuffer *evbuf;
+  // Next free slice in outputs_slice_pool
+  struct output_slice *next;
+};
+
+// A conversion of the input to a subscribed quality. Since a job that misses
+// the deadline finishes in the background, it has its own reference to the
+// input (if it is run by a worker) and to the contexts.
+struct outputs_convert_job
+{
+  struct output_quality_subscription *subscription;
+  struct pcm_convert_ctx *convert_ctx;
+  struct encode_ctx *encode_ctx;
+  struct media_quality quality;
+  struct output_slice *input;
+  void *buf;
+  size_t bufsize;
+  int nsamples;
+
+  // Protected by the barrier mutex. If the subscription releases the contexts
+  // while a late job is running, the job is orphaned and frees them and itself
+  // when it is done.
+  struct output_slice *slice;
+  bool done;
+  bool late;
+  bool orphaned;
+};
+
+struct outputs_convert_barrier
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int pending;
+};
+
+struct outputs_convert_stats
+{
+  uint64_t jobs;
+  uint64_t deferred;
+  uint64_t missed;
+};
+
+struct outputs_slice_stats
+{
+  uint64_t writes;
+  uint64_t allocated;
+  uint64_t copies;
+  uint64_t copied_bytes;
+};
+
 struct output_quality_subscription
 {
   int count;
   struct media_quality quality;
+  enum output_resampler resampler;
+  // The input quality that the contexts are for
+  struct media_quality input_quality;
+  // Only one of these is set, convert_ctx unless ffmpeg must resample
+  struct pcm_convert_ctx *convert_ctx;
+  struct encode_ctx *encode_ctx;
+  // New contexts must be made by a setup job (see subscription_setup_start).
+  // Each time it gets a new generation from outputs_setup_gen, so outdated
+  // jobs can be ignored.
+  bool setup_needed;
+  unsigned setup_gen;
+  // A conversion that missed its deadline and may still use the contexts
+  struct outputs_convert_job *late_job;
+};
+
+// Makes the contexts for a subscription in the setup worker
+struct outputs_setup_job
+{
+  struct event *ev;
+  unsigned gen;
+  struct media_quality input_quality;
+  struct media_quality quality;
+  enum output_resampler resampler;
+
+  struct pcm_convert_ctx *convert_ctx;
+  struct encode_ctx *encode_ctx;
+};
+
+// Contexts that are freed by the setup worker
+struct outputs_ctx_free_arg
+{
+  struct pcm_convert_ctx *convert_ctx;
   struct encode_ctx *encode_ctx;
 };
 
 // Buffer used to pass data to the backends
 static struct output_buffer output_buffer;
 
+// Slice for the player's input data, which is only valid during write(). The
+// convert workers take references, and while they have them the player keeps
+// the data in its ring (see outputs_input_busy). A backend that wants to keep
+// the data gets a real slice instead.
+static struct output_slice outputs_input_slice;
+
+// Slices that no one references any more, ready for reuse. Backends may drop
+// their references from other threads, so protected by the lock.
+static struct output_slice *outputs_slice_pool;
+static pthread_mutex_t outputs_slice_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct outputs_slice_stats outputs_slice_stats;
+
+static struct evthr_pool *outputs_convert_pool;
+static struct evthr_pool *outputs_setup_pool;
+// Never reset, so a setup job for an earlier subscription to the same quality
+// can't be mistaken for a current one
+static unsigned outputs_setup_gen;
+static struct outputs_convert_job *outputs_convert_jobs[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS];
+static int outputs_convert_njobs;
+// The cond uses CLOCK_MONOTONIC, so it is initialized by outputs_init()
+static struct outputs_convert_barrier outputs_convert_barrier =
+{
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct outputs_convert_stats outputs_convert_stats;
+
 static struct output_device *outputs_device_list;
 static int outputs_master_volume;
 
@@ -121,7 +252,6 @@ static struct timeval outputs_stop_timeout = { OUTPUTS_STOP_TIMEOUT, 0 };
 
 // Last element is a zero terminator
 static struct output_quality_subscription output_quality_subscriptions[OUTPUTS_MAX_QUALITY_SUBSCRIPTIONS + 1];
-static bool outputs_got_new_subscription;
 
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
@@ -264,6 +394,7 @@ device_stop_cb(struct output_device *device, enum output_device_state state)
     DPRINTF(E_INFO, L_PLAYER, "Device stopped properly\n");
 }
 
+#ifdef HAVE_TRANSCODE
 static enum transcode_profile
 quality_to_xcode(struct media_quality *quality)
 {
@@ -277,103 +408,609 @@ quality_to_xcode(struct media_quality *quality)
   return XCODE_UNKNOWN;
 }
 
-static int
-encoding_reset(struct media_quality *quality)
+// Returns NULL if ffmpeg can't do the conversion either
+static struct encode_ctx *
+encode_setup(struct media_quality *in, struct media_quality *out)
 {
   struct transcode_encode_setup_args encode_args = { 0 };
-  struct output_quality_subscription *subscription;
+  struct encode_ctx *encode_ctx;
   enum transcode_profile profile;
-  int i;
 
-  profile = quality_to_xcode(quality);
-  if  (profile == XCODE_UNKNOWN)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Could not create subscription decoding context, invalid quality (%d/%d/%d)\n",
-	quality->sample_rate, quality->bits_per_sample, quality->channels);
-      return -1;
-    }
+  profile = quality_to_xcode(in);
+  encode_args.profile = quality_to_xcode(out);
+  if (profile == XCODE_UNKNOWN || encode_args.profile == XCODE_UNKNOWN)
+    return NULL;
 
-  encode_args.src_ctx = transcode_decode_setup_raw(profile, quality);
+  encode_args.src_ctx = transcode_decode_setup_raw(profile, in);
   if (!encode_args.src_ctx)
     {
       DPRINTF(E_LOG, L_PLAYER, "Could not create subscription decoding context (profile %d)\n", profile);
-      return -1;
+      return NULL;
     }
 
+  encode_args.quality = out;
+  encode_ctx = transcode_encode_setup(encode_args);
+
+  transcode_decode_cleanup(&encode_args.src_ctx);
+
+  return encode_ctx;
+}
+
+static int
+encode_run(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, void *buf, size_t bufsize, int nsamples, struct media_quality *quality)
+{
+  transcode_frame *frame;
+  int ret;
+
+  frame = transcode_frame_new(buf, bufsize, nsamples, quality);
+  if (!frame)
+    return -1;
+
+  ret = transcode_encode(evbuf, encode_ctx, frame, 0);
+  transcode_frame_free(frame);
+
+  return ret;
+}
+
+static void
+encode_free(struct encode_ctx **encode_ctx)
+{
+  transcode_encode_cleanup(encode_ctx);
+}
+#else
+// Built without the transcoder, so only our own converter is available
+static struct encode_ctx *
+encode_setup(struct media_quality *in, struct media_quality *out)
+{
+  return NULL;
+}
+
+static int
+encode_run(struct evbuffer *evbuf, struct encode_ctx *encode_ctx, void *buf, size_t bufsize, int nsamples, struct media_quality *quality)
+{
+  return -1;
+}
+
+static void
+encode_free(struct encode_ctx **encode_ctx)
+{
+  *encode_ctx = NULL;
+}
+#endif
+
+static enum pcm_resample_preset
+resampler_to_preset(enum output_resampler resampler)
+{
+  if (resampler == OUTPUT_RESAMPLER_FAST)
+    return PCM_RESAMPLE_FAST;
+  if (resampler == OUTPUT_RESAMPLER_BEST)
+    return PCM_RESAMPLE_BEST;
+
+  return PCM_RESAMPLE_BALANCED;
+}
+
+// Returns NULL if ffmpeg is required
+static struct pcm_convert_ctx *
+convert_setup(struct media_quality *in, struct media_quality *out, enum output_resampler resampler)
+{
+  if (in->sample_rate != out->sample_rate && resampler == OUTPUT_RESAMPLER_FFMPEG)
+    return NULL;
+
+  return pcm_convert_setup(pcm_format_from_bits(in->bits_per_sample), in->channels, in->sample_rate,
+    pcm_format_from_bits(out->bits_per_sample), out->channels, out->sample_rate, resampler_to_preset(resampler));
+}
+
+// *** Setup worker ***
+static void
+subscription_ctx_free_cb(struct evthr *thr, void *arg, void *shared)
+{
+  struct outputs_ctx_free_arg *ctx_free_arg = arg;
+
+  pcm_convert_free(ctx_free_arg->convert_ctx);
+  encode_free(&ctx_free_arg->encode_ctx);
+  free(ctx_free_arg);
+}
+
+static bool
+convert_job_reap(struct output_quality_subscription *subscription, bool orphan);
+
+// Hands the contexts to the setup worker, since tearing down an ffmpeg context
+// is not something we want to do on the audio path
+static void
+subscription_ctx_release(struct output_quality_subscription *subscription)
+{
+  struct outputs_ctx_free_arg *ctx_free_arg;
+
+  if (subscription->late_job && !convert_job_reap(subscription, true))
+    {
+      // The late job still uses the contexts, so it will free them
+      subscription->convert_ctx = NULL;
+      subscription->encode_ctx = NULL;
+      return;
+    }
+
+  if (!subscription->convert_ctx && !subscription->encode_ctx)
+    return;
+
+  CHECK_NULL(L_PLAYER, ctx_free_arg = malloc(sizeof(struct outputs_ctx_free_arg)));
+  ctx_free_arg->convert_ctx = subscription->convert_ctx;
+  ctx_free_arg->encode_ctx = subscription->encode_ctx;
+
+  if (!outputs_setup_pool || evthr_pool_defer(outputs_setup_pool, subscription_ctx_free_cb, ctx_free_arg) != EVTHR_RES_OK)
+    subscription_ctx_free_cb(NULL, ctx_free_arg, NULL);
+
+  subscription->convert_ctx = NULL;
+  subscription->encode_ctx = NULL;
+}
+
+static void
+subscription_setup_job_free(struct outputs_setup_job *job)
+{
+  pcm_convert_free(job->convert_ctx);
+  encode_free(&job->encode_ctx);
+  event_free(job->ev);
+  free(job);
+}
+
+// Called when the worker is done with a setup job. If the subscription still
+// wants the contexts, they replace the ones it has, so a subscription that has
+// contexts keeps converting with them until the new ones are ready.
+static void
+subscription_setup_done_cb(int fd, short what, void *arg)
+{
+  struct outputs_setup_job *job = arg;
+  struct output_quality_subscription *subscription;
+  int i;
+
+  subscription = NULL;
   for (i = 0; output_quality_subscriptions[i].count > 0; i++)
     {
-      subscription = &output_quality_subscriptions[i]; // Just for short-hand
+      if (quality_is_equal(&job->quality, &output_quality_subscriptions[i].quality) && job->gen == output_quality_subscriptions[i].setup_gen)
+	{
+	  subscription = &output_quality_subscriptions[i];
+	  break;
+	}
+    }
+
+  if (!subscription)
+    {
+      DPRINTF(E_DBG, L_PLAYER, "Discarding outdated setup of quality %d/%d/%d\n",
+	job->quality.sample_rate, job->quality.bits_per_sample, job->quality.channels);
+      goto out;
+    }
+
+  if (!job->convert_ctx && !job->encode_ctx)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not setup resampling to %d/%d/%d for output\n",
+	subscription->quality.sample_rate, subscription->quality.bits_per_sample, subscription->quality.channels);
+      goto out;
+    }
 
-      transcode_encode_cleanup(&subscription->encode_ctx); // Will also point the ctx to NULL
+  subscription_ctx_release(subscription);
 
-      if (quality_is_equal(quality, &subscription->quality))
-	continue; // No resampling required
+  subscription->convert_ctx = job->convert_ctx;
+  subscription->encode_ctx = job->encode_ctx;
+  job->convert_ctx = NULL;
+  job->encode_ctx = NULL;
 
-      encode_args.profile = quality_to_xcode(&subscription->quality);
-      encode_args.quality = &subscription->quality;
-      if (encode_args.profile != XCODE_UNKNOWN)
-	subscription->encode_ctx = transcode_encode_setup(encode_args);
-      else
-	DPRINTF(E_LOG, L_PLAYER, "Could not setup resampling to %d/%d/%d for output\n",
-	  subscription->quality.sample_rate, subscription->quality.bits_per_sample, subscription->quality.channels);
+  DPRINTF(E_DBG, L_PLAYER, "Converting to %d/%d/%d for output (%s)\n",
+    subscription->quality.sample_rate, subscription->quality.bits_per_sample, subscription->quality.channels,
+    subscription->convert_ctx ? pcm_convert_kernels_name() : "ffmpeg");
+
+ out:
+  subscription_setup_job_free(job);
+}
+
+// *** Setup worker ***
+static void
+subscription_setup_cb(struct evthr *thr, void *arg, void *shared)
+{
+  struct outputs_setup_job *job = arg;
+
+  job->convert_ctx = convert_setup(&job->input_quality, &job->quality, job->resampler);
+  if (!job->convert_ctx)
+    job->encode_ctx = encode_setup(&job->input_quality, &job->quality);
+
+  // Let the player thread swap the contexts in
+  event_active(job->ev, 0, 0);
+}
+
+static void
+subscription_setup_start(struct output_quality_subscription *subscription)
+{
+  struct outputs_setup_job *job;
+
+  CHECK_NULL(L_PLAYER, job = calloc(1, sizeof(struct outputs_setup_job)));
+
+  job->ev = event_new(evbase_player, -1, 0, subscription_setup_done_cb, job);
+  job->gen = subscription->setup_gen;
+  job->input_quality = subscription->input_quality;
+  job->quality = subscription->quality;
+  job->resampler = subscription->resampler;
+
+  subscription->setup_needed = false;
+
+  // Without the pool it is done here, but the swap is still deferred
+  if (!outputs_setup_pool || evthr_pool_defer(outputs_setup_pool, subscription_setup_cb, job) != EVTHR_RES_OK)
+    subscription_setup_cb(NULL, job, NULL);
+}
+
+// Checks if the subscription's contexts fit the input, and if not, starts
+// making new ones. Only this subscription is affected, the others keep their
+// contexts and state.
+static void
+subscription_update(struct output_quality_subscription *subscription, struct media_quality *quality)
+{
+  if (quality_is_equal(&subscription->input_quality, quality) && !subscription->setup_needed)
+    return;
+
+  if (!quality_is_equal(&subscription->input_quality, quality))
+    {
+      // The contexts are for another input quality, so they are useless now
+      subscription_ctx_release(subscription);
+      subscription->input_quality = *quality;
+      subscription->setup_gen = ++outputs_setup_gen;
+      subscription->setup_needed = true;
     }
 
-  transcode_decode_cleanup(&encode_args.src_ctx);
+  if (quality_is_equal(&subscription->quality, quality))
+    {
+      subscription->setup_needed = false;
+      return; // No conversion required, we have the data in element 0
+    }
 
-  return 0;
+  subscription_setup_start(subscription);
+}
+
+static struct output_slice *
+slice_get(void)
+{
+  struct output_slice *slice;
+
+  pthread_mutex_lock(&outputs_slice_lck);
+  slice = outputs_slice_pool;
+  if (slice)
+    outputs_slice_pool = slice->next;
+  pthread_mutex_unlock(&outputs_slice_lck);
+
+  if (!slice)
+    {
+      CHECK_NULL(L_PLAYER, slice = calloc(1, sizeof(struct output_slice)));
+      CHECK_NULL(L_PLAYER, slice->evbuf = evbuffer_new());
+      __atomic_add_fetch(&outputs_slice_stats.allocated, 1, __ATOMIC_RELAXED);
+    }
+
+  slice->next = NULL;
+  slice->refcount = 1;
+  return slice;
 }
 
 static void
-buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_quality *quality, int nsamples, struct timespec *pts)
+slice_ref(struct output_slice *slice)
 {
-  transcode_frame *frame;
+  __atomic_add_fetch(&slice->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+slice_unref(struct output_slice *slice)
+{
+  if (!slice)
+    return;
+
+  // Not pooled, the data belongs to the player
+  if (slice == &outputs_input_slice)
+    {
+      __atomic_sub_fetch(&slice->refcount, 1, __ATOMIC_RELEASE);
+      return;
+    }
+
+  if (__atomic_sub_fetch(&slice->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  // Last reference gone, so we can reuse the storage
+  evbuffer_drain(slice->evbuf, evbuffer_get_length(slice->evbuf));
+
+  pthread_mutex_lock(&outputs_slice_lck);
+  slice->next = outputs_slice_pool;
+  outputs_slice_pool = slice;
+  pthread_mutex_unlock(&outputs_slice_lck);
+}
+
+static void
+slice_pool_free(void)
+{
+  struct output_slice *slice;
+
+  pthread_mutex_lock(&outputs_slice_lck);
+  while ((slice = outputs_slice_pool))
+    {
+      outputs_slice_pool = slice->next;
+      evbuffer_free(slice->evbuf);
+      free(slice);
+    }
+  pthread_mutex_unlock(&outputs_slice_lck);
+}
+
+// A backend wants to keep the player's input data beyond write(), so we must
+// copy it. The copy replaces the input data in obuf, so the
+// other backends that keep it will share the copy.
+static void
+input_slice_detach(struct output_data *data)
+{
+  struct output_slice *slice;
+
+  slice = slice_get();
+  evbuffer_add(slice->evbuf, data->buffer, data->bufsize);
+
+  slice_unref(data->slice);
+  data->slice  = slice;
+  data->buffer = evbuffer_pullup(slice->evbuf, -1);
+
+  outputs_slice_stats.copies++;
+  outputs_slice_stats.copied_bytes += data->bufsize;
+}
+
+static int
+buffer_convert(struct evbuffer *evbuf, struct pcm_convert_ctx *ctx, void *buf, int nsamples)
+{
+  struct evbuffer_iovec iov;
+  int ret;
+
+  // Reserving one iovec gives us contiguous space, so the pullup will be free
+  ret = evbuffer_reserve_space(evbuf, pcm_convert_out_max(ctx, nsamples), &iov, 1);
+  if (ret != 1)
+    return -1;
+
+  iov.iov_len = pcm_convert(ctx, iov.iov_base, buf, nsamples);
+
+  return evbuffer_commit_space(evbuf, &iov, 1);
+}
+
+// Returns a slice with the input converted with the given contexts, or NULL.
+// Called from the player thread or a convert worker.
+static struct output_slice *
+slice_convert(struct pcm_convert_ctx *convert_ctx, struct encode_ctx *encode_ctx, void *buf, size_t bufsize, int nsamples, struct media_quality *quality)
+{
+  struct output_slice *slice;
+  int ret;
+
+  if (convert_ctx)
+    {
+      slice = slice_get();
+      ret = buffer_convert(slice->evbuf, convert_ctx, buf, nsamples);
+    }
+  else if (encode_ctx)
+    {
+      slice = slice_get();
+      ret = encode_run(slice->evbuf, encode_ctx, buf, bufsize, nsamples, quality);
+    }
+  else
+    return NULL;
+
+  if (ret < 0 || evbuffer_get_length(slice->evbuf) == 0)
+    {
+      slice_unref(slice);
+      return NULL;
+    }
+
+  // Makes the data contiguous, after this the slice is not modified
+  evbuffer_pullup(slice->evbuf, -1);
+
+  return slice;
+}
+
+static void
+convert_job_free(struct outputs_convert_job *job)
+{
+  slice_unref(job->slice);
+  slice_unref(job->input);
+  free(job);
+}
+
+static void
+convert_job_run(struct outputs_convert_job *job)
+{
+  struct output_slice *slice;
+  bool orphaned;
+
+  slice = slice_convert(job->convert_ctx, job->encode_ctx, job->buf, job->bufsize, job->nsamples, &job->quality);
+
+  pthread_mutex_lock(&outputs_convert_barrier.mutex);
+  job->slice = slice;
+  job->done = true;
+  orphaned = job->orphaned;
+  if (!job->late)
+    {
+      outputs_convert_barrier.pending--;
+      if (outputs_convert_barrier.pending == 0)
+	pthread_cond_signal(&outputs_convert_barrier.cond);
+    }
+  pthread_mutex_unlock(&outputs_convert_barrier.mutex);
+
+  if (orphaned)
+    {
+      pcm_convert_free(job->convert_ctx);
+      encode_free(&job->encode_ctx);
+      convert_job_free(job);
+    }
+}
+
+static void
+convert_job_cb(struct evthr *thr, void *arg, void *shared)
+{
+  convert_job_run(arg);
+}
+
+// Frees the subscription's late job if it is done. If it isn't and orphan is
+// true, the job is detached from the subscription and will free itself and the
+// contexts. Returns true if the subscription no longer has a late job.
+static bool
+convert_job_reap(struct output_quality_subscription *subscription, bool orphan)
+{
+  struct outputs_convert_job *job = subscription->late_job;
+  bool done;
+
+  pthread_mutex_lock(&outputs_convert_barrier.mutex);
+  done = job->done;
+  if (!done && orphan)
+    job->orphaned = true;
+  pthread_mutex_unlock(&outputs_convert_barrier.mutex);
+
+  if (done)
+    convert_job_free(job);
+  else if (!orphan)
+    return false;
+
+  subscription->late_job = NULL;
+  return done;
+}
+
+// Converts the input for all the jobs. The first job is run by the calling
+// thread, the others are handed to the worker pool. Those hold a reference to
+// the input, since they may outlive write(). Then we wait for them, but only
+// until the deadline, so that a slow conversion doesn't hold back every output.
+static void
+convert_jobs_run(struct output_data *input, struct timespec *deadline)
+{
+  struct outputs_convert_job *job;
   int ret;
   int i;
-  int n;
 
-  obuf->pts = *pts;
+  outputs_convert_barrier.pending = outputs_convert_njobs;
 
-  // The resampling/encoding (transcode) contexts work for a given input quality,
-  // so if the quality changes we need to reset the contexts. We also do that if
-  // we have received a subscription for a new quality.
-  if (!quality_is_equal(quality, &obuf->data[0].quality) || outputs_got_new_subscription)
+  for (i = 1; i < outputs_convert_njobs; i++)
     {
-      encoding_reset(quality);
-      outputs_got_new_subscription = false;
+      job = outputs_convert_jobs[i];
+
+      if (outputs_convert_pool)
+	{
+	  slice_ref(input->slice);
+	  job->input = input->slice;
+	  job->buf = input->buffer;
+
+	  if (evthr_pool_defer(outputs_convert_pool, convert_job_cb, job) == EVTHR_RES_OK)
+	    {
+	      outputs_convert_stats.deferred++;
+	      continue;
+	    }
+	}
+
+      convert_job_run(job);
     }
 
-  // The first element of the output_buffer is always just the raw input data
-  // TODO can we avoid the copy below? we can't use evbuffer_add_buffer_reference,
-  // because then the outputs can't use it and we would need to copy there instead
-  evbuffer_add(obuf->data[0].evbuf, buf, bufsize);
+  if (outputs_convert_njobs > 0)
+    convert_job_run(outputs_convert_jobs[0]);
+
+  pthread_mutex_lock(&outputs_convert_barrier.mutex);
+  while (outputs_convert_barrier.pending > 0)
+    {
+      ret = pthread_cond_timedwait(&outputs_convert_barrier.cond, &outputs_convert_barrier.mutex, deadline);
+      if (ret == ETIMEDOUT)
+	break;
+    }
+  pthread_mutex_unlock(&outputs_convert_barrier.mutex);
+}
+
+static void
+buffer_fill(struct output_buffer *obuf, void *buf, size_t bufsize, struct media_quality *quality, int nsamples, struct timespec *pts)
+{
+  struct output_quality_subscription *subscription;
+  struct outputs_convert_job *job;
+  struct timespec deadline;
+  uint64_t nsec;
+  int i;
+  int n;
+
+  obuf->pts = *pts;
+
+  // The first element of the output_buffer is always just the raw input data.
+  // It isn't copied, unless a backend wants to keep it (see buffer_copy).
+  slice_ref(&outputs_input_slice);
+  obuf->data[0].slice = &outputs_input_slice;
   obuf->data[0].buffer = buf;
   obuf->data[0].bufsize = bufsize;
   obuf->data[0].quality = *quality;
   obuf->data[0].samples = nsamples;
 
-  for (i = 0, n = 1; output_quality_subscriptions[i].count > 0; i++)
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
     {
-      if (quality_is_equal(&output_quality_subscriptions[i].quality, quality))
+      subscription = &output_quality_subscriptions[i]; // Just for short-hand
+
+      // The resampling/encoding contexts work for a given input quality, so if
+      // the quality changes they must be remade. That is done by the worker,
+      // the subscription is skipped until it has them.
+      subscription_update(subscription, quality);
+
+      if (quality_is_equal(&subscription->quality, quality))
 	continue; // Skip, no resampling required and we have the data in element 0
 
-      if (!output_quality_subscriptions[i].encode_ctx)
+      if (!subscription->convert_ctx && !subscription->encode_ctx)
 	continue;
 
-      frame = transcode_frame_new(buf, bufsize, nsamples, quality);
-      if (!frame)
-	continue;
+      // The conversion from a previous write is still using the contexts
+      if (subscription->late_job && !convert_job_reap(subscription, false))
+	{
+	  outputs_convert_stats.missed++;
+	  continue;
+	}
 
-      ret = transcode_encode(obuf->data[n].evbuf, output_quality_subscriptions[i].encode_ctx, frame, 0);
-      transcode_frame_free(frame);
-      if (ret < 0)
-	continue;
+      CHECK_NULL(L_PLAYER, job = calloc(1, sizeof(struct outputs_convert_job)));
+      job->subscription = subscription;
+      job->convert_ctx = subscription->convert_ctx;
+      job->encode_ctx = subscription->encode_ctx;
+      job->quality = *quality;
+      job->buf = buf;
+      job->bufsize = bufsize;
+      job->nsamples = nsamples;
+
+      outputs_convert_jobs[outputs_convert_njobs++] = job;
+    }
 
-      obuf->data[n].buffer  = evbuffer_pullup(obuf->data[n].evbuf, -1);
-      obuf->data[n].bufsize = evbuffer_get_length(obuf->data[n].evbuf);
-      obuf->data[n].quality = output_quality_subscriptions[i].quality;
-      obuf->data[n].samples = BTOS(obuf->data[n].bufsize, obuf->data[n].quality.bits_per_sample, obuf->data[n].quality.channels);
-      n++;
+  if (outputs_convert_njobs == 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  nsec = deadline.tv_nsec + (uint64_t)nsamples * 1000000000 / quality->sample_rate / OUTPUTS_CONVERT_DEADLINE_DIV;
+  deadline.tv_sec += nsec / 1000000000;
+  deadline.tv_nsec = nsec % 1000000000;
+
+  convert_jobs_run(&obuf->data[0], &deadline);
+
+  outputs_convert_stats.jobs += outputs_convert_njobs;
+
+  pthread_mutex_lock(&outputs_convert_barrier.mutex);
+  for (i = 0, n = 1; i < outputs_convert_njobs; i++)
+    {
+      job = outputs_convert_jobs[i];
+      if (!job->done)
+	{
+	  // Left to finish in the background, see convert_job_reap()
+	  job->late = true;
+	  job->subscription->late_job = job;
+	  outputs_convert_stats.missed++;
+	  continue;
+	}
+
+      if (job->slice)
+	{
+	  obuf->data[n].slice   = job->slice;
+	  obuf->data[n].buffer  = evbuffer_pullup(job->slice->evbuf, -1);
+	  obuf->data[n].bufsize = evbuffer_get_length(job->slice->evbuf);
+	  obuf->data[n].quality = job->subscription->quality;
+	  obuf->data[n].samples = BTOS(obuf->data[n].bufsize, obuf->data[n].quality.bits_per_sample, obuf->data[n].quality.channels);
+	  n++;
+
+	  // Now owned by obuf
+	  job->slice = NULL;
+	}
+
+      convert_job_free(job);
     }
+
+  // The late jobs don't count any more
+  outputs_convert_barrier.pending = 0;
+  outputs_convert_njobs = 0;
+  pthread_mutex_unlock(&outputs_convert_barrier.mutex);
 }
 
 static void
@@ -383,7 +1020,8 @@ buffer_drain(struct output_buffer *obuf)
 
   for (i = 0; obuf->data[i].buffer; i++)
     {
-      evbuffer_drain(obuf->data[i].evbuf, obuf->data[i].bufsize);
+      slice_unref(obuf->data[i].slice);
+      obuf->data[i].slice   = NULL;
       obuf->data[i].buffer  = NULL;
       obuf->data[i].bufsize = 0;
       // We don't reset quality and samples, would be a waste of time
@@ -405,9 +1043,12 @@ buffer_copy(struct output_buffer *obuf)
 
   for (i = 0; obuf->data[i].buffer; i++)
     {
-      CHECK_NULL(L_PLAYER, copy->data[i].evbuf = evbuffer_new());
-      evbuffer_add(copy->data[i].evbuf, obuf->data[i].buffer, obuf->data[i].bufsize);
-      copy->data[i].buffer = evbuffer_pullup(copy->data[i].evbuf, -1);
+      if (obuf->data[i].slice == &outputs_input_slice)
+	input_slice_detach(&obuf->data[i]);
+
+      slice_ref(obuf->data[i].slice);
+      copy->data[i].slice  = obuf->data[i].slice;
+      copy->data[i].buffer = obuf->data[i].buffer;
     }
 
   return copy;
@@ -422,7 +1063,7 @@ buffer_free(struct output_buffer *obuf)
     return;
 
   for (i = 0; obuf->data[i].buffer; i++)
-    evbuffer_free(obuf->data[i].evbuf);
+    slice_unref(obuf->data[i].slice);
 
   free(obuf);
 }
@@ -672,12 +1313,12 @@ outputs_quality_subscribe(struct media_quality *quality)
   output_quality_subscriptions[i].quality = *quality;
   output_quality_subscriptions[i].count++;
 
+  // The contexts are made when we know the input quality, see buffer_fill()
+  output_quality_subscriptions[i].setup_needed = true;
+
   DPRINTF(E_DBG, L_PLAYER, "Subscription request for quality %d/%d/%d (now %d subscribers)\n",
     quality->sample_rate, quality->bits_per_sample, quality->channels, output_quality_subscriptions[i].count);
 
-  // Better way of signaling this?
-  outputs_got_new_subscription = true;
-
   return 0;
 }
 
@@ -707,13 +1348,42 @@ outputs_quality_unsubscribe(struct media_quality *quality)
   if (output_quality_subscriptions[i].count > 0)
     return;
 
-  transcode_encode_cleanup(&output_quality_subscriptions[i].encode_ctx);
+  // A setup that is in progress will be discarded when it is done
+  subscription_ctx_release(&output_quality_subscriptions[i]);
 
   // Shift elements
   for (; i < ARRAY_SIZE(output_quality_subscriptions) - 1; i++)
     output_quality_subscriptions[i] = output_quality_subscriptions[i + 1];
 }
 
+int
+outputs_quality_resampler_set(struct media_quality *quality, enum output_resampler resampler)
+{
+  int i;
+
+  for (i = 0; output_quality_subscriptions[i].count > 0; i++)
+    {
+      if (quality_is_equal(quality, &output_quality_subscriptions[i].quality))
+	break;
+    }
+
+  if (output_quality_subscriptions[i].count == 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Resampler request for a quality level that there is no subscription for\n");
+      return -1;
+    }
+
+  if (output_quality_subscriptions[i].resampler == resampler)
+    return 0;
+
+  // The current contexts are used until the new ones are ready
+  output_quality_subscriptions[i].resampler = resampler;
+  output_quality_subscriptions[i].setup_gen = ++outputs_setup_gen;
+  output_quality_subscriptions[i].setup_needed = true;
+
+  return 0;
+}
+
 // Output backends call back through the below wrapper to make sure that:
 // 1. Callbacks are always deferred
 // 2. The callback never has a dangling pointer to a device (a device that has been removed from our list)
@@ -1230,6 +1900,8 @@ outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *qua
 {
   int i;
 
+  outputs_slice_stats.writes++;
+
   buffer_fill(&output_buffer, buf, bufsize, quality, nsamples, pts);
 
   for (i = 0; outputs[i]; i++)
@@ -1244,6 +1916,100 @@ outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *qua
   buffer_drain(&output_buffer);
 }
 
+bool
+outputs_input_busy(void)
+{
+  return __atomic_load_n(&outputs_input_slice.refcount, __ATOMIC_ACQUIRE) > 0;
+}
+
+void
+outputs_resampler_benchmark(int seconds)
+{
+  struct media_quality qualities[] = { { 44100, 16, 2, 0 }, { 48000, 16, 2, 0 } };
+  struct pcm_convert_ctx *convert_ctx;
+  struct encode_ctx *encode_ctx;
+  struct media_quality *in;
+  struct media_quality *out;
+  struct evbuffer *evbuf;
+  struct timespec start;
+  struct timespec end;
+  enum output_resampler resampler;
+  const char *name;
+  double elapsed_ms;
+  int16_t *buf;
+  size_t bufsize;
+  int nsamples;
+  int total;
+  int done;
+  int dir;
+  int i;
+
+  // Same amount per write as the player, a 1 kHz tone is as good as anything
+  nsamples = 352;
+  bufsize = STOB(nsamples, 16, 2);
+
+  CHECK_NULL(L_PLAYER, evbuf = evbuffer_new());
+  CHECK_NULL(L_PLAYER, buf = malloc(bufsize));
+
+  for (dir = 0; dir < 2; dir++)
+    {
+      in = &qualities[dir];
+      out = &qualities[1 - dir];
+      total = seconds * in->sample_rate;
+
+      for (i = 0; i < nsamples; i++)
+	buf[2 * i] = buf[2 * i + 1] = 16000 * sin(2 * M_PI * 1000 * i / in->sample_rate);
+
+      for (resampler = OUTPUT_RESAMPLER_BALANCED; resampler <= OUTPUT_RESAMPLER_FFMPEG; resampler++)
+	{
+	  convert_ctx = NULL;
+	  encode_ctx = NULL;
+
+	  if (resampler == OUTPUT_RESAMPLER_FFMPEG)
+	    {
+	      name = "ffmpeg";
+	      encode_ctx = encode_setup(in, out);
+	    }
+	  else
+	    {
+	      name = pcm_resample_preset_name(resampler_to_preset(resampler));
+	      convert_ctx = convert_setup(in, out, resampler);
+	    }
+
+	  if (!convert_ctx && !encode_ctx)
+	    {
+	      DPRINTF(E_LOG, L_PLAYER, "Benchmark: Could not set up %s resampler\n", name);
+	      continue;
+	    }
+
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+
+	  for (done = 0; done < total; done += nsamples)
+	    {
+	      if (convert_ctx)
+		buffer_convert(evbuf, convert_ctx, buf, nsamples);
+	      else
+		encode_run(evbuf, encode_ctx, buf, bufsize, nsamples, in);
+
+	      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	    }
+
+	  clock_gettime(CLOCK_MONOTONIC, &end);
+
+	  elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+	  DPRINTF(E_LOG, L_PLAYER, "Benchmark: Resampling %d s from %d to %d with %s took %.1f ms (%.0fx realtime)\n",
+	    seconds, in->sample_rate, out->sample_rate, name, elapsed_ms, 1000.0 * seconds / MAX(elapsed_ms, 0.001));
+
+	  pcm_convert_free(convert_ctx);
+	  encode_free(&encode_ctx);
+	}
+    }
+
+  free(buf);
+  evbuffer_free(evbuf);
+}
+
 void
 outputs_metadata_send(uint32_t item_id, bool startup, output_metadata_finalize_cb cb)
 {
@@ -1293,12 +2059,19 @@ outputs_list(void)
 int
 outputs_init(void)
 {
+  pthread_condattr_t condattr;
   int no_output;
   int ret;
   int i;
 
   outputs_master_volume = -1;
 
+  // The conversion deadline must not move with the wall clock
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&outputs_convert_barrier.cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+
   CHECK_NULL(L_PLAYER, outputs_deferredev = evtimer_new(evbase_player, deferred_cb, NULL));
 
   no_output = 1;
@@ -1331,8 +2104,26 @@ outputs_init(void)
   if (no_output)
     return -1;
 
-  for (i = 0; i < ARRAY_SIZE(output_buffer.data); i++)
-    output_buffer.data[i].evbuf = evbuffer_new();
+  memset(&outputs_slice_stats, 0, sizeof(outputs_slice_stats));
+  memset(&outputs_convert_stats, 0, sizeof(outputs_convert_stats));
+
+  // Without the pool the conversions are just done by the player thread
+  outputs_convert_pool = evthr_pool_wexit_new(OUTPUTS_CONVERT_THREADS, NULL, NULL, NULL);
+  if (!outputs_convert_pool || evthr_pool_start(outputs_convert_pool) < 0)
+    {
+      DPRINTF(E_WARN, L_PLAYER, "Could not start conversion threads, will convert serially\n");
+      evthr_pool_free(outputs_convert_pool);
+      outputs_convert_pool = NULL;
+    }
+
+  // Without it the contexts are made by the player thread
+  outputs_setup_pool = evthr_pool_wexit_new(OUTPUTS_SETUP_THREADS, NULL, NULL, NULL);
+  if (!outputs_setup_pool || evthr_pool_start(outputs_setup_pool) < 0)
+    {
+      DPRINTF(E_WARN, L_PLAYER, "Could not start conversion setup thread, will set up serially\n");
+      evthr_pool_free(outputs_setup_pool);
+      outputs_setup_pool = NULL;
+    }
 
   return 0;
 }
@@ -1353,15 +2144,40 @@ outputs_deinit(void)
         outputs[i]->deinit();
     }
 
+  // Stops the workers, so late conversions are no longer using the contexts
+  if (outputs_convert_pool)
+    {
+      evthr_pool_stop(outputs_convert_pool);
+      evthr_pool_free(outputs_convert_pool);
+      outputs_convert_pool = NULL;
+    }
+
+  if (outputs_setup_pool)
+    {
+      evthr_pool_stop(outputs_setup_pool);
+      evthr_pool_free(outputs_setup_pool);
+      outputs_setup_pool = NULL;
+    }
+
   // In case some outputs forgot to unsubscribe
   for (i = 0; i < ARRAY_SIZE(output_quality_subscriptions); i++)
     if (output_quality_subscriptions[i].count > 0)
       {
-	transcode_encode_cleanup(&output_quality_subscriptions[i].encode_ctx);
+	if (output_quality_subscriptions[i].late_job)
+	  convert_job_free(output_quality_subscriptions[i].late_job);
+	encode_free(&output_quality_subscriptions[i].encode_ctx);
+	pcm_convert_free(output_quality_subscriptions[i].convert_ctx);
 	memset(&output_quality_subscriptions[i], 0, sizeof(struct output_quality_subscription));
       }
 
-  for (i = 0; i < ARRAY_SIZE(output_buffer.data); i++)
-    evbuffer_free(output_buffer.data[i].evbuf);
+  DPRINTF(E_DBG, L_PLAYER, "Output buffer stats: %" PRIu64 " writes, %" PRIu64 " slices allocated, %" PRIu64 " input copies (%" PRIu64 " bytes)\n",
+    outputs_slice_stats.writes, outputs_slice_stats.allocated, outputs_slice_stats.copies, outputs_slice_stats.copied_bytes);
+
+  DPRINTF(E_DBG, L_PLAYER, "Output conversion stats: %" PRIu64 " conversions, %" PRIu64 " by workers, %" PRIu64 " missed the deadline\n",
+    outputs_convert_stats.jobs, outputs_convert_stats.deferred, outputs_convert_stats.missed);
+
+  pthread_cond_destroy(&outputs_convert_barrier.cond);
+
+  slice_pool_free();
 }
 
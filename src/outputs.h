@@ -92,6 +92,19 @@ enum output_device_state
   OUTPUT_STATE_PASSWORD  = -2,
 };
 
+/* How quality subscriptions with a different sample rate than the source are
+ * resampled. The polyphase presets are in-tree and much cheaper than ffmpeg,
+ * but only support rates with a small ratio, e.g. 44100 <-> 48000. Otherwise
+ * ffmpeg is used anyway.
+ */
+enum output_resampler
+{
+  OUTPUT_RESAMPLER_BALANCED = 0,
+  OUTPUT_RESAMPLER_FAST     = 1,
+  OUTPUT_RESAMPLER_BEST     = 2,
+  OUTPUT_RESAMPLER_FFMPEG   = 3,
+};
+
 /* Linked list of device info used by the player for each device
  */
 struct output_device
@@ -179,10 +192,16 @@ struct output_metadata
   output_metadata_finalize_cb finalize_cb;
 };
 
+// Refcounted holder of the audio data in an output_data. The data must not be
+// modified, since the player, all the quality subscriptions and the backends
+// share it. A backend that needs the data after write() returns should use
+// outputs_buffer_copy(), which only takes references.
+struct output_slice;
+
 struct output_data
 {
   struct media_quality quality;
-  struct evbuffer *evbuf;
+  struct output_slice *slice;
   uint8_t *buffer;
   size_t bufsize;
   int samples;
@@ -290,12 +309,21 @@ outputs_quality_subscribe(struct media_quality *quality);
 void
 outputs_quality_unsubscribe(struct media_quality *quality);
 
+// Selects the resampler for an existing subscription. If subscribers ask for
+// different ones, the last one asked for is used.
+int
+outputs_quality_resampler_set(struct media_quality *quality, enum output_resampler resampler);
+
 void
 outputs_cb(int callback_id, uint64_t device_id, enum output_device_state);
 
 void
 outputs_metadata_free(struct output_metadata *metadata);
 
+// Returns a copy of the buffer that holds references to its data, so that it
+// stays valid until outputs_buffer_free(). Does not copy the audio data, except
+// the player's input data, which is copied once per write() however many
+// copies are made.
 struct output_buffer *
 outputs_buffer_copy(struct output_buffer *buffer);
 
@@ -304,6 +332,10 @@ outputs_buffer_free(struct output_buffer *buffer);
 
 /* ---------------------------- Called by player ---------------------------- */
 
+// Logs how long the resamplers take for some seconds of 44100 <-> 48000 audio
+void
+outputs_resampler_benchmark(int seconds);
+
 // Ownership of *add is transferred, so don't address after calling. Instead you
 // can address the return value (which is not the same if the device was already
 // in the list).
@@ -376,6 +408,11 @@ outputs_sessions_count(void);
 void
 outputs_write(void *buf, size_t bufsize, int nsamples, struct media_quality *quality, struct timespec *pts);
 
+// True while conversions that missed their deadline still read the input of an
+// earlier outputs_write(), so the caller must not reuse that memory yet
+bool
+outputs_input_busy(void);
+
 void
 outputs_metadata_send(uint32_t item_id, bool startup, output_metadata_finalize_cb cb);
 
@@ -12,62 +12,6 @@
  #include "artwork.h"
  #include "dmap_common.h"
 
-/* ----------- player.[c,h] -------------------------*/
-struct event_base *evbase_player;
-
-int
-player_get_status(struct player_status *status) {
-  // Dummy function to satisfy the call in cliairplay2
-  status->status = PLAY_PLAYING;
-  status->repeat = REPEAT_OFF;
-  status->shuffle = false;
-  status->consume = false;
-  status->volume = 100; // Default volume
-  return 0;
-}
-
-int
-player_device_add(void *device) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-int
-player_device_remove(void *device) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-int
-player_playback_start(void) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-int
-player_playback_pause(void) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-int
-player_playback_next(void) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-int
-player_playback_prev(void) {
-  // Dummy function to satisfy the call in cliairplay2
-  return 0;
-}
-
-const char *
-player_pmap(void *p) {
-  // Dummy function to satisfy the call in cliairplay2
-  return "dummy_player";
-}
-
 /* -------------- db.h -------------------------*/
 int
 db_speaker_get(struct output_device *device, uint64_t id) {
@@ -0,0 +1,695 @@
+/*
+ * Sample format and channel conversion of interleaved PCM, for the output
+ * quality subscriptions that have the same sample rate as the source, so they
+ * don't need a full ffmpeg decode/filter/encode context.
+ *
+ * Samples are converted to left-justified int32 and back, in blocks that fit in
+ * the cache. The hot kernels have SSE2, AVX2 and NEON versions, selected at
+ * runtime (AVX2) or build time (SSE2, NEON), with a scalar fallback. Packed
+ * 24 bit only has scalar versions.
+ *
+ * If the sample rates differ, pcm_resample runs between the downmix and the
+ * upmix, so it never processes more channels than needed.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define PCM_HAVE_AVX2
+#endif
+
+#include "logger.h"
+#include "misc.h"
+#include "pcm_convert.h"
+
+// Samples per channel converted in one go, so the intermediate stays in L1
+#define PCM_CONVERT_BLOCK 512
+
+// Largest float below 2^31, so scaled 1.0 doesn't overflow when truncated
+#define PCM_F32_MAX 2147483520.0f
+
+struct pcm_convert_ctx
+{
+  enum pcm_format in_format;
+  int in_channels;
+  enum pcm_format out_format;
+  int out_channels;
+
+  // Only if the sample rates differ
+  struct pcm_resample *resample;
+  int32_t *resampled;
+  int32_t *upmixed;
+};
+
+struct pcm_kernels
+{
+  const char *name;
+  void (*s16_to_s32)(int32_t *dst, const int16_t *src, size_t n);
+  void (*s32_to_s16)(int16_t *dst, const int32_t *src, size_t n);
+  void (*f32_to_s32)(int32_t *dst, const float *src, size_t n);
+  void (*stereo_to_mono)(int32_t *dst, const int32_t *src, size_t nsamples);
+  void (*mono_to_stereo)(int32_t *dst, const int32_t *src, size_t nsamples);
+};
+
+static const struct pcm_kernels *pcm_kernels;
+static pthread_once_t pcm_kernels_once = PTHREAD_ONCE_INIT;
+
+
+/* ---------------------------------- Scalar -------------------------------- */
+
+static void
+scalar_s16_to_s32(int32_t *dst, const int16_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (int32_t)((uint32_t)(uint16_t)src[i] << 16);
+}
+
+static void
+scalar_s32_to_s16(int16_t *dst, const int32_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = src[i] >> 16;
+}
+
+static void
+scalar_f32_to_s32(int32_t *dst, const float *src, size_t n)
+{
+  float v;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    {
+      v = src[i] * 2147483648.0f;
+      if (v > PCM_F32_MAX)
+	v = PCM_F32_MAX;
+      else if (v < -2147483648.0f)
+	v = -2147483648.0f;
+      dst[i] = (int32_t)v;
+    }
+}
+
+static void
+scalar_stereo_to_mono(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  size_t i;
+
+  for (i = 0; i < nsamples; i++)
+    dst[i] = (src[2 * i] >> 1) + (src[2 * i + 1] >> 1);
+}
+
+static void
+scalar_mono_to_stereo(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  size_t i;
+
+  for (i = 0; i < nsamples; i++)
+    {
+      dst[2 * i] = src[i];
+      dst[2 * i + 1] = src[i];
+    }
+}
+
+static void
+s24_to_s32(int32_t *dst, const uint8_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, src += 3)
+    dst[i] = (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 24);
+}
+
+static void
+s32_to_s24(uint8_t *dst, const int32_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++, dst += 3)
+    {
+      dst[0] = (uint32_t)src[i] >> 8;
+      dst[1] = (uint32_t)src[i] >> 16;
+      dst[2] = (uint32_t)src[i] >> 24;
+    }
+}
+
+static const struct pcm_kernels pcm_kernels_scalar =
+{
+  .name = "scalar",
+  .s16_to_s32 = scalar_s16_to_s32,
+  .s32_to_s16 = scalar_s32_to_s16,
+  .f32_to_s32 = scalar_f32_to_s32,
+  .stereo_to_mono = scalar_stereo_to_mono,
+  .mono_to_stereo = scalar_mono_to_stereo,
+};
+
+
+/* ----------------------------------- SSE2 --------------------------------- */
+
+#if defined(__SSE2__)
+static void
+sse2_s16_to_s32(int32_t *dst, const int16_t *src, size_t n)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i v;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(zero, v));
+      _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(zero, v));
+    }
+
+  scalar_s16_to_s32(dst + i, src + i, n - i);
+}
+
+static void
+sse2_s32_to_s16(int16_t *dst, const int32_t *src, size_t n)
+{
+  __m128i a;
+  __m128i b;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i)), 16);
+      b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i + 4)), 16);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+
+  scalar_s32_to_s16(dst + i, src + i, n - i);
+}
+
+static void
+sse2_f32_to_s32(int32_t *dst, const float *src, size_t n)
+{
+  __m128 scale = _mm_set1_ps(2147483648.0f);
+  __m128 max = _mm_set1_ps(PCM_F32_MAX);
+  __m128 min = _mm_set1_ps(-2147483648.0f);
+  __m128 v;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      v = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+      v = _mm_max_ps(_mm_min_ps(v, max), min);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_cvttps_epi32(v));
+    }
+
+  scalar_f32_to_s32(dst + i, src + i, n - i);
+}
+
+static void
+sse2_stereo_to_mono(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  __m128 a;
+  __m128 b;
+  __m128i l;
+  __m128i r;
+  size_t i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4)
+    {
+      a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src + 2 * i)));
+      b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src + 2 * i + 4)));
+      l = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      r = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(_mm_srai_epi32(l, 1), _mm_srai_epi32(r, 1)));
+    }
+
+  scalar_stereo_to_mono(dst + i, src + 2 * i, nsamples - i);
+}
+
+static void
+sse2_mono_to_stereo(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  __m128i v;
+  size_t i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4)
+    {
+      v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(v, v));
+    }
+
+  scalar_mono_to_stereo(dst + 2 * i, src + i, nsamples - i);
+}
+
+static const struct pcm_kernels pcm_kernels_sse2 =
+{
+  .name = "sse2",
+  .s16_to_s32 = sse2_s16_to_s32,
+  .s32_to_s16 = sse2_s32_to_s16,
+  .f32_to_s32 = sse2_f32_to_s32,
+  .stereo_to_mono = sse2_stereo_to_mono,
+  .mono_to_stereo = sse2_mono_to_stereo,
+};
+#endif
+
+
+/* ----------------------------------- AVX2 --------------------------------- */
+
+#ifdef PCM_HAVE_AVX2
+__attribute__((target("avx2"))) static void
+avx2_s16_to_s32(int32_t *dst, const int16_t *src, size_t n)
+{
+  __m256i v;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi32(v, 16));
+    }
+
+  scalar_s16_to_s32(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_s32_to_s16(int16_t *dst, const int32_t *src, size_t n)
+{
+  __m256i a;
+  __m256i b;
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i)), 16);
+      b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), 16);
+      // packs works per 128 bit lane, so the 64 bit quarters need reordering
+      a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+      _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+
+  scalar_s32_to_s16(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_f32_to_s32(int32_t *dst, const float *src, size_t n)
+{
+  __m256 scale = _mm256_set1_ps(2147483648.0f);
+  __m256 max = _mm256_set1_ps(PCM_F32_MAX);
+  __m256 min = _mm256_set1_ps(-2147483648.0f);
+  __m256 v;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+      v = _mm256_max_ps(_mm256_min_ps(v, max), min);
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvttps_epi32(v));
+    }
+
+  scalar_f32_to_s32(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_stereo_to_mono(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  __m256 a;
+  __m256 b;
+  __m256i l;
+  __m256i r;
+  __m256i v;
+  size_t i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8)
+    {
+      a = _mm256_loadu_ps((const float *)(src + 2 * i));
+      b = _mm256_loadu_ps((const float *)(src + 2 * i + 8));
+      l = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      r = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      v = _mm256_add_epi32(_mm256_srai_epi32(l, 1), _mm256_srai_epi32(r, 1));
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+  scalar_stereo_to_mono(dst + i, src + 2 * i, nsamples - i);
+}
+
+__attribute__((target("avx2"))) static void
+avx2_mono_to_stereo(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  __m256i v;
+  __m256i lo;
+  __m256i hi;
+  size_t i;
+
+  for (i = 0; i + 8 <= nsamples; i += 8)
+    {
+      v = _mm256_loadu_si256((const __m256i *)(src + i));
+      lo = _mm256_unpacklo_epi32(v, v);
+      hi = _mm256_unpackhi_epi32(v, v);
+      _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+      _mm256_storeu_si256((__m256i *)(dst + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+  scalar_mono_to_stereo(dst + 2 * i, src + i, nsamples - i);
+}
+
+static const struct pcm_kernels pcm_kernels_avx2 =
+{
+  .name = "avx2",
+  .s16_to_s32 = avx2_s16_to_s32,
+  .s32_to_s16 = avx2_s32_to_s16,
+  .f32_to_s32 = avx2_f32_to_s32,
+  .stereo_to_mono = avx2_stereo_to_mono,
+  .mono_to_stereo = avx2_mono_to_stereo,
+};
+#endif
+
+
+/* ----------------------------------- NEON --------------------------------- */
+
+#if defined(__ARM_NEON)
+static void
+neon_s16_to_s32(int32_t *dst, const int16_t *src, size_t n)
+{
+  int16x8_t v;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = vld1q_s16(src + i);
+      vst1q_s32(dst + i, vshll_n_s16(vget_low_s16(v), 16));
+      vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+    }
+
+  scalar_s16_to_s32(dst + i, src + i, n - i);
+}
+
+static void
+neon_s32_to_s16(int16_t *dst, const int32_t *src, size_t n)
+{
+  int16x4_t a;
+  int16x4_t b;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = vshrn_n_s32(vld1q_s32(src + i), 16);
+      b = vshrn_n_s32(vld1q_s32(src + i + 4), 16);
+      vst1q_s16(dst + i, vcombine_s16(a, b));
+    }
+
+  scalar_s32_to_s16(dst + i, src + i, n - i);
+}
+
+static void
+neon_f32_to_s32(int32_t *dst, const float *src, size_t n)
+{
+  float32x4_t max = vdupq_n_f32(PCM_F32_MAX);
+  size_t i;
+
+  // vcvtq saturates at the bottom, but at the top it would give INT32_MAX, not
+  // PCM_F32_MAX like the other kernels
+  for (i = 0; i + 4 <= n; i += 4)
+    vst1q_s32(dst + i, vcvtq_s32_f32(vminq_f32(vmulq_n_f32(vld1q_f32(src + i), 2147483648.0f), max)));
+
+  scalar_f32_to_s32(dst + i, src + i, n - i);
+}
+
+static void
+neon_stereo_to_mono(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  int32x4x2_t v;
+  size_t i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4)
+    {
+      v = vld2q_s32(src + 2 * i);
+      vst1q_s32(dst + i, vaddq_s32(vshrq_n_s32(v.val[0], 1), vshrq_n_s32(v.val[1], 1)));
+    }
+
+  scalar_stereo_to_mono(dst + i, src + 2 * i, nsamples - i);
+}
+
+static void
+neon_mono_to_stereo(int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  int32x4x2_t v;
+  size_t i;
+
+  for (i = 0; i + 4 <= nsamples; i += 4)
+    {
+      v.val[0] = vld1q_s32(src + i);
+      v.val[1] = v.val[0];
+      vst2q_s32(dst + 2 * i, v);
+    }
+
+  scalar_mono_to_stereo(dst + 2 * i, src + i, nsamples - i);
+}
+
+static const struct pcm_kernels pcm_kernels_neon =
+{
+  .name = "neon",
+  .s16_to_s32 = neon_s16_to_s32,
+  .s32_to_s16 = neon_s32_to_s16,
+  .f32_to_s32 = neon_f32_to_s32,
+  .stereo_to_mono = neon_stereo_to_mono,
+  .mono_to_stereo = neon_mono_to_stereo,
+};
+#endif
+
+
+/* ---------------------------------- Helpers ------------------------------- */
+
+static void
+kernels_select(void)
+{
+  pcm_kernels = &pcm_kernels_scalar;
+
+#if defined(__SSE2__)
+  pcm_kernels = &pcm_kernels_sse2;
+#elif defined(__ARM_NEON)
+  pcm_kernels = &pcm_kernels_neon;
+#endif
+
+#ifdef PCM_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    pcm_kernels = &pcm_kernels_avx2;
+#endif
+
+  DPRINTF(E_DBG, L_PLAYER, "Using %s kernels for PCM conversion\n", pcm_kernels->name);
+}
+
+// Returns a pointer to n samples in left-justified int32, either src itself or
+// tmp with the converted samples
+static const int32_t *
+samples_load(int32_t *tmp, const uint8_t *src, enum pcm_format format, size_t n)
+{
+  switch (format)
+    {
+      case PCM_FORMAT_S16:
+	pcm_kernels->s16_to_s32(tmp, (const int16_t *)src, n);
+	return tmp;
+      case PCM_FORMAT_S24:
+	s24_to_s32(tmp, src, n);
+	return tmp;
+      case PCM_FORMAT_S32:
+	return (const int32_t *)src;
+      case PCM_FORMAT_F32:
+	pcm_kernels->f32_to_s32(tmp, (const float *)src, n);
+	return tmp;
+      default:
+	return NULL;
+    }
+}
+
+static void
+samples_store(uint8_t *dst, const int32_t *src, enum pcm_format format, size_t n)
+{
+  switch (format)
+    {
+      case PCM_FORMAT_S16:
+	pcm_kernels->s32_to_s16((int16_t *)dst, src, n);
+	break;
+      case PCM_FORMAT_S24:
+	s32_to_s24(dst, src, n);
+	break;
+      case PCM_FORMAT_S32:
+	if ((const uint8_t *)src != dst)
+	  memcpy(dst, src, n * sizeof(int32_t));
+	break;
+      default:
+	break;
+    }
+}
+
+
+/* ----------------------------------- API ---------------------------------- */
+
+enum pcm_format
+pcm_format_from_bits(int bits_per_sample)
+{
+  if (bits_per_sample == 16)
+    return PCM_FORMAT_S16;
+  if (bits_per_sample == 24)
+    return PCM_FORMAT_S24;
+  if (bits_per_sample == 32)
+    return PCM_FORMAT_S32;
+
+  return PCM_FORMAT_UNKNOWN;
+}
+
+int
+pcm_format_bytes(enum pcm_format format)
+{
+  switch (format)
+    {
+      case PCM_FORMAT_S16:
+	return 2;
+      case PCM_FORMAT_S24:
+	return 3;
+      case PCM_FORMAT_S32:
+      case PCM_FORMAT_F32:
+	return 4;
+      default:
+	return 0;
+    }
+}
+
+struct pcm_convert_ctx *
+pcm_convert_setup(enum pcm_format in_format, int in_channels, int in_rate,
+                  enum pcm_format out_format, int out_channels, int out_rate,
+                  enum pcm_resample_preset preset)
+{
+  struct pcm_convert_ctx *ctx;
+  size_t out_max;
+
+  if (in_format == PCM_FORMAT_UNKNOWN || out_format == PCM_FORMAT_UNKNOWN || out_format == PCM_FORMAT_F32)
+    return NULL;
+  if (in_channels < 1 || in_channels > 2 || out_channels < 1 || out_channels > 2)
+    return NULL;
+
+  pthread_once(&pcm_kernels_once, kernels_select);
+
+  CHECK_NULL(L_PLAYER, ctx = calloc(1, sizeof(struct pcm_convert_ctx)));
+
+  ctx->in_format = in_format;
+  ctx->in_channels = in_channels;
+  ctx->out_format = out_format;
+  ctx->out_channels = out_channels;
+
+  if (in_rate == out_rate)
+    return ctx;
+
+  ctx->resample = pcm_resample_new(in_rate, out_rate, MIN(in_channels, out_channels), preset);
+  if (!ctx->resample)
+    {
+      free(ctx);
+      return NULL;
+    }
+
+  out_max = pcm_resample_out_max(ctx->resample, PCM_CONVERT_BLOCK);
+  CHECK_NULL(L_PLAYER, ctx->resampled = malloc(out_max * MIN(in_channels, out_channels) * sizeof(int32_t)));
+  CHECK_NULL(L_PLAYER, ctx->upmixed = malloc(out_max * out_channels * sizeof(int32_t)));
+
+  return ctx;
+}
+
+void
+pcm_convert_free(struct pcm_convert_ctx *ctx)
+{
+  if (!ctx)
+    return;
+
+  pcm_resample_free(ctx->resample);
+  free(ctx->resampled);
+  free(ctx->upmixed);
+  free(ctx);
+}
+
+size_t
+pcm_convert_out_max(struct pcm_convert_ctx *ctx, int nsamples)
+{
+  size_t out_stride;
+  size_t blocks;
+
+  out_stride = pcm_format_bytes(ctx->out_format) * ctx->out_channels;
+  if (!ctx->resample)
+    return nsamples * out_stride;
+
+  // The input is resampled in blocks, each might give one more sample
+  blocks = (nsamples + PCM_CONVERT_BLOCK - 1) / PCM_CONVERT_BLOCK;
+
+  return (pcm_resample_out_max(ctx->resample, nsamples) + blocks) * out_stride;
+}
+
+size_t
+pcm_convert(struct pcm_convert_ctx *ctx, uint8_t *dst, const uint8_t *src, int nsamples)
+{
+  int32_t in[PCM_CONVERT_BLOCK * 2];
+  int32_t mixed[PCM_CONVERT_BLOCK * 2];
+  const int32_t *samples;
+  uint8_t *out;
+  size_t in_stride;
+  size_t out_stride;
+  size_t n;
+  size_t nout;
+  size_t i;
+
+  in_stride = pcm_format_bytes(ctx->in_format) * ctx->in_channels;
+  out_stride = pcm_format_bytes(ctx->out_format) * ctx->out_channels;
+
+  for (i = 0, out = dst; i < (size_t)nsamples; i += n)
+    {
+      n = MIN(PCM_CONVERT_BLOCK, nsamples - i);
+
+      // Straight into dst if that is where the int32 samples should end up
+      if (ctx->out_format == PCM_FORMAT_S32 && ctx->in_channels == ctx->out_channels && !ctx->resample)
+	samples = samples_load((int32_t *)out, src + i * in_stride, ctx->in_format, n * ctx->in_channels);
+      else
+	samples = samples_load(in, src + i * in_stride, ctx->in_format, n * ctx->in_channels);
+
+      if (ctx->in_channels == 2 && ctx->out_channels == 1)
+	{
+	  pcm_kernels->stereo_to_mono(mixed, samples, n);
+	  samples = mixed;
+	}
+
+      nout = n;
+      if (ctx->resample)
+	{
+	  nout = pcm_resample_process(ctx->resample, ctx->resampled, samples, n);
+	  samples = ctx->resampled;
+	}
+
+      if (ctx->in_channels == 1 && ctx->out_channels == 2)
+	{
+	  pcm_kernels->mono_to_stereo(ctx->resample ? ctx->upmixed : mixed, samples, nout);
+	  samples = ctx->resample ? ctx->upmixed : mixed;
+	}
+
+      samples_store(out, samples, ctx->out_format, nout * ctx->out_channels);
+      out += nout * out_stride;
+    }
+
+  return out - dst;
+}
+
+const char *
+pcm_convert_kernels_name(void)
+{
+  pthread_once(&pcm_kernels_once, kernels_select);
+
+  return pcm_kernels->name;
+}
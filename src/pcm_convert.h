@@ -0,0 +1,51 @@
+#ifndef __PCM_CONVERT_H__
+#define __PCM_CONVERT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcm_resample.h"
+
+// Interleaved native endian PCM
+enum pcm_format
+{
+  PCM_FORMAT_UNKNOWN,
+  PCM_FORMAT_S16,
+  PCM_FORMAT_S24, // Packed, 3 bytes per sample
+  PCM_FORMAT_S32,
+  PCM_FORMAT_F32, // Only as input
+};
+
+struct pcm_convert_ctx;
+
+enum pcm_format
+pcm_format_from_bits(int bits_per_sample);
+
+int
+pcm_format_bytes(enum pcm_format format);
+
+// Returns NULL if the conversion isn't supported, i.e. if the output is float,
+// if the channels are other than the same or mono <-> stereo, or if the sample
+// rates differ and pcm_resample doesn't support the ratio.
+struct pcm_convert_ctx *
+pcm_convert_setup(enum pcm_format in_format, int in_channels, int in_rate,
+                  enum pcm_format out_format, int out_channels, int out_rate,
+                  enum pcm_resample_preset preset);
+
+void
+pcm_convert_free(struct pcm_convert_ctx *ctx);
+
+// Max number of bytes pcm_convert() will write for nsamples input samples
+size_t
+pcm_convert_out_max(struct pcm_convert_ctx *ctx, int nsamples);
+
+// Converts nsamples samples (per channel) from src to dst, which must not
+// overlap. Returns the number of bytes written to dst.
+size_t
+pcm_convert(struct pcm_convert_ctx *ctx, uint8_t *dst, const uint8_t *src, int nsamples);
+
+// Name of the kernels selected for this CPU, e.g. "avx2"
+const char *
+pcm_convert_kernels_name(void);
+
+#endif  /* !__PCM_CONVERT_H__ */
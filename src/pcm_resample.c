@@ -0,0 +1,389 @@
+/*
+ * Polyphase resampler for output quality subscriptions, mainly for 44100 <->
+ * 48000 (147:160), so the common case doesn't need libavfilter.
+ *
+ * The filter is a Kaiser windowed sinc, split into one set of coefficients per
+ * output phase. The tables are computed the first time a ratio/preset is used
+ * and then kept, so creating a resampler for a new subscription is cheap. The
+ * coefficients of each phase are stored in the order they are applied to the
+ * (planar) history, so the inner loop is a plain dot product, which has SSE
+ * and NEON versions.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__SSE__)
+# include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+#include "logger.h"
+#include "misc.h"
+#include "pcm_resample.h"
+
+// Max up/down factor after reducing the ratio, limits the size of the tables
+#define PCM_RESAMPLE_FACTOR_MAX 160
+
+// Input samples (per channel) processed in one go
+#define PCM_RESAMPLE_CHUNK 512
+
+// Largest float below 2^31, so scaled 1.0 doesn't overflow when truncated
+#define PCM_RESAMPLE_F32_MAX 2147483520.0f
+
+struct pcm_resample_design
+{
+  const char *name;
+  int taps;     // Per phase, must be a multiple of 8
+  double cutoff; // Relative to the Nyquist frequency of the lower rate
+  double beta;   // Kaiser window
+};
+
+struct pcm_resample_table
+{
+  int up;
+  int down;
+  enum pcm_resample_preset preset;
+
+  int taps;
+  float *coefs; // up phases of taps coefficients
+
+  struct pcm_resample_table *next;
+};
+
+struct pcm_resample
+{
+  struct pcm_resample_table *table;
+  int channels;
+
+  // Planar history per channel, taps - 1 old samples plus the chunk
+  float *hist[8];
+  size_t len;
+
+  // Position of the newest input sample for the next output, and its phase
+  size_t pos;
+  int phase;
+};
+
+static const struct pcm_resample_design pcm_resample_designs[] =
+{
+  [PCM_RESAMPLE_FAST]     = { "fast",     16, 0.85, 6.0 },
+  [PCM_RESAMPLE_BALANCED] = { "balanced", 32, 0.92, 8.0 },
+  [PCM_RESAMPLE_BEST]     = { "best",     64, 0.96, 10.0 },
+};
+
+// Tables are shared by all resamplers and never freed
+static struct pcm_resample_table *pcm_resample_tables;
+static pthread_mutex_t pcm_resample_tables_lck = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ------------------------------ Filter design ----------------------------- */
+
+static int
+gcd(int a, int b)
+{
+  int t;
+
+  while (b)
+    {
+      t = a % b;
+      a = b;
+      b = t;
+    }
+
+  return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double
+bessel_i0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  int k;
+
+  for (k = 1; k < 100 && term > 1e-12 * sum; k++)
+    {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+    }
+
+  return sum;
+}
+
+static struct pcm_resample_table *
+table_make(int up, int down, enum pcm_resample_preset preset)
+{
+  const struct pcm_resample_design *design = &pcm_resample_designs[preset];
+  struct pcm_resample_table *table;
+  double *proto;
+  double center;
+  double fc;
+  double x;
+  double sum;
+  int len;
+  int p;
+  int j;
+  int n;
+
+  CHECK_NULL(L_PLAYER, table = calloc(1, sizeof(struct pcm_resample_table)));
+
+  table->up = up;
+  table->down = down;
+  table->preset = preset;
+  table->taps = design->taps;
+
+  // Prototype lowpass at the upsampled rate
+  len = design->taps * up;
+  center = (len - 1) / 2.0;
+  fc = design->cutoff * 0.5 / MAX(up, down);
+
+  CHECK_NULL(L_PLAYER, proto = malloc(len * sizeof(double)));
+  for (n = 0; n < len; n++)
+    {
+      x = 2.0 * fc * (n - center);
+      proto[n] = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+      x = 2.0 * n / (len - 1) - 1.0;
+      proto[n] *= bessel_i0(design->beta * sqrt(MAX(0.0, 1.0 - x * x))) / bessel_i0(design->beta);
+    }
+
+  // Phase p has every up'th coefficient from p, reversed so they line up with
+  // the history from oldest to newest. Each phase is normalized to unity gain.
+  CHECK_NULL(L_PLAYER, table->coefs = malloc(up * design->taps * sizeof(float)));
+  for (p = 0; p < up; p++)
+    {
+      for (j = 0, sum = 0.0; j < design->taps; j++)
+	sum += proto[p + j * up];
+
+      for (j = 0; j < design->taps; j++)
+	table->coefs[p * design->taps + j] = proto[p + (design->taps - 1 - j) * up] / sum;
+    }
+
+  free(proto);
+
+  DPRINTF(E_DBG, L_PLAYER, "Made %s resampler table for ratio %d:%d (%d phases, %d taps)\n", design->name, up, down, up, design->taps);
+
+  return table;
+}
+
+static struct pcm_resample_table *
+table_get(int up, int down, enum pcm_resample_preset preset)
+{
+  struct pcm_resample_table *table;
+
+  pthread_mutex_lock(&pcm_resample_tables_lck);
+
+  for (table = pcm_resample_tables; table; table = table->next)
+    {
+      if (table->up == up && table->down == down && table->preset == preset)
+	break;
+    }
+
+  if (!table)
+    {
+      table = table_make(up, down, preset);
+      table->next = pcm_resample_tables;
+      pcm_resample_tables = table;
+    }
+
+  pthread_mutex_unlock(&pcm_resample_tables_lck);
+
+  return table;
+}
+
+
+/* -------------------------------- Filtering ------------------------------- */
+
+static inline float
+dot(const float *c, const float *x, int taps)
+{
+  int i;
+#if defined(__SSE__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+
+  for (i = 0; i < taps; i += 8)
+    {
+      acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(c + i), _mm_loadu_ps(x + i)));
+      acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(c + i + 4), _mm_loadu_ps(x + i + 4)));
+    }
+
+  acc0 = _mm_add_ps(acc0, acc1);
+  acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+  acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+
+  return _mm_cvtss_f32(acc0);
+#elif defined(__ARM_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  float32x2_t sum;
+
+  for (i = 0; i < taps; i += 8)
+    {
+      acc0 = vmlaq_f32(acc0, vld1q_f32(c + i), vld1q_f32(x + i));
+      acc1 = vmlaq_f32(acc1, vld1q_f32(c + i + 4), vld1q_f32(x + i + 4));
+    }
+
+  acc0 = vaddq_f32(acc0, acc1);
+  sum = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+
+  return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#else
+  float acc = 0.0f;
+
+  for (i = 0; i < taps; i++)
+    acc += c[i] * x[i];
+
+  return acc;
+#endif
+}
+
+static inline int32_t
+float_to_s32(float v)
+{
+  v *= 2147483648.0f;
+  if (v > PCM_RESAMPLE_F32_MAX)
+    return (int32_t)PCM_RESAMPLE_F32_MAX;
+  if (v < -2147483648.0f)
+    return INT32_MIN;
+
+  return (int32_t)v;
+}
+
+static size_t
+chunk_process(struct pcm_resample *rs, int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  struct pcm_resample_table *table = rs->table;
+  const float *coefs;
+  size_t out;
+  size_t drop;
+  size_t i;
+  int c;
+
+  for (c = 0; c < rs->channels; c++)
+    {
+      for (i = 0; i < nsamples; i++)
+	rs->hist[c][rs->len + i] = src[i * rs->channels + c] * (1.0f / 2147483648.0f);
+    }
+
+  rs->len += nsamples;
+
+  for (out = 0; rs->pos < rs->len; out++)
+    {
+      coefs = table->coefs + rs->phase * table->taps;
+      for (c = 0; c < rs->channels; c++)
+	dst[out * rs->channels + c] = float_to_s32(dot(coefs, rs->hist[c] + rs->pos + 1 - table->taps, table->taps));
+
+      rs->phase += table->down;
+      rs->pos += rs->phase / table->up;
+      rs->phase %= table->up;
+    }
+
+  // Keep what the next outputs need
+  drop = rs->len - (table->taps - 1);
+  for (c = 0; c < rs->channels; c++)
+    memmove(rs->hist[c], rs->hist[c] + drop, (table->taps - 1) * sizeof(float));
+
+  rs->len -= drop;
+  rs->pos -= drop;
+
+  return out;
+}
+
+
+/* ----------------------------------- API ---------------------------------- */
+
+bool
+pcm_resample_is_supported(int in_rate, int out_rate)
+{
+  int div;
+
+  if (in_rate <= 0 || out_rate <= 0 || in_rate == out_rate)
+    return false;
+
+  div = gcd(in_rate, out_rate);
+
+  return (out_rate / div <= PCM_RESAMPLE_FACTOR_MAX && in_rate / div <= PCM_RESAMPLE_FACTOR_MAX);
+}
+
+struct pcm_resample *
+pcm_resample_new(int in_rate, int out_rate, int channels, enum pcm_resample_preset preset)
+{
+  struct pcm_resample *rs;
+  int div;
+  int c;
+
+  if (!pcm_resample_is_supported(in_rate, out_rate) || channels < 1 || channels > ARRAY_SIZE(rs->hist))
+    return NULL;
+  if (preset < 0 || preset >= ARRAY_SIZE(pcm_resample_designs))
+    return NULL;
+
+  div = gcd(in_rate, out_rate);
+
+  CHECK_NULL(L_PLAYER, rs = calloc(1, sizeof(struct pcm_resample)));
+
+  rs->table = table_get(out_rate / div, in_rate / div, preset);
+  rs->channels = channels;
+
+  // Starts with silence as history, so the output is delayed by taps / 2
+  for (c = 0; c < channels; c++)
+    CHECK_NULL(L_PLAYER, rs->hist[c] = calloc(rs->table->taps - 1 + PCM_RESAMPLE_CHUNK, sizeof(float)));
+
+  rs->len = rs->table->taps - 1;
+  rs->pos = rs->len;
+
+  return rs;
+}
+
+void
+pcm_resample_free(struct pcm_resample *rs)
+{
+  int c;
+
+  if (!rs)
+    return;
+
+  for (c = 0; c < rs->channels; c++)
+    free(rs->hist[c]);
+
+  free(rs);
+}
+
+size_t
+pcm_resample_out_max(struct pcm_resample *rs, size_t nsamples)
+{
+  return nsamples * rs->table->up / rs->table->down + 2;
+}
+
+size_t
+pcm_resample_process(struct pcm_resample *rs, int32_t *dst, const int32_t *src, size_t nsamples)
+{
+  size_t out;
+  size_t n;
+  size_t i;
+
+  for (i = 0, out = 0; i < nsamples; i += n)
+    {
+      n = MIN(PCM_RESAMPLE_CHUNK, nsamples - i);
+      out += chunk_process(rs, dst + out * rs->channels, src + i * rs->channels, n);
+    }
+
+  return out;
+}
+
+const char *
+pcm_resample_preset_name(enum pcm_resample_preset preset)
+{
+  if (preset < 0 || preset >= ARRAY_SIZE(pcm_resample_designs))
+    return "unknown";
+
+  return pcm_resample_designs[preset].name;
+}
@@ -0,0 +1,42 @@
+#ifndef __PCM_RESAMPLE_H__
+#define __PCM_RESAMPLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longer filters have a steeper cutoff and less aliasing, at the cost of CPU
+// and latency (taps / 2 input samples)
+enum pcm_resample_preset
+{
+  PCM_RESAMPLE_FAST,     // 16 taps per phase
+  PCM_RESAMPLE_BALANCED, // 32 taps per phase
+  PCM_RESAMPLE_BEST,     // 64 taps per phase
+};
+
+struct pcm_resample;
+
+// True for rates with a small ratio, e.g. 44100 <-> 48000 (147:160)
+bool
+pcm_resample_is_supported(int in_rate, int out_rate);
+
+struct pcm_resample *
+pcm_resample_new(int in_rate, int out_rate, int channels, enum pcm_resample_preset preset);
+
+void
+pcm_resample_free(struct pcm_resample *rs);
+
+// Max number of samples (per channel) that pcm_resample_process() will output
+// for nsamples input samples
+size_t
+pcm_resample_out_max(struct pcm_resample *rs, size_t nsamples);
+
+// Input and output is interleaved left-justified int32. Returns the number of
+// samples (per channel) written to dst.
+size_t
+pcm_resample_process(struct pcm_resample *rs, int32_t *dst, const int32_t *src, size_t nsamples);
+
+const char *
+pcm_resample_preset_name(enum pcm_resample_preset preset);
+
+#endif  /* !__PCM_RESAMPLE_H__ */
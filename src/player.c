@@ -0,0 +1,596 @@
+/*
+ * Player for cliairplay2, a much reduced version of the owntones player. There
+ * is no queue or input modules, instead audio is taken from a PCM ring that the
+ * application fills. The player drives evbase_player (which the outputs run
+ * on) and paces the writes to the outputs with a monotonic timer.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef HAVE_TIMERFD
+# include <sys/timerfd.h>
+#else
+# include <signal.h>
+#endif
+
+#include <event2/event.h>
+
+#include "logger.h"
+#include "conffile.h"
+#include "misc.h"
+#include "outputs.h"
+#include "player.h"
+
+// Default interval between ticks in milliseconds. Each tick we write this much
+// audio to the outputs.
+#define PLAYER_TICK_INTERVAL 10
+// If the timer is delayed (e.g. by a suspend) we catch up by writing extra
+// ticks, but no more than this many ms
+#define PLAYER_WRITE_BEHIND_MAX 1500
+
+struct event_base *evbase_player;
+
+static pthread_t tid_player;
+
+// Protects the playback state below, which may be changed from other threads
+static pthread_mutex_t player_lock;
+
+static enum play_status player_state;
+
+// Playback timer
+#ifdef HAVE_TIMERFD
+static int pb_timer_fd;
+#else
+static timer_t pb_timer;
+#endif
+static struct event *pb_timer_ev;
+static struct timespec player_timer_res;
+static struct timespec player_tick_interval;
+static int pb_write_deficit_max;
+
+// Input, set by the application
+static struct spsc_ringbuffer *pb_input;
+static struct media_quality pb_quality;
+static size_t pb_frame_size;
+static uint8_t *pb_silence;
+static size_t pb_silence_len;
+// The application's watermark callback. The ring makes the low watermark
+// callback from read_commit(), which we do holding player_lock, so it is
+// deferred until the lock is released (see input_watermark_cb).
+static spsc_ringbuffer_watermark_cb pb_input_watermark_cb;
+static void *pb_input_watermark_arg;
+static bool pb_input_low;
+// Input that was written to the outputs but not released to the producer yet,
+// because conversions that missed their deadline still read it
+static size_t pb_input_held;
+
+// The playback clock. Sample pos has pts pb_start + (pos - pb_start_pos) /
+// sample_rate, so the timestamps don't drift no matter how the ticks are spread.
+static struct timespec pb_start;
+static uint64_t pb_start_pos;
+static uint64_t pb_pos;
+// Remainder (in ns * sample_rate) of the samples per tick calculation
+static uint64_t pb_tick_rem;
+
+static bool pb_underrun;
+static uint64_t pb_underrun_count;
+static uint64_t pb_underrun_samples;
+
+
+/* ------------------------------ Playback clock ---------------------------- */
+
+static struct timespec
+pos_to_pts(uint64_t pos)
+{
+  struct timespec ts;
+
+  pos -= pb_start_pos;
+
+  // Split to avoid overflowing pos * 1000000000
+  ts.tv_sec = pos / pb_quality.sample_rate;
+  ts.tv_nsec = (pos % pb_quality.sample_rate) * 1000000000 / pb_quality.sample_rate;
+
+  return timespec_add(pb_start, ts);
+}
+
+// Number of samples in the next tick. With e.g. 44100 Hz and a 10 ms tick that
+// is always 441, but for other combinations the fractions must add up.
+static int
+tick_samples(void)
+{
+  uint64_t total;
+
+  total = (uint64_t)player_tick_interval.tv_nsec * pb_quality.sample_rate + pb_tick_rem;
+  pb_tick_rem = total % 1000000000;
+
+  return total / 1000000000;
+}
+
+static int
+pb_timer_start(void)
+{
+  struct itimerspec tick;
+  int ret;
+
+  tick.it_interval = player_tick_interval;
+  tick.it_value = player_tick_interval;
+
+#ifdef HAVE_TIMERFD
+  ret = timerfd_settime(pb_timer_fd, 0, &tick, NULL);
+#else
+  ret = timer_settime(pb_timer, 0, &tick, NULL);
+#endif
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not arm playback timer: %s\n", strerror(errno));
+      return -1;
+    }
+
+  event_add(pb_timer_ev, NULL);
+  return 0;
+}
+
+static int
+pb_timer_stop(void)
+{
+  struct itimerspec tick = { { 0 } };
+  int ret;
+
+  event_del(pb_timer_ev);
+
+#ifdef HAVE_TIMERFD
+  ret = timerfd_settime(pb_timer_fd, 0, &tick, NULL);
+#else
+  ret = timer_settime(pb_timer, 0, &tick, NULL);
+#endif
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not disarm playback timer: %s\n", strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/* --------------------------------- Playback ------------------------------- */
+
+static void
+input_watermark_cb(struct spsc_ringbuffer *ring, enum spsc_ringbuffer_watermark mark, void *arg)
+{
+  // The high watermark comes from the producer, which doesn't hold our lock
+  if (mark == SPSC_RINGBUFFER_LOW)
+    pb_input_low = true;
+  else
+    pb_input_watermark_cb(ring, mark, pb_input_watermark_arg);
+}
+
+// Writes nsamples to the outputs, taken from the input in slices. If the input
+// has run dry we write silence, so the devices keep getting a steady stream.
+static void
+playback_write(int nsamples)
+{
+  struct timespec pts;
+  uint8_t *buf;
+  size_t want;
+  size_t len;
+  int n;
+
+  while (nsamples > 0)
+    {
+      want = MIN(nsamples * pb_frame_size, pb_silence_len);
+
+      len = spsc_ringbuffer_read_peek_at(&buf, pb_input_held, want, pb_input);
+      len -= len % pb_frame_size;
+      if (len == 0)
+	{
+	  if (!pb_underrun)
+	    {
+	      DPRINTF(E_WARN, L_PLAYER, "Input underrun at pos %" PRIu64 ", playing silence\n", pb_pos);
+	      pb_underrun = true;
+	      pb_underrun_count++;
+	    }
+
+	  pb_underrun_samples += want / pb_frame_size;
+
+	  buf = pb_silence;
+	  len = want;
+	}
+      else if (pb_underrun)
+	{
+	  DPRINTF(E_INFO, L_PLAYER, "Input resumed at pos %" PRIu64 "\n", pb_pos);
+	  pb_underrun = false;
+	}
+
+      n = len / pb_frame_size;
+      pts = pos_to_pts(pb_pos);
+
+      outputs_write(buf, len, n, &pb_quality, &pts);
+
+      if (buf != pb_silence)
+	pb_input_held += len;
+
+      if (pb_input_held > 0 && !outputs_input_busy())
+	{
+	  spsc_ringbuffer_read_commit(pb_input, pb_input_held);
+	  pb_input_held = 0;
+	}
+
+      pb_pos += n;
+      nsamples -= n;
+    }
+}
+
+static void
+playback_cb(int fd, short what, void *arg)
+{
+  struct timespec skipped;
+  uint64_t overrun;
+  uint64_t nsec;
+  bool low;
+  int ret;
+  int i;
+
+  // Check if we missed any timer expirations
+  overrun = 0;
+#ifdef HAVE_TIMERFD
+  ret = read(pb_timer_fd, &overrun, sizeof(overrun));
+  if (ret <= 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Error reading timer\n");
+      return;
+    }
+
+  if (overrun > 0)
+    overrun--;
+#else
+  ret = timer_getoverrun(pb_timer);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Error getting timer overrun\n");
+      return;
+    }
+
+  overrun = ret;
+#endif
+
+  pthread_mutex_lock(&player_lock);
+
+  if (player_state != PLAY_PLAYING)
+    goto out;
+
+  // If we are too far behind we skip the surplus ticks, and move the clock
+  // forward so the pts keeps matching the real time
+  if (overrun > pb_write_deficit_max)
+    {
+      DPRINTF(E_WARN, L_PLAYER, "Playback timer is %" PRIu64 " ticks behind, skipping %" PRIu64 "\n", overrun, overrun - pb_write_deficit_max);
+
+      nsec = (overrun - pb_write_deficit_max) * player_tick_interval.tv_nsec;
+      skipped.tv_sec = nsec / 1000000000;
+      skipped.tv_nsec = nsec % 1000000000;
+      pb_start = timespec_add(pb_start, skipped);
+
+      overrun = pb_write_deficit_max;
+    }
+
+  for (i = 0; i <= overrun; i++)
+    playback_write(tick_samples());
+
+ out:
+  low = pb_input_low;
+  pb_input_low = false;
+  pthread_mutex_unlock(&player_lock);
+
+  if (low)
+    pb_input_watermark_cb(pb_input, SPSC_RINGBUFFER_LOW, pb_input_watermark_arg);
+}
+
+
+/* ---------------------------- Player thread ------------------------------- */
+
+static void *
+player(void *arg)
+{
+  // The loop must keep running while we are stopped and there are no events
+  event_base_loop(evbase_player, EVLOOP_NO_EXIT_ON_EMPTY);
+
+  pthread_exit(NULL);
+}
+
+
+/* ------------------------------- Interface -------------------------------- */
+
+int
+player_input_set(struct spsc_ringbuffer *ring, struct media_quality *quality)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&player_lock);
+
+  if (player_state != PLAY_STOPPED)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Player input can't be changed during playback\n");
+      goto out;
+    }
+
+  free(pb_silence);
+
+  pb_input = ring;
+  pb_quality = *quality;
+
+  if (ring->watermark_cb && ring->watermark_cb != input_watermark_cb)
+    {
+      pb_input_watermark_cb = ring->watermark_cb;
+      pb_input_watermark_arg = ring->watermark_arg;
+      spsc_ringbuffer_watermarks_set(ring, ring->low_watermark, ring->high_watermark, input_watermark_cb, NULL);
+    }
+  pb_input_low = false;
+  pb_input_held = 0;
+  pb_frame_size = STOB(1, quality->bits_per_sample, quality->channels);
+
+  // Also the max we write to the outputs in one go
+  pb_silence_len = ring->slice_max - ring->slice_max % pb_frame_size;
+  CHECK_NULL(L_PLAYER, pb_silence = calloc(1, pb_silence_len));
+
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock(&player_lock);
+  return ret;
+}
+
+int
+player_get_status(struct player_status *status)
+{
+  memset(status, 0, sizeof(struct player_status));
+
+  pthread_mutex_lock(&player_lock);
+  status->status = player_state;
+  status->pos_ms = pb_quality.sample_rate ? pb_pos * 1000 / pb_quality.sample_rate : 0;
+  pthread_mutex_unlock(&player_lock);
+
+  status->repeat = REPEAT_OFF;
+  status->volume = 100; // Default volume
+  return 0;
+}
+
+int
+player_playback_start(void)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&player_lock);
+
+  if (player_state == PLAY_PLAYING)
+    {
+      ret = 0;
+      goto out;
+    }
+
+  if (!pb_input)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Can't start playback, no input\n");
+      goto out;
+    }
+
+  // When resuming, the clock restarts from where we paused
+  clock_gettime_with_res(CLOCK_MONOTONIC, &pb_start, &player_timer_res);
+  if (player_state != PLAY_PAUSED)
+    {
+      pb_pos = 0;
+      pb_tick_rem = 0;
+      pb_underrun = false;
+    }
+  pb_start_pos = pb_pos;
+
+  ret = pb_timer_start();
+  if (ret < 0)
+    goto out;
+
+  DPRINTF(E_INFO, L_PLAYER, "Playback started (tick interval %ld ms)\n", player_tick_interval.tv_nsec / 1000000);
+
+  player_state = PLAY_PLAYING;
+
+ out:
+  pthread_mutex_unlock(&player_lock);
+  return ret;
+}
+
+int
+player_playback_pause(void)
+{
+  pthread_mutex_lock(&player_lock);
+
+  if (player_state == PLAY_PLAYING)
+    {
+      pb_timer_stop();
+      player_state = PLAY_PAUSED;
+    }
+
+  pthread_mutex_unlock(&player_lock);
+  return 0;
+}
+
+int
+player_playback_stop(void)
+{
+  pthread_mutex_lock(&player_lock);
+
+  if (player_state == PLAY_PLAYING)
+    pb_timer_stop();
+
+  if (player_state != PLAY_STOPPED)
+    DPRINTF(E_INFO, L_PLAYER, "Playback stopped at pos %" PRIu64 ", %" PRIu64 " underruns (%" PRIu64 " samples of silence)\n",
+      pb_pos, pb_underrun_count, pb_underrun_samples);
+
+  player_state = PLAY_STOPPED;
+
+  pthread_mutex_unlock(&player_lock);
+  return 0;
+}
+
+// There is no queue, so nothing to skip to
+int
+player_playback_next(void)
+{
+  return 0;
+}
+
+int
+player_playback_prev(void)
+{
+  return 0;
+}
+
+int
+player_device_add(void *device)
+{
+  return 0;
+}
+
+int
+player_device_remove(void *device)
+{
+  return 0;
+}
+
+const char *
+player_pmap(void *p)
+{
+  return "player";
+}
+
+int
+player_init(void)
+{
+  uint64_t interval;
+  int ret;
+
+  player_state = PLAY_STOPPED;
+
+  CHECK_ERR(L_PLAYER, mutex_init(&player_lock));
+
+  // Determine if the resolution of the system timer is > or < the size
+  // of an audio packet. NOTE: this assumes the system clock resolution
+  // is less than one second.
+  if (clock_getres(CLOCK_MONOTONIC, &player_timer_res) < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not get the system timer resolution\n");
+      return -1;
+    }
+
+  if (!cfg_getbool(cfg_getsec(cfg, "general"), "high_resolution_clock"))
+    {
+      DPRINTF(E_INFO, L_PLAYER, "High resolution clock not enabled on this system (res is %ld)\n", player_timer_res.tv_nsec);
+      player_timer_res.tv_nsec = 10 * PLAYER_TICK_INTERVAL * 1000000;
+    }
+
+  // Set the tick interval for the playback timer
+  interval = MAX(player_timer_res.tv_nsec, PLAYER_TICK_INTERVAL * 1000000);
+  player_tick_interval.tv_sec = 0;
+  player_tick_interval.tv_nsec = interval;
+
+  pb_write_deficit_max = (PLAYER_WRITE_BEHIND_MAX * 1000000 / interval);
+
+  CHECK_NULL(L_PLAYER, evbase_player = event_base_new());
+
+#ifdef HAVE_TIMERFD
+  pb_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (pb_timer_fd < 0)
+    {
+      DPRINTF(E_FATAL, L_PLAYER, "Could not create playback timer: %s\n", strerror(errno));
+      goto error_evbase_free;
+    }
+
+  CHECK_NULL(L_PLAYER, pb_timer_ev = event_new(evbase_player, pb_timer_fd, EV_READ | EV_PERSIST, playback_cb, NULL));
+#else
+  ret = timer_create(CLOCK_MONOTONIC, NULL, &pb_timer);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_PLAYER, "Could not create playback timer: %s\n", strerror(errno));
+      goto error_evbase_free;
+    }
+
+  CHECK_NULL(L_PLAYER, pb_timer_ev = evsignal_new(evbase_player, SIGALRM, playback_cb, NULL));
+#endif
+
+  ret = outputs_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_PLAYER, "Output initiation failed\n");
+      goto error_timer_free;
+    }
+
+  ret = pthread_create(&tid_player, NULL, player, NULL);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_PLAYER, "Could not spawn player thread: %s\n", strerror(errno));
+      goto error_outputs_deinit;
+    }
+
+  thread_setname(tid_player, "player");
+
+  return 0;
+
+ error_outputs_deinit:
+  outputs_deinit();
+ error_timer_free:
+  event_free(pb_timer_ev);
+#ifdef HAVE_TIMERFD
+  close(pb_timer_fd);
+#else
+  timer_delete(pb_timer);
+#endif
+ error_evbase_free:
+  event_base_free(evbase_player);
+  pthread_mutex_destroy(&player_lock);
+
+  return -1;
+}
+
+void
+player_deinit(void)
+{
+  int ret;
+
+  player_playback_stop();
+
+  event_base_loopbreak(evbase_player);
+
+  ret = pthread_join(tid_player, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not join player thread: %s\n", strerror(errno));
+      return;
+    }
+
+  // With the player thread gone the outputs can be shut down from here
+  outputs_deinit();
+
+  event_free(pb_timer_ev);
+#ifdef HAVE_TIMERFD
+  close(pb_timer_fd);
+#else
+  timer_delete(pb_timer);
+#endif
+
+  free(pb_silence);
+  pb_silence = NULL;
+  pb_input = NULL;
+
+  event_base_free(evbase_player);
+  pthread_mutex_destroy(&player_lock);
+}
@@ -206,6 +206,13 @@ player_raop_verification_kickoff(char **arglist);
 const char *
 player_pmap(void *p);
 
+// Sets the PCM ring that playback reads from, must be called while stopped. Set
+// the ring's watermarks first. The low watermark callback is made from the
+// player thread without the player's lock held, so it may take locks that are
+// also held when calling the player.
+int
+player_input_set(struct spsc_ringbuffer *ring, struct media_quality *quality);
+
 int
 player_init(void);
 
@@ -30,6 +30,7 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 
 #include <gcrypt.h>
 
@@ -39,6 +40,10 @@
 
 #define RTP_HEADER_LEN        12
 #define RTCP_SYNC_PACKET_LEN  20 
+#define RTCP_SYNC_PTP_PACKET_LEN 28
+
+#define RTP_CACHELINE         64
+#define RTP_HUGEPAGE_SIZE     (2 * 1024 * 1024)
 
 // NTP timestamp definitions
 #define FRAC             4294967296. // 2^32 as a double
@@ -64,10 +69,76 @@ ntp_to_timespec(struct ntp_timestamp *ns, struct timespec *ts)
   ts->tv_nsec = (long)((double)ns->frac / (1e-9 * FRAC));
 }
 */
+
+// Allocates the packet data for the whole buffer in one go. With huge pages we
+// first try explicit ones (MAP_HUGETLB), which must have been reserved by the
+// admin, and otherwise ask for transparent huge pages.
+static int
+pktbuf_arena_alloc(struct rtp_session *session, bool hugepages)
+{
+  void *arena;
+  size_t size;
+  int ret;
+
+  session->pktbuf_slot_size = RTP_HEADER_LEN + session->pktbuf_payload_max;
+  session->pktbuf_slot_size = (session->pktbuf_slot_size + RTP_CACHELINE - 1) & ~(size_t)(RTP_CACHELINE - 1);
+
+  size = session->pktbuf_slot_size * session->pktbuf_size;
+
+#ifdef MAP_HUGETLB
+  if (hugepages)
+    {
+      session->pktbuf_arena_size = (size + RTP_HUGEPAGE_SIZE - 1) & ~(size_t)(RTP_HUGEPAGE_SIZE - 1);
+
+      arena = mmap(NULL, session->pktbuf_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (arena != MAP_FAILED)
+	{
+	  session->pktbuf_arena = arena;
+	  session->pktbuf_arena_mmap = true;
+	  return 0;
+	}
+
+      DPRINTF(E_DBG, L_PLAYER, "No huge pages for RTP packet buffer (%s), using transparent huge pages\n", strerror(errno));
+    }
+#endif
+
+  session->pktbuf_arena_size = size;
+
+  ret = posix_memalign(&arena, hugepages ? RTP_HUGEPAGE_SIZE : RTP_CACHELINE, size);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory for RTP packet buffer of %zu bytes\n", size);
+      return -1;
+    }
+
+#ifdef MADV_HUGEPAGE
+  if (hugepages)
+    madvise(arena, size, MADV_HUGEPAGE);
+#endif
+
+  session->pktbuf_arena = arena;
+  session->pktbuf_arena_mmap = false;
+  return 0;
+}
+
+static void
+pktbuf_arena_free(struct rtp_session *session)
+{
+  if (!session->pktbuf_arena)
+    return;
+
+  if (session->pktbuf_arena_mmap)
+    munmap(session->pktbuf_arena, session->pktbuf_arena_size);
+  else
+    free(session->pktbuf_arena);
+}
+
 struct rtp_session *
-rtp_session_new(struct media_quality *quality, int pktbuf_size, int sync_each_nsamples)
+rtp_session_new(struct media_quality *quality, int pktbuf_size, size_t payload_max, bool hugepages, int sync_each_nsamples)
 {
   struct rtp_session *session;
+  struct rtp_packet *pkt;
+  int i;
 
   CHECK_NULL(L_PLAYER, session = calloc(1, sizeof(struct rtp_session)));
 
@@ -80,8 +151,27 @@ rtp_session_new(struct media_quality *quality, int pktbuf_size, int sync_each_ns
     session->quality = *quality;
 
   session->pktbuf_size = pktbuf_size;
+  session->pktbuf_payload_max = payload_max;
   CHECK_NULL(L_PLAYER, session->pktbuf = calloc(session->pktbuf_size, sizeof(struct rtp_packet)));
 
+  if (pktbuf_arena_alloc(session, hugepages) < 0)
+    {
+      free(session->pktbuf);
+      free(session);
+      return NULL;
+    }
+
+  // The slots are fixed, so the packets can point into the arena right away
+  for (i = 0; i < session->pktbuf_size; i++)
+    {
+      pkt = &session->pktbuf[i];
+      pkt->data = session->pktbuf_arena + i * session->pktbuf_slot_size;
+      pkt->data_size = session->pktbuf_slot_size;
+      pkt->header = pkt->data;
+      pkt->payload = pkt->data + RTP_HEADER_LEN;
+      pkt->payload_size = session->pktbuf_slot_size - RTP_HEADER_LEN;
+    }
+
   if (sync_each_nsamples > 0)
     session->sync_each_nsamples = sync_each_nsamples;
   else if (sync_each_nsamples == 0 && quality)
@@ -93,13 +183,10 @@ rtp_session_new(struct media_quality *quality, int pktbuf_size, int sync_each_ns
 void
 rtp_session_free(struct rtp_session *session)
 {
-  int i;
-
-  for (i = 0; i < session->pktbuf_size; i++)
-    free(session->pktbuf[i].data);
-
+  pktbuf_arena_free(session);
   free(session->pktbuf);
   free(session->sync_packet_next.data);
+  free(session->sync_packet_ptp_next.data);
   free(session);
 }
 
@@ -111,7 +198,7 @@ rtp_session_flush(struct rtp_session *session)
 }
 
 // We don't want the caller to malloc payload for every packet, so instead we
-// will get him a packet from the ring buffer, thus in most cases reusing memory
+// will get him a packet from the ring buffer, which has a fixed slot for it
 struct rtp_packet *
 rtp_packet_next(struct rtp_session *session, size_t payload_len, int samples, char payload_type, char marker_bit)
 {
@@ -122,18 +209,11 @@ rtp_packet_next(struct rtp_session *session, size_t payload_len, int samples, ch
 
   pkt = &session->pktbuf[session->pktbuf_next];
 
-  // When first filling up the buffer we malloc, but otherwise the existing data
-  // allocation should in most cases suffice. If not, we realloc.
-  if (!pkt->data || payload_len > pkt->payload_size)
+  // The slot size was set by the payload_max given to rtp_session_new()
+  if (payload_len > pkt->payload_size)
     {
-      pkt->data_size = RTP_HEADER_LEN + payload_len;
-      if (!pkt->data)
-	CHECK_NULL(L_PLAYER, pkt->data = malloc(pkt->data_size));
-      else
-	CHECK_NULL(L_PLAYER, pkt->data = realloc(pkt->data, pkt->data_size));
-      pkt->header  = pkt->data;
-      pkt->payload = pkt->data + RTP_HEADER_LEN;
-      pkt->payload_size = payload_len;
+      DPRINTF(E_LOG, L_PLAYER, "Bug! RTP payload of %zu bytes exceeds max of %zu\n", payload_len, pkt->payload_size);
+      return NULL;
     }
 
   pkt->samples     = samples;
@@ -141,6 +221,8 @@ rtp_packet_next(struct rtp_session *session, size_t payload_len, int samples, ch
   pkt->payload_len = payload_len;
   pkt->data_len    = RTP_HEADER_LEN + payload_len;
   pkt->seqnum      = session->seqnum;
+  pkt->primary     = pkt->payload;
+  pkt->primary_len = payload_len;
 
 
   // The RTP header is made of these 12 bytes (RFC 3550):
@@ -168,6 +250,73 @@ rtp_packet_next(struct rtp_session *session, size_t payload_len, int samples, ch
   return pkt;
 }
 
+struct rtp_packet *
+rtp_packet_red_next(struct rtp_session *session, size_t primary_len, int samples, char payload_type, char primary_type, int depth, size_t payload_max)
+{
+  struct rtp_packet *red[RTP_RED_DEPTH_MAX];
+  uint32_t offset[RTP_RED_DEPTH_MAX];
+  struct rtp_packet *prev;
+  struct rtp_packet *pkt;
+  uint32_t rtptime;
+  uint32_t hdr;
+  uint8_t *ptr;
+  size_t len;
+  int n;
+  int i;
+
+  // The primary has a 1 byte header, each redundant block a 4 byte header
+  len = 1 + primary_len;
+  n = 0;
+  for (i = 1; i <= MIN(depth, RTP_RED_DEPTH_MAX) && i <= session->pktbuf_len; i++)
+    {
+      prev = rtp_packet_get(session, session->seqnum - i);
+      if (!prev || prev->primary_len > RTP_RED_BLOCK_LEN_MAX || len + 4 + prev->primary_len > payload_max)
+	continue;
+
+      memcpy(&rtptime, prev->header + 4, 4);
+      offset[n] = session->pos - be32toh(rtptime);
+      if (offset[n] > RTP_RED_OFFSET_MAX)
+	continue;
+
+      red[n] = prev;
+      len += 4 + prev->primary_len;
+      n++;
+    }
+
+  pkt = rtp_packet_next(session, len, samples, payload_type, 0);
+  if (!pkt)
+    return NULL;
+
+  // The block headers are (RFC 2198):
+  //    0                   1                    2                   3
+  //    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+  //   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  //   |F|   block PT  |  timestamp offset         |   block length    |
+  //   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  // F is 1 for the redundant blocks, which must be in order, oldest first. The
+  // header of the primary is just F = 0 and the block PT.
+  ptr = pkt->payload;
+  for (i = n - 1; i >= 0; i--)
+    {
+      hdr = htobe32((1U << 31) | ((uint32_t)(primary_type & 0x7f) << 24) | (offset[i] << 10) | red[i]->primary_len);
+      memcpy(ptr, &hdr, 4);
+      ptr += 4;
+    }
+
+  *ptr++ = primary_type & 0x7f;
+
+  for (i = n - 1; i >= 0; i--)
+    {
+      memcpy(ptr, red[i]->primary, red[i]->primary_len);
+      ptr += red[i]->primary_len;
+    }
+
+  pkt->primary = ptr;
+  pkt->primary_len = primary_len;
+
+  return pkt;
+}
+
 void
 rtp_packet_commit(struct rtp_session *session, struct rtp_packet *pkt)
 {
@@ -274,6 +423,43 @@ rtp_sync_packet_next(struct rtp_session *session, struct rtcp_timestamp cur_stam
   return &session->sync_packet_next;
 }
 
+// Like the above, but for receivers using PTP. The time is in the PTP timescale
+// as 32.32 fixed point seconds, and is followed by the master clock id.
+struct rtp_packet *
+rtp_sync_packet_ptp_next(struct rtp_session *session, struct rtcp_timestamp cur_stamp, char type, uint64_t clock_id)
+{
+  struct rtp_packet *pkt = &session->sync_packet_ptp_next;
+  uint64_t cur_ts;
+  uint32_t rtptime;
+  uint32_t cur_pos;
+
+  if (!pkt->data)
+    {
+      CHECK_NULL(L_PLAYER, pkt->data = malloc(RTCP_SYNC_PTP_PACKET_LEN));
+      pkt->data_len = RTCP_SYNC_PTP_PACKET_LEN;
+    }
+
+  pkt->data[0] = type;
+  pkt->data[1] = 0xd7;
+  pkt->data[2] = 0x00;
+  pkt->data[3] = 0x06;
+
+  cur_pos = htobe32(cur_stamp.pos);
+  memcpy(pkt->data + 4, &cur_pos, 4);
+
+  cur_ts = ((uint64_t)cur_stamp.ts.tv_sec << 32) | (((uint64_t)cur_stamp.ts.tv_nsec << 32) / 1000000000);
+  cur_ts = htobe64(cur_ts);
+  memcpy(pkt->data + 8, &cur_ts, 8);
+
+  rtptime = htobe32(session->pos);
+  memcpy(pkt->data + 16, &rtptime, 4);
+
+  clock_id = htobe64(clock_id);
+  memcpy(pkt->data + 20, &clock_id, 8);
+
+  return pkt;
+}
+
 int
 rtcp_packet_parse(struct rtcp_packet *pkt, uint8_t *data, size_t size)
 {
@@ -5,6 +5,11 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+// RFC 2198 redundant audio, see rtp_packet_red_next()
+#define RTP_RED_DEPTH_MAX     4
+#define RTP_RED_BLOCK_LEN_MAX 1023
+#define RTP_RED_OFFSET_MAX    16383
+
 struct rtcp_timestamp
 {
   uint32_t pos;
@@ -29,6 +34,9 @@ struct rtp_packet
   size_t payload_size; // Size of allocated memory for RTP payload
   size_t payload_len;  // Length of payload (must of course not exceed size)
 
+  uint8_t *primary;    // Pointer to the primary encoding, which is the whole
+  size_t primary_len;  // payload unless the packet is RFC 2198 redundant audio
+
   uint8_t *data;       // Pointer to the complete packet data
   size_t data_size;    // Size of packet data
   size_t data_len;     // Length of actual packet data
@@ -97,17 +105,36 @@ struct rtp_session
   size_t pktbuf_next;
   size_t pktbuf_size;
   size_t pktbuf_len;
+  // The packet data lives in one contiguous arena, where each packet has a
+  // cache line aligned slot with room for the largest payload
+  uint8_t *pktbuf_arena;
+  size_t pktbuf_arena_size;
+  size_t pktbuf_slot_size;
+  size_t pktbuf_payload_max;
+  bool pktbuf_arena_mmap;
 
   // Number of samples to elapse before sync'ing. If 0 we set it to the s/r, so
   // we sync once a second. If negative we won't sync.
   int sync_each_nsamples;
   int sync_counter;
   struct rtp_packet sync_packet_next;
+  struct rtp_packet sync_packet_ptp_next;
 };
 
 
+/* Creates an RTP session with a retransmit buffer of pktbuf_size packets. The
+ * buffer is allocated up front, so payload_max must be the largest payload the
+ * caller will ask rtp_packet_next() for.
+ *
+ * @in  quality             Quality of the audio in the session
+ * @in  pktbuf_size         Number of packets in the retransmit buffer
+ * @in  payload_max         Max length of a packet payload
+ * @in  hugepages           Try to put the buffer on huge pages
+ * @in  sync_each_nsamples  Samples between sync packets, 0 means once a second
+ * @return                  New session, or NULL on error
+ */
 struct rtp_session *
-rtp_session_new(struct media_quality *quality, int pktbuf_size, int sync_each_nsamples);
+rtp_session_new(struct media_quality *quality, int pktbuf_size, size_t payload_max, bool hugepages, int sync_each_nsamples);
 
 void
 rtp_session_free(struct rtp_session *session);
@@ -116,19 +143,40 @@ void
 rtp_session_flush(struct rtp_session *session);
 
 
-/* Gets the next packet from the packet buffer, pkt->payload will be allocated
- * to a size of payload_len (or larger).
+/* Gets the next packet from the packet buffer, pkt->payload will have room for
+ * payload_len (or more).
  *
  * @in  session       RTP session
  * @in  payload_len   Length of payload the packet needs to hold
  * @in  samples       Number of samples in packet
  * @in  payload_type  RTP payload type
  * @in  marker_bit    Marker bit, see RFC3551
- * @return            Pointer to the next packet in the packet buffer
+ * @return            Pointer to the next packet in the packet buffer, NULL if
+ *                    payload_len is larger than the session's payload_max
  */
 struct rtp_packet *
 rtp_packet_next(struct rtp_session *session, size_t payload_len, int samples, char payload_type, char marker_bit);
 
+/* Like rtp_packet_next(), but the payload is RFC 2198 redundant audio: headers
+ * for the blocks, then copies of the primary encodings of up to depth previous
+ * packets, and last the primary encoding of this packet. Previous packets are
+ * taken newest first, as long as the payload stays within payload_max, and
+ * skipped if they are not in the buffer or too large for a block. The caller
+ * writes the primary encoding to pkt->primary.
+ *
+ * @in  session       RTP session
+ * @in  primary_len   Length of the primary encoding
+ * @in  samples       Number of samples in packet
+ * @in  payload_type  RTP payload type of the redundant audio
+ * @in  primary_type  Payload type of the blocks, e.g. the audio codec
+ * @in  depth         Max number of redundant blocks, max RTP_RED_DEPTH_MAX
+ * @in  payload_max   Max length of the payload including redundant blocks
+ * @return            Pointer to the next packet in the packet buffer, NULL if
+ *                    the payload is larger than the session's payload_max
+ */
+struct rtp_packet *
+rtp_packet_red_next(struct rtp_session *session, size_t primary_len, int samples, char payload_type, char primary_type, int depth, size_t payload_max);
+
 /* Call this after finalizing a packet, i.e. writing the payload and possibly
  * sending. Registers the packet as final, i.e. it can now be retrieved with
  * rtp_packet_get() for retransmission, if required. Also advances RTP position
@@ -154,6 +202,9 @@ rtp_sync_is_time(struct rtp_session *session);
 struct rtp_packet *
 rtp_sync_packet_next(struct rtp_session *session, struct rtcp_timestamp cur_stamp, char type);
 
+struct rtp_packet *
+rtp_sync_packet_ptp_next(struct rtp_session *session, struct rtcp_timestamp cur_stamp, char type, uint64_t clock_id);
+
 int
 rtcp_packet_parse(struct rtcp_packet *pkt, uint8_t *data, size_t size);
 